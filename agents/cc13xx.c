@@ -17,6 +17,9 @@
 #include <agent/flash.h>
 #include "cc13xx-romapi.h"
 
+#define FLASH_BASE	0x00000000
+#define FLASH_SIZE	0x00020000
+
 int flash_agent_setup(flash_agent *agent) {
 	return ERR_NONE;
 }
@@ -50,19 +53,33 @@ int flash_agent_write(uint32_t flash_addr, const void *data, uint32_t length) {
 }
 
 
+static int flash_agent_sector(uint32_t flash_addr, uint32_t *base, uint32_t *size) {
+	if ((flash_addr - FLASH_BASE) >= FLASH_SIZE) {
+		return ERR_INVALID;
+	}
+	*base = flash_addr & (~0xFFF);
+	*size = 0x1000;
+	return ERR_NONE;
+}
+
+#define FLASH_WRITE_SIZE 0x1000
+#define FLASH_NO_STREAM // the 4K buffer holds one write
+
+#include "flash-common.c"
+
 int flash_agent_ioctl(uint32_t op, void *ptr, uint32_t arg0, uint32_t arg1) {
-	return ERR_INVALID;
+	return flash_agent_common_ioctl(op, ptr, arg0, arg1);
 }
 
 const flash_agent __attribute((section(".vectors"))) FlashAgent = {
 	.magic =	AGENT_MAGIC,
 	.version =	AGENT_VERSION,
-	.flags =	0,
+	.flags =	FLAG_CRC | FLAG_GEOMETRY,
 	.load_addr =	0x20000400,
 	.data_addr =	0x20001000,
 	.data_size =	0x1000,
-	.flash_addr =	0x00000000,
-	.flash_size =	0x00020000,
+	.flash_addr =	FLASH_BASE,
+	.flash_size =	FLASH_SIZE,
 	.setup =	flash_agent_setup,
 	.erase =	flash_agent_erase,
 	.write =	flash_agent_write,
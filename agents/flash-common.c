@@ -0,0 +1,60 @@
+// agents/flash-common.c
+//
+// Copyright 2023 Brian Swetland <swetland@frotz.net>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// The ioctls shared by the flash agents: include after flash_agent_write()
+// and flash_agent_sector() (see flash-crc.c), having defined
+//
+// FLASH_WRITE_SIZE
+//   the alignment (in bytes) flash_agent_write() needs
+// FLASH_AGENT_MAP
+//   if flash is not simply readable where it is, and flash_agent_map()
+//   (see flash-crc.c) is provided
+// FLASH_NO_STREAM
+//   if the buffer is too small to stream through (no FLAG_STREAM)
+//
+// then pass the ops flash_agent_ioctl() does not handle itself
+// to flash_agent_common_ioctl()
+
+#ifndef FLASH_AGENT_MAP
+static const void *flash_agent_map(uint32_t flash_addr) {
+	return (void*) flash_addr;
+}
+#endif
+
+#include "flash-crc.c"
+#include "flash-geometry.c"
+#ifndef FLASH_NO_STREAM
+#include "flash-stream.c"
+#endif
+
+static int flash_agent_common_ioctl(uint32_t op, void *ptr,
+		uint32_t arg0, uint32_t arg1) {
+#ifndef FLASH_NO_STREAM
+	if ((op == IOCTL_STREAM) || (op == IOCTL_STREAM_LZ4)) {
+		return flash_agent_stream(ptr, arg0, arg1, op == IOCTL_STREAM_LZ4);
+	}
+#endif
+	if (op == IOCTL_SECTOR_CRC) {
+		return flash_agent_sector_crc(ptr, arg0, arg1);
+	}
+	if (op == IOCTL_CRC) {
+		return flash_agent_crc(ptr, arg0, arg1);
+	}
+	if (op == IOCTL_GEOMETRY) {
+		return flash_agent_geometry(ptr, arg0, arg1);
+	}
+	return ERR_INVALID;
+}
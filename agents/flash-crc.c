@@ -0,0 +1,60 @@
+// agents/flash-crc.c
+//
+// Copyright 2023 Brian Swetland <swetland@frotz.net>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// IOCTL_SECTOR_CRC and IOCTL_CRC for agents that set FLAG_CRC (included
+// by flash-common.c), which need
+//
+// flash_agent_sector(addr, &base, &size)
+//   the erase sector containing addr (ERR_INVALID if none)
+// flash_agent_map(addr)
+//   make flash readable (if it is not always), and return where
+//   addr may be read from
+
+#include <agent/crc32.h>
+
+static int flash_agent_sector_crc(uint32_t *out,
+		uint32_t flash_addr, uint32_t length) {
+	uint32_t end = flash_addr + length;
+	uint32_t max = out[0];
+	uint32_t count = 0;
+	while ((flash_addr < end) && (count < max)) {
+		uint32_t base, size;
+		if (flash_agent_sector(flash_addr, &base, &size)) {
+			return ERR_INVALID;
+		}
+		out[1 + count * 3] = base;
+		out[2 + count * 3] = size;
+		out[3 + count * 3] = flash_crc32(0, flash_agent_map(base), size);
+		count++;
+		flash_addr = base + size;
+	}
+	out[0] = count;
+	return ERR_NONE;
+}
+
+static int flash_agent_crc(uint32_t *out,
+		uint32_t flash_addr, uint32_t length) {
+	uint32_t base, size;
+	if (length == 0) {
+		return ERR_INVALID;
+	}
+	if (flash_agent_sector(flash_addr, &base, &size) ||
+		flash_agent_sector(flash_addr + length - 1, &base, &size)) {
+		return ERR_INVALID;
+	}
+	out[0] = flash_crc32(0, flash_agent_map(flash_addr), length);
+	return ERR_NONE;
+}
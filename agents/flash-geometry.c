@@ -0,0 +1,53 @@
+// agents/flash-geometry.c
+//
+// Copyright 2023 Brian Swetland <swetland@frotz.net>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// IOCTL_GEOMETRY for agents that set FLAG_GEOMETRY (included by
+// flash-common.c), which needs flash_agent_sector() (see flash-crc.c)
+// and FLASH_WRITE_SIZE, the alignment (in bytes) flash_agent_write() needs
+
+static int flash_agent_geometry(uint32_t *out,
+		uint32_t flash_addr, uint32_t length) {
+	flash_region *region = (void*) (out + 1);
+	uint32_t max = out[0];
+	uint32_t count = 0;
+	while (length > 0) {
+		uint32_t base, size;
+		if (flash_agent_sector(flash_addr, &base, &size)) {
+			return ERR_INVALID;
+		}
+		flash_region *last = region + count - 1;
+		if ((count > 0) && (last->sector_size == size) &&
+			((last->base + last->sector_size * last->sector_count) == base)) {
+			last->sector_count++;
+		} else if (count < max) {
+			region[count].base = base;
+			region[count].sector_size = size;
+			region[count].sector_count = 1;
+			region[count].write_size = FLASH_WRITE_SIZE;
+			count++;
+		} else {
+			break;
+		}
+		uint32_t step = base + size - flash_addr;
+		if (step >= length) {
+			break;
+		}
+		flash_addr += step;
+		length -= step;
+	}
+	out[0] = count;
+	return ERR_NONE;
+}
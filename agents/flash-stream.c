@@ -0,0 +1,49 @@
+// agents/flash-stream.c
+//
+// Copyright 2023 Brian Swetland <swetland@frotz.net>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// IOCTL_STREAM (and IOCTL_STREAM_LZ4, if lz4) for agents that set
+// FLAG_STREAM (and FLAG_LZ4), included by flash-common.c
+
+#include <agent/lz4.h>
+
+static int flash_agent_stream(volatile flash_agent *agent,
+		uint32_t flash_addr, uint32_t length, int lz4) {
+	uint32_t chunk = agent->data_size / (lz4 ? 4 : 2);
+	uint8_t *stage = (void*) (agent->data_addr + 2 * chunk);
+	uint32_t n = 0;
+	while (length > 0) {
+		uint32_t xfer = (length > chunk) ? chunk : length;
+		// wait for the host to download chunk n
+		while (agent->stream_host == n) ;
+		uint8_t *data = (void*) (agent->data_addr + (n & 1) * chunk);
+		uint32_t packed = lz4 ? agent->stream_len[n & 1] : 0;
+		if (packed != 0) {
+			if ((packed > chunk) ||
+				lz4_decompress(data, packed, stage, xfer)) {
+				return ERR_INVALID;
+			}
+			data = stage;
+		}
+		int status = flash_agent_write(flash_addr, data, xfer);
+		if (status != ERR_NONE) {
+			return status;
+		}
+		agent->stream_done = ++n;
+		flash_addr += xfer;
+		length -= xfer;
+	}
+	return ERR_NONE;
+}
@@ -41,6 +41,8 @@
 #define SPIFI_MCMD		0x40003018 // Memory Command
 #define SPIFI_STAT		0x4000301C // Status
 
+#define SPIFI_MEM_BASE		0x14000000 // flash, in memory mode
+
 #define CTRL_TIMEOUT(n)		((n) & 0xFFFF)
 #define CTRL_CSHIGH(n)		(((n) & 0xF) << 16) // Minimum /CS high time (serclks - 1)
 #define CTRL_D_PRFTCH_DIS	(1 << 21) // Disable Prefetch of Data
@@ -206,16 +208,36 @@ int flash_agent_write(uint32_t flash_addr, const void *data, uint32_t length) {
 	return ERR_NONE;
 }
 
+static int flash_agent_sector(uint32_t flash_addr, uint32_t *base, uint32_t *size) {
+	if ((flash_addr - FLASH_BASE) >= FLASH_SIZE) {
+		return ERR_INVALID;
+	}
+	*base = flash_addr & (~0xFFF);
+	*size = 0x1000;
+	return ERR_NONE;
+}
+
+// read through the memory mapped window
+static const void *flash_agent_map(uint32_t flash_addr) {
+	writel(CMD_FF_SERIAL | CMD_FR_OP_3B | CMD_OPCODE(CMD_READ_DATA), SPIFI_MCMD);
+	return (void*) (flash_addr + SPIFI_MEM_BASE);
+}
+
+#define FLASH_WRITE_SIZE 0x1000
+#define FLASH_AGENT_MAP
+
+#include "flash-common.c"
+
 int flash_agent_ioctl(uint32_t op, void *ptr, uint32_t arg0, uint32_t arg1) {
-	return ERR_INVALID;
+	return flash_agent_common_ioctl(op, ptr, arg0, arg1);
 }
 
 const flash_agent __attribute((section(".vectors"))) FlashAgent = {
 	.magic =	AGENT_MAGIC,
 	.version =	AGENT_VERSION,
-	.flags =	0,
+	.flags =	FLAG_STREAM | FLAG_CRC | FLAG_GEOMETRY | FLAG_LZ4 | FLAG_ALIAS,
 	.load_addr =	LOADADDR,
-	.data_addr =	LOADADDR + 0x400,
+	.data_addr =	LOADADDR + 0x800,
 	.data_size =	0x8000,
 	.flash_addr =	FLASH_BASE,
 	.flash_size =	FLASH_SIZE,
@@ -223,4 +245,5 @@ const flash_agent __attribute((section(".vectors"))) FlashAgent = {
 	.erase =	flash_agent_erase,
 	.write =	flash_agent_write,
 	.ioctl =	flash_agent_ioctl,
+	.flash_alias =	SPIFI_MEM_BASE,
 };
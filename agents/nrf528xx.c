@@ -107,16 +107,29 @@ done:
 	return status;
 }
 
+static int flash_agent_sector(uint32_t flash_addr, uint32_t *base, uint32_t *size) {
+	if (flash_addr >= FLASH_SIZE) {
+		return ERR_INVALID;
+	}
+	*base = flash_addr & (~(FLASH_PAGE_SIZE - 1));
+	*size = FLASH_PAGE_SIZE;
+	return ERR_NONE;
+}
+
+#define FLASH_WRITE_SIZE 4
+
+#include "flash-common.c"
+
 int flash_agent_ioctl(uint32_t op, void *ptr, uint32_t arg0, uint32_t arg1) {
-	return ERR_INVALID;
+	return flash_agent_common_ioctl(op, ptr, arg0, arg1);
 }
 
 const flash_agent __attribute((section(".vectors"))) FlashAgent = {
 	.magic =	AGENT_MAGIC,
 	.version =	AGENT_VERSION,
-	.flags =	0,
+	.flags =	FLAG_STREAM | FLAG_CRC | FLAG_GEOMETRY | FLAG_LZ4,
 	.load_addr =	LOADADDR,
-	.data_addr =	LOADADDR + 0x400,
+	.data_addr =	LOADADDR + 0x800,
 	.data_size =	0x4000,
 	.flash_addr =	FLASH_BASE,
 	.flash_size =	0,
@@ -26,8 +26,24 @@ static unsigned FLASH_BLOCK_SIZE = 256;
 static unsigned FLASH_PAGE_SIZE = 4096;
 static unsigned FLASH_SIZE = 4 * 1024 * 1024;
 
+// all of the serial flash that can be mapped for XIP
+#define FLASH_MAX_SIZE (16 * 1024 * 1024)
+
 #define FLASH_XIP_BASE 0x10000000
 
+#define XIP_SSI_SR		0x18000028
+#define XIP_SSI_SR_TFNF		(1 << 1) // tx fifo not full
+#define XIP_SSI_SR_RFNE		(1 << 3) // rx fifo not empty
+#define XIP_SSI_DR0		0x18000060
+
+#define IO_QSPI_SS_CTRL		0x4001800C
+#define IO_QSPI_OUTOVER_MASK	(3 << 8)
+#define IO_QSPI_OUTOVER_LOW	(2 << 8)
+#define IO_QSPI_OUTOVER_HIGH	(3 << 8)
+
+#define CMD_READ_JEDEC_ID	0x9F
+#define CMD_READ_SFDP		0x5A
+
 #define CODE(c1, c2) (((c2) << 8) | (c1))
 
 #define ROM_LOOKUP_FN_PTR 0x18
@@ -52,6 +68,64 @@ static void (*_flash_enter_xip)(void);
 // erase: addr and count must be 4096 aligned
 // write: addr and len must be 256 aligned 
 
+static void flash_cs(uint32_t level) {
+	writel((readl(IO_QSPI_SS_CTRL) & (~IO_QSPI_OUTOVER_MASK)) | level,
+		IO_QSPI_SS_CTRL);
+}
+
+// Send len bytes from buf to the serial flash while replacing them
+// with the bytes received, with the SSI in the serial mode the ROM
+// leaves it in after _flash_exit_xip().
+static void flash_cmd(uint8_t *buf, uint32_t len) {
+	uint32_t tx = 0, rx = 0;
+	flash_cs(IO_QSPI_OUTOVER_LOW);
+	while (rx < len) {
+		uint32_t sr = readl(XIP_SSI_SR);
+		// keep within the 16 entry rx fifo
+		if ((sr & XIP_SSI_SR_TFNF) && (tx < len) && ((tx - rx) < 14)) {
+			writel(buf[tx++], XIP_SSI_DR0);
+		}
+		if (sr & XIP_SSI_SR_RFNE) {
+			buf[rx++] = readl(XIP_SSI_DR0);
+		}
+	}
+	flash_cs(IO_QSPI_OUTOVER_HIGH);
+}
+
+// read 4 bytes of SFDP data at addr
+static uint32_t flash_sfdp(uint32_t addr) {
+	uint8_t buf[9] = {
+		CMD_READ_SFDP, addr >> 16, addr >> 8, addr, 0,
+	};
+	flash_cmd(buf, 9);
+	return buf[5] | (buf[6] << 8) | (buf[7] << 16) | (buf[8] << 24);
+}
+
+// The size in the SFDP basic flash parameter table (density, in
+// bits), if the part has one, or else the capacity byte of the
+// JEDEC ID (log2 of the size in bytes), or 0 if neither makes sense.
+static uint32_t flash_probe_size(void) {
+	if (flash_sfdp(0) == 0x50444653) { // "SFDP"
+		// the first parameter header is the basic table's
+		uint32_t table = flash_sfdp(12) & 0xFFFFFF;
+		uint32_t density = flash_sfdp(table + 4);
+		if (density & 0x80000000) {
+			density &= 0x7FFFFFFF;
+			if ((density >= 19) && (density <= 34)) {
+				return 1U << (density - 3);
+			}
+		} else if (density >= 0x7FFFF) {
+			return (density >> 3) + 1;
+		}
+	}
+	uint8_t id[4] = { CMD_READ_JEDEC_ID, };
+	flash_cmd(id, 4);
+	if ((id[3] >= 16) && (id[3] <= 31)) {
+		return 1U << id[3];
+	}
+	return 0;
+}
+
 int flash_agent_setup(flash_agent *agent) {
 	// TODO - validate part ID
 	if (0) {
@@ -66,7 +140,14 @@ int flash_agent_setup(flash_agent *agent) {
 	_flash_flush_cache = lookup_fn(CODE('F','C'));
 	_flash_enter_xip = lookup_fn(CODE('C','X'));
 
-	// TODO: obtain from spi flash	
+	_flash_connect();
+	_flash_exit_xip();
+	uint32_t size = flash_probe_size();
+	_flash_flush_cache();
+	_flash_enter_xip();
+	if (size != 0) {
+		FLASH_SIZE = (size > FLASH_MAX_SIZE) ? FLASH_MAX_SIZE : size;
+	}
 	agent->flash_size = FLASH_SIZE;
 
 	return ERR_NONE;
@@ -127,16 +208,39 @@ int flash_agent_write(uint32_t flash_addr, const void *data, uint32_t length) {
 	return ERR_NONE;
 }
 
+static int flash_agent_sector(uint32_t flash_addr, uint32_t *base, uint32_t *size) {
+	if (flash_addr >= FLASH_SIZE) {
+		return ERR_INVALID;
+	}
+	*base = flash_addr & (~(FLASH_PAGE_SIZE - 1));
+	*size = FLASH_PAGE_SIZE;
+	return ERR_NONE;
+}
+
+// XIP may not be set up yet, after reset-stop
+static const void *flash_agent_map(uint32_t flash_addr) {
+	_flash_connect();
+	_flash_exit_xip();
+	_flash_flush_cache();
+	_flash_enter_xip();
+	return (void*) (flash_addr + FLASH_XIP_BASE);
+}
+
+#define FLASH_WRITE_SIZE FLASH_BLOCK_SIZE
+#define FLASH_AGENT_MAP
+
+#include "flash-common.c"
+
 int flash_agent_ioctl(uint32_t op, void *ptr, uint32_t arg0, uint32_t arg1) {
-	return ERR_INVALID;
+	return flash_agent_common_ioctl(op, ptr, arg0, arg1);
 }
 
 const flash_agent __attribute((section(".vectors"))) FlashAgent = {
 	.magic =	AGENT_MAGIC,
 	.version =	AGENT_VERSION,
-	.flags =	0,
+	.flags =	FLAG_STREAM | FLAG_CRC | FLAG_GEOMETRY | FLAG_LZ4 | FLAG_ALIAS | FLAG_WSZ_256B,
 	.load_addr =	LOADADDR,
-	.data_addr =	LOADADDR + 0x400,
+	.data_addr =	LOADADDR + 0x1000,
 	.data_size =	0x4000,
 	.flash_addr =	FLASH_BASE,
 	.flash_size =	0,
@@ -144,4 +248,5 @@ const flash_agent __attribute((section(".vectors"))) FlashAgent = {
 	.erase =	flash_agent_erase,
 	.write =	flash_agent_write,
 	.ioctl =	flash_agent_ioctl,
+	.flash_alias =	FLASH_XIP_BASE,
 };
@@ -53,6 +53,7 @@
 #define FLASH_AR		(_FLASH_BASE + 0x14)
 
 static unsigned FLASH_PAGE_SIZE = 1024;
+static unsigned FLASH_END = FLASH_BASE + FLASH_SIZE;
 
 int flash_agent_setup(flash_agent *agent) {
 
@@ -73,6 +74,7 @@ int flash_agent_setup(flash_agent *agent) {
 
 	// check flash size
 	agent->flash_size = readw(0x1FFFF7CC) * 1024;
+	FLASH_END = FLASH_BASE + agent->flash_size;
 
 	writel(FLASH_KEYR_KEY1, FLASH_KEYR);
 	writel(FLASH_KEYR_KEY2, FLASH_KEYR);
@@ -134,17 +136,30 @@ int flash_agent_write(uint32_t flash_addr, const void *_data, uint32_t length) {
 	return ERR_NONE;
 }
 
+static int flash_agent_sector(uint32_t flash_addr, uint32_t *base, uint32_t *size) {
+	if ((flash_addr < FLASH_BASE) || (flash_addr >= FLASH_END)) {
+		return ERR_INVALID;
+	}
+	*base = flash_addr & (~(FLASH_PAGE_SIZE - 1));
+	*size = FLASH_PAGE_SIZE;
+	return ERR_NONE;
+}
+
+#define FLASH_WRITE_SIZE 4
+
+#include "flash-common.c"
+
 int flash_agent_ioctl(uint32_t op, void *ptr, uint32_t arg0, uint32_t arg1) {
-	return ERR_INVALID;
+	return flash_agent_common_ioctl(op, ptr, arg0, arg1);
 }
 
 const flash_agent __attribute((section(".vectors"))) FlashAgent = {
 	.magic =	AGENT_MAGIC,
 	.version =	AGENT_VERSION,
-	.flags =	0,
+	.flags =	FLAG_STREAM | FLAG_CRC | FLAG_GEOMETRY | FLAG_LZ4,
 	.load_addr =	LOADADDR,
-	.data_addr =	LOADADDR + 0x400,
-	.data_size =	0x1000,
+	.data_addr =	LOADADDR + 0x800,
+	.data_size =	0xC00, // ends at 0x20001800, for 6K parts
 	.flash_addr =	FLASH_BASE,
 	.flash_size =	FLASH_SIZE,
 	.setup =	flash_agent_setup,
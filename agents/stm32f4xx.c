@@ -3,4 +3,7 @@
 #define FLASH_BASE	0x00000000
 #define FLASH_SIZE	0x00100000
 
+// main flash, which FLASH_BASE aliases when booting from flash
+#define FLASH_ALIAS	0x08000000
+
 #include "stm32fxxx.c"
@@ -121,16 +121,31 @@ int flash_agent_write(uint32_t flash_addr, const void *_data, uint32_t length) {
 	return ERR_NONE;
 }
 
-int flash_agent_ioctl(uint32_t op, void *ptr, uint32_t arg0, uint32_t arg1) {
+static int flash_agent_sector(uint32_t flash_addr, uint32_t *base, uint32_t *size) {
+	for (int n = 0; n < SECTORS; n++) {
+		if (flash_addr < sectors[n + 1]) {
+			*base = sectors[n];
+			*size = sectors[n + 1] - sectors[n];
+			return ERR_NONE;
+		}
+	}
 	return ERR_INVALID;
 }
 
+#define FLASH_WRITE_SIZE 4
+
+#include "flash-common.c"
+
+int flash_agent_ioctl(uint32_t op, void *ptr, uint32_t arg0, uint32_t arg1) {
+	return flash_agent_common_ioctl(op, ptr, arg0, arg1);
+}
+
 const flash_agent __attribute((section(".vectors"))) FlashAgent = {
 	.magic =	AGENT_MAGIC,
 	.version =	AGENT_VERSION,
-	.flags =	0,
+	.flags =	FLAG_STREAM | FLAG_CRC | FLAG_GEOMETRY | FLAG_LZ4 | FLAG_ALIAS,
 	.load_addr =	LOADADDR,
-	.data_addr =	LOADADDR + 0x400,
+	.data_addr =	LOADADDR + 0x800,
 	.data_size =	0x8000,
 	.flash_addr =	FLASH_BASE,
 	.flash_size =	FLASH_SIZE,
@@ -138,4 +153,5 @@ const flash_agent __attribute((section(".vectors"))) FlashAgent = {
 	.erase =	flash_agent_erase,
 	.write =	flash_agent_write,
 	.ioctl =	flash_agent_ioctl,
+	.flash_alias =	FLASH_ALIAS,
 };
@@ -0,0 +1,45 @@
+// agent/crc32.h
+//
+// Copyright 2023 Brian Swetland <swetland@frotz.net>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef _AGENT_CRC32_H_
+#define _AGENT_CRC32_H_
+
+#include <stdint.h>
+
+// CRC-32 (as zlib computes it), shared by the flash agents and
+// the host so both sides agree.  A nibble at a time keeps the
+// table small enough for an agent.
+//
+// crc = flash_crc32(0, data, len), then flash_crc32(crc, more, len)
+
+static uint32_t flash_crc32(uint32_t crc, const void *data, uint32_t len) {
+	static const uint32_t table[16] = {
+		0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC,
+		0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+		0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C,
+		0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C,
+	};
+	const uint8_t *p = data;
+	crc = ~crc;
+	while (len-- > 0) {
+		crc ^= *p++;
+		crc = (crc >> 4) ^ table[crc & 15];
+		crc = (crc >> 4) ^ table[crc & 15];
+	}
+	return ~crc;
+}
+
+#endif
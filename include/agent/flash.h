@@ -33,10 +33,9 @@ typedef struct flash_agent {
 	uint32_t flash_addr;
 	uint32_t flash_size; // bytes
 
-	uint32_t reserved0;
-	uint32_t reserved1;
-	uint32_t reserved2;
-	uint32_t reserved3;
+	uint32_t stream_host; // IOCTL_STREAM mailbox
+	uint32_t stream_done;
+	uint32_t stream_len[2]; // IOCTL_STREAM_LZ4 chunk sizes
 
 #ifdef _AGENT_HOST_
 	uint32_t setup;
@@ -49,8 +48,18 @@ typedef struct flash_agent {
 	int (*write)(uint32_t flash_addr, const void *data, uint32_t length);
 	int (*ioctl)(uint32_t op, void *ptr, uint32_t arg0, uint32_t arg1);
 #endif
+
+	uint32_t flash_alias; // FLAG_ALIAS
 } flash_agent;
 
+// one entry of the IOCTL_GEOMETRY region table
+typedef struct flash_region {
+	uint32_t base;
+	uint32_t sector_size; // bytes, the erase unit
+	uint32_t sector_count;
+	uint32_t write_size; // bytes, the alignment fa.write() needs
+} flash_region;
+
 #ifndef _AGENT_HOST_
 int flash_agent_setup(flash_agent *agent);
 int flash_agent_erase(uint32_t flash_addr, uint32_t length);
@@ -76,10 +85,74 @@ int flash_agent_ioctl(uint32_t op, void *ptr, uint32_t arg0, uint32_t arg1);
 // some parts which require boot ROM initialization of Flash
 // timing registers, etc.
 
+#define FLAG_STREAM		0x00000002
+// The agent supports IOCTL_STREAM (see below).
+
+#define FLAG_CRC		0x00000004
+// The agent supports IOCTL_SECTOR_CRC and IOCTL_CRC (see below).
+
+#define FLAG_LZ4		0x00000008
+// The agent supports IOCTL_STREAM_LZ4 (see below).
+
+#define FLAG_GEOMETRY		0x00000010
+// The agent supports IOCTL_GEOMETRY (see below).
+
+#define FLAG_ALIAS		0x00000020
+// The flash at flash_addr is also mapped at flash_alias (a boot
+// alias or XIP window), which is where images are linked, so the
+// host moves image segments there to flash_addr.
+
+#define IOCTL_STREAM		0x00000001
+// ioctl(IOCTL_STREAM, agent, flash_addr, length)
+// Write length bytes (to erased flash) from the two halves of the
+// data buffer in turn, so the host can download the next chunk
+// while the agent programs the last one.  Chunk n is in half
+// (n & 1) and is data_size / 2 bytes (except maybe the last).
+// The host increments stream_host after each chunk it downloads,
+// and the agent increments stream_done after each it programs,
+// so chunk n may be programmed once stream_host > n, and its
+// half reused once stream_done > n.  Both start at 0.  The agent
+// returns once all chunks are written, or on the first failure.
+// data_size / 2 must meet fa.write()'s alignment needs.
+
+#define IOCTL_SECTOR_CRC	0x00000002
+// ioctl(IOCTL_SECTOR_CRC, out, flash_addr, length)
+// For each erase sector overlapping [flash_addr, flash_addr + length)
+// store { base, size, crc } (the CRC-32 of agent/crc32.h over the
+// whole sector) at out[1...], up to the count the host stores at
+// out[0] (the buffer's capacity), and then the count stored at
+// out[0].  The host asks again from the end of the last sector if
+// it needs more.  out is in the data buffer.
+
+#define IOCTL_CRC		0x00000003
+// ioctl(IOCTL_CRC, out, flash_addr, length)
+// Store the CRC-32 of [flash_addr, flash_addr + length) at out[0],
+// so the host can verify what it wrote without reading it back.
+
+#define IOCTL_STREAM_LZ4	0x00000004
+// ioctl(IOCTL_STREAM_LZ4, agent, flash_addr, length)
+// As IOCTL_STREAM, but chunks are data_size / 4 bytes (except maybe
+// the last), and chunk n arrives in quarter (n & 1) of the data
+// buffer as an LZ4 block (see agent/lz4.h) of stream_len[n & 1]
+// bytes, or uncompressed if that is 0.  The agent decompresses it
+// into the third quarter and programs it from there.  The host sets
+// stream_len[n & 1] before it increments stream_host past n.
+// data_size / 4 must meet fa.write()'s alignment needs.
+
+#define IOCTL_GEOMETRY		0x00000005
+// ioctl(IOCTL_GEOMETRY, out, flash_addr, length)
+// Describe [flash_addr, flash_addr + length) (after setup) as
+// runs of like-sized erase sectors: store a flash_region for each
+// at out[1...], up to the count the host stores at out[0] (the
+// table's capacity), and then the count stored at out[0].  The
+// host asks again from the end of the last region if it needs
+// more.  out is in the data buffer.
+
 
 // Flash agent binaries will be downloaded to device memory at
 // fa.load_addr.  The memory below this address will be used as
 // the stack for method calls.  It should be sized appropriately.
+// The binary (and its bss) must end below fa.data_addr.
 //
 // The fa.magic field will be replaced with 0xbe00be00 (two
 // Thumb BKPT instructions) before download to device.
@@ -124,7 +197,7 @@ int flash_agent_ioctl(uint32_t op, void *ptr, uint32_t arg0, uint32_t arg1);
 // possible.
 //
 // fa.ioctl() must return ERR_INVALID if op is unsupported.
-// Currently no ops are defined, but OTP/EEPROM/Config bits are
+// The ops are defined above, and OTP/EEPROM/Config bits are
 // planned to be managed with ioctls.
 //
 // Bogus parameters may cause failure (ERR_INVALID)
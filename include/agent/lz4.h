@@ -0,0 +1,86 @@
+// agent/lz4.h
+//
+// Copyright 2023 Brian Swetland <swetland@frotz.net>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef _AGENT_LZ4_H_
+#define _AGENT_LZ4_H_
+
+#include <stdint.h>
+
+// LZ4 block format decompression, for the flash agents (and the
+// host, to check its compressor).  Copies go a byte at a time,
+// which keeps the code small and handles overlapping matches, and
+// are kept from being turned into calls to a memcpy() the agents
+// do not have.
+//
+// Decompress the src_len byte block at src into exactly dst_len
+// bytes at dst: 0 on success, -1 if the block is malformed or does
+// not come out at dst_len bytes.
+
+static uint32_t lz4_length(const uint8_t **src, const uint8_t *end, uint32_t len) {
+	if (len == 15) {
+		uint32_t b;
+		do {
+			if (*src >= end) {
+				return 0xFFFFFFFF;
+			}
+			b = *(*src)++;
+			len += b;
+		} while (b == 255);
+	}
+	return len;
+}
+
+__attribute__((optimize("no-tree-loop-distribute-patterns")))
+static int lz4_decompress(const uint8_t *src, uint32_t src_len,
+		uint8_t *dst, uint32_t dst_len) {
+	const uint8_t *end = src + src_len;
+	uint8_t *out = dst;
+	uint8_t *out_end = dst + dst_len;
+	while (src < end) {
+		uint32_t token = *src++;
+		uint32_t len = lz4_length(&src, end, token >> 4);
+		if ((len > (uint32_t) (end - src)) || (len > (uint32_t) (out_end - out))) {
+			return -1;
+		}
+		while (len-- > 0) {
+			*out++ = *src++;
+		}
+		// the last sequence is only literals
+		if (src == end) {
+			break;
+		}
+		if ((end - src) < 2) {
+			return -1;
+		}
+		uint32_t offset = src[0] | (src[1] << 8);
+		src += 2;
+		if ((offset == 0) || (offset > (uint32_t) (out - dst))) {
+			return -1;
+		}
+		len = lz4_length(&src, end, token & 15);
+		if ((len == 0xFFFFFFFF) || ((len + 4) > (uint32_t) (out_end - out))) {
+			return -1;
+		}
+		const uint8_t *match = out - offset;
+		len += 4;
+		while (len-- > 0) {
+			*out++ = *match++;
+		}
+	}
+	return (out == out_end) ? 0 : -1;
+}
+
+#endif
@@ -111,6 +111,8 @@
 
 #define MAP_CSW_KEEP		0xFF00FF00U // preserve mode/type/prot fields
 
+#define MAP_TAR_WRAP_MIN	0x400 // auto-increment guaranteed within 1K
+
 #define AHB_CSW_PROT_PRIV	0x02000000U
 #define AHB_CSW_MASTER_DEBUG	0x20000000U
 #define MAP_CSW_HNONSEC		0x40000000U
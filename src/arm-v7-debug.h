@@ -123,4 +123,64 @@
 #define FP2_COMP_FP_MASK     0x1FFFFFFE // allowed FP addr bits
 
 
-
+#define DWT_CTRL             0xE0001000
+#define DWT_CYCCNT           0xE0001004
+#define DWT_PCSR             0xE000101C // RO PC sample (FFFFFFFF if halted)
+
+#define DWT_CTRL_NUMCOMP_MASK  0xF0000000
+#define DWT_CTRL_NUMCOMP_SHIFT 28
+#define DWT_CTRL_NOCYCCNT      0x02000000
+#define DWT_CTRL_EXCTRCENA     0x00010000 // exception trace packets
+#define DWT_CTRL_PCSAMPLENA    0x00001000 // periodic PC sample packets
+#define DWT_CTRL_SYNCTAP_MASK  0x00000C00
+#define DWT_CTRL_SYNCTAP_24    0x00000400 // sync packet every 2^24 cycles
+#define DWT_CTRL_CYCTAP        0x00000200 // POSTCNT ticks every 2^10 cycles (not 2^6)
+#define DWT_CTRL_POSTPRESET_MASK  0x0000001E
+#define DWT_CTRL_POSTPRESET_SHIFT 1
+#define DWT_CTRL_CYCCNTENA     0x00000001
+
+#define DWT_COMP(n)          (0xE0001020 + 16*(n))
+#define DWT_MASK(n)          (0xE0001024 + 16*(n)) // low address bits ignored
+#define DWT_FUNCTION(n)      (0xE0001028 + 16*(n))
+
+#define DWT_FUNCTION_MATCHED   0x01000000 // cleared on read
+#define DWT_FUNCTION_MASK      0x0000000F
+#define DWT_FUNCTION_DISABLED  0x00000000
+#define DWT_FUNCTION_WP_RD     0x00000005 // watchpoint on data read
+#define DWT_FUNCTION_WP_WR     0x00000006 // ... on data write
+#define DWT_FUNCTION_WP_RW     0x00000007 // ... on either
+
+
+#define ITM_STIM(n)          (0xE0000000 + 4*(n))
+#define ITM_TER              0xE0000E00 // stimulus port enables
+#define ITM_TPR              0xE0000E40 // unprivileged access, per 8 ports
+#define ITM_TCR              0xE0000E80
+#define ITM_LAR              0xE0000FB0 // write ITM_LAR_KEY to unlock
+
+#define ITM_LAR_KEY          0xC5ACCE55
+
+#define ITM_TCR_BUSY         0x00800000
+#define ITM_TCR_TRACEBUSID(n) (((n) & 0x7F) << 16)
+#define ITM_TCR_SWOENA       0x00000010 // timestamps count TPIUACTV
+#define ITM_TCR_TXENA        0x00000008 // forward DWT packets
+#define ITM_TCR_SYNCENA      0x00000004
+#define ITM_TCR_TSENA        0x00000002 // local timestamps
+#define ITM_TCR_ITMENA       0x00000001
+
+
+#define TPIU_SSPSR           0xE0040000 // supported port sizes
+#define TPIU_CSPSR           0xE0040004 // current port size
+#define TPIU_ACPR            0xE0040010 // SWO clock = TRACECLKIN / (ACPR + 1)
+#define TPIU_SPPR            0xE00400F0 // selected pin protocol
+#define TPIU_FFSR            0xE0040300
+#define TPIU_FFCR            0xE0040304
+#define TPIU_TYPE            0xE0040FC8
+
+#define TPIU_ACPR_MAX        0x1FFF
+
+#define TPIU_SPPR_PARALLEL   0
+#define TPIU_SPPR_MANCHESTER 1
+#define TPIU_SPPR_NRZ        2
+
+#define TPIU_FFCR_TRIGIN     0x00000100
+#define TPIU_FFCR_ENFCONT    0x00000002 // formatter on (not for SWO)
@@ -92,6 +92,35 @@
 #define SEQ_INPUT  0x80
 // Response: BYTE(STATUS) DATA (LSB first)
 
+#define DAP_SWO_Transport 0x17 // BYTE(Transport)
+// Response BYTE(Status)
+#define SWO_TRANSPORT_NONE    0x00
+#define SWO_TRANSPORT_COMMAND 0x01 // via DAP_SWO_Data
+#define SWO_TRANSPORT_STREAM  0x02 // via the trace bulk endpoint
+
+#define DAP_SWO_Mode 0x18 // BYTE(Mode)
+// Response BYTE(Status)
+#define SWO_MODE_OFF        0x00
+#define SWO_MODE_UART       0x01
+#define SWO_MODE_MANCHESTER 0x02
+
+#define DAP_SWO_Baudrate 0x19 // WORD(Baudrate)
+// Response WORD(Baudrate) (actual rate, 0 if unsupported)
+
+#define DAP_SWO_Control 0x1A // BYTE(Control)
+// Response BYTE(Status)
+#define SWO_CONTROL_STOP  0x00
+#define SWO_CONTROL_START 0x01
+
+#define DAP_SWO_Status 0x1B
+// Response BYTE(TraceStatus) WORD(TraceCount)
+#define SWO_STATUS_ACTIVE  0x01
+#define SWO_STATUS_ERROR   0x40
+#define SWO_STATUS_OVERRUN 0x80
+
+#define DAP_SWO_Data 0x1C // SHORT(TraceCount) (max bytes to return)
+// Response BYTE(TraceStatus) SHORT(TraceCount) BYTE(Data)*
+
 
 #define DAP_TransferConfigure 0x04
 // BYTE(IdleCycles) SHORT(WaitRetry) SHORT(MatchRetry)
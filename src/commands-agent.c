@@ -4,19 +4,51 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <sys/time.h>
 
 #include "xdebug.h"
 #include "transport.h"
 #include "arm-v7-debug.h"
 #include "arm-v7-system-control.h"
+#include "image.h"
+#include "lz4.h"
 
 #define _AGENT_HOST_
 #include <agent/flash.h>
+#include <agent/crc32.h>
+
+// run_flash_agent() options
+#define FLASH_DIFF 1 // only erase and write sectors that differ
+#define FLASH_VERIFY 2 // have the agent checksum the result
+
+// a streaming agent that programs no chunk for this long is stuck
+#define STREAM_STALL_US 5000000
 
 static flash_agent *AGENT = NULL;
 static uint32_t AGENT_sz = 0;
 static char *AGENT_arch = NULL;
 
+#define AGENT_MAX 4096
+#define REGION_MAX 16
+
+// The agent stays resident between commands.  It is downloaded and
+// set up once, and reused for as long as the core has not run or
+// been reset since (see dc_core_epoch()) and the agent still reads
+// back (in one batch, with DHCSR) as it did after setup.  That covers
+// the RAM up to its buffer too, as setup may leave state in .bss
+// (the pico agent keeps the boot ROM entry points there).
+static struct {
+	uint8_t image[AGENT_MAX]; // as set up, so with its geometry
+	uint32_t size; // load_addr up to data_addr, at most AGENT_MAX
+	uint32_t crc; // of the image, less the stream mailbox
+	uint32_t epoch;
+	int active;
+	// from IOCTL_GEOMETRY (if the agent supports it)
+	flash_region region[REGION_MAX];
+	unsigned regions;
+} SESSION;
+
 const char* get_arch_name(void) {
 	if (AGENT_arch) {
 		return AGENT_arch;
@@ -82,8 +114,16 @@ fail_load:
 		ERROR("invalid agent image\n");
 		goto fail;
 	}
+	// the data buffer must not overlap the agent (which must fit)
+	if ((agent->data_addr >= agent->load_addr) &&
+		((agent->data_addr - agent->load_addr) < agent_sz)) {
+		ERROR("agent image (%zu bytes) overlaps its buffer at %08x\n",
+			agent_sz, agent->data_addr);
+		goto fail;
+	}
 
 	INFO("flash agent '%s' loaded.\n", agent_name);
+	SESSION.active = 0;
 	if (AGENT) {
 		free(AGENT);
 		free(AGENT_arch);
@@ -103,39 +143,35 @@ fail:
 	return DBG_ERR;
 }
 
-static int invoke(DC* dc, uint32_t agent, uint32_t func,
-	uint32_t r0, uint32_t r1, uint32_t r2, uint32_t r3) {
-	// TODO: improve error handling
-	dc_core_reg_wr(dc, 0, r0);
-	dc_core_reg_wr(dc, 1, r1);
-	dc_core_reg_wr(dc, 2, r2);
-	dc_core_reg_wr(dc, 3, r3);
-	dc_core_reg_wr(dc, 13, agent - 4);
-	dc_core_reg_wr(dc, 14, agent | 1); // include T bit
-	dc_core_reg_wr(dc, 15, func | 1); // include T bit
-
-	// if the target has bogus data at 0, the processor may be in
-	// pending-exception state after reset-stop, so we will clear
-	// any exceptions and then set the PSR to something reasonable
-	dc_mem_wr32(dc, AIRCR, AIRCR_VECTKEY | AIRCR_VECTCLRACTIVE);
-	dc_core_reg_wr(dc, 16, 0x01000000);
-
-	// todo: readback and verify?
+static long long now() {
+	struct timeval tv;
+	gettimeofday(&tv, 0);
+	return ((long long) tv.tv_usec) + ((long long) tv.tv_sec) * 1000000LL;
+}
 
+static int invoke_start(DC* dc, uint32_t agent, uint32_t func,
+	uint32_t r0, uint32_t r1, uint32_t r2, uint32_t r3) {
+	uint32_t args[4] = { r0, r1, r2, r3 };
 	INFO("agent: call <func@%08x>(0x%x,0x%x,0x%x,0x%x)\n", func, r0, r1, r2, r3);
-	dc_core_resume(dc);
+	if (dc_target_call_start(dc, func, args, agent - 4, agent)) {
+		ERROR("agent: cannot start call\n");
+		return DBG_ERR;
+	}
+	return 0;
+}
+
+// wait for the agent method to return, and check its status
+static int invoke_finish(DC* dc, uint32_t agent) {
 	// todo: timeout after a few seconds?
-	if (dc_core_wait_halt(dc)) {
+	uint32_t res = 0xeeeeeeee;
+	int r = dc_target_call_wait(dc, agent, &res);
+	if (r == DC_ERR_INTERRUPTED) {
 		ERROR("agent: interrupted\n");
 		return DBG_ERR;
 	}
-
-	uint32_t pc = 0xeeeeeeee, res = 0xeeeeeeee;
-	dc_core_reg_rd(dc, 0, &res);
-	dc_core_reg_rd(dc, 15, &pc);
-	if (pc != agent) {
-		ERROR("pc (%08x) is not at %08x\n", pc, agent);
-		return -1;
+	if (r < 0) {
+		ERROR("agent: call failed (%d)\n", r);
+		return DBG_ERR;
 	}
 	if (res) {
 		if (res == ERR_INVALID) {
@@ -148,35 +184,389 @@ static int invoke(DC* dc, uint32_t agent, uint32_t func,
 	return 0;
 }
 
-static int run_flash_agent(DC* dc, uint32_t flashaddr, void *data, uint32_t data_sz) {
-	uint8_t buffer[4096];
-	flash_agent *agent;
-	uint32_t agent_sz;
-	int r;
+static int invoke(DC* dc, uint32_t agent, uint32_t func,
+	uint32_t r0, uint32_t r1, uint32_t r2, uint32_t r3) {
+	if (invoke_start(dc, agent, func, r0, r1, r2, r3)) {
+		return DBG_ERR;
+	}
+	return invoke_finish(dc, agent);
+}
 
-	if (AGENT == NULL) {
-		ERROR("no flash agent selected\n");
-		ERROR("set architecture with: arch <name>\n");
+// the region containing addr, if the agent described its geometry
+static flash_region *flash_region_at(uint32_t addr) {
+	for (unsigned n = 0; n < SESSION.regions; n++) {
+		flash_region *r = SESSION.region + n;
+		if ((addr - r->base) < (r->sector_size * r->sector_count)) {
+			return r;
+		}
+	}
+	return NULL;
+}
+
+// the erase sector containing addr, from the region table if there
+// is one, or else by asking the agent
+static int flash_sector(DC* dc, flash_agent *agent, uint32_t addr,
+	uint32_t *base, uint32_t *size) {
+	uint32_t info[4];
+	flash_region *r;
+	if (SESSION.regions) {
+		if ((r = flash_region_at(addr)) == NULL) {
+			ERROR("flash: no sector at %08x\n", addr);
+			return DBG_ERR;
+		}
+		*base = addr - ((addr - r->base) % r->sector_size);
+		*size = r->sector_size;
+		return 0;
+	}
+	if (dc_mem_wr32(dc, agent->data_addr, 1) ||
+		invoke(dc, agent->load_addr, agent->ioctl,
+			IOCTL_SECTOR_CRC, agent->data_addr, addr, 1) ||
+		dc_mem_rd_words(dc, agent->data_addr, 4, info) ||
+		(info[0] != 1)) {
+		ERROR("flash: cannot find the sector at %08x\n", addr);
+		return DBG_ERR;
+	}
+	*base = info[1];
+	*size = info[2];
+	return 0;
+}
+
+// the write size of the region containing addr, or else the largest
+// write block size the agent hints at, at least a word
+static uint32_t write_align(flash_agent *agent, uint32_t addr) {
+	uint32_t align = 4;
+	flash_region *r = flash_region_at(addr);
+	if (r) {
+		return (r->write_size > align) ? r->write_size : align;
+	}
+	for (uint32_t flag = FLAG_WSZ_256B, sz = 256; flag <= FLAG_WSZ_4K; flag <<= 1, sz <<= 1) {
+		if (agent->flags & flag) {
+			align = sz;
+		}
+	}
+	return align;
+}
+
+// With IOCTL_STREAM the agent programs from one half of the data
+// buffer while the next chunk is downloaded into the other.  The
+// host only waits (polling the mailbox) when both halves are full.
+// With IOCTL_STREAM_LZ4 chunks are a quarter of the buffer, and each
+// is sent LZ4 compressed if that makes it smaller.
+static int stream_flash_agent(DC* dc, flash_agent *agent,
+	uint32_t flashaddr, uint8_t *data, uint32_t data_sz, int lz4) {
+	uint32_t mbox = agent->load_addr + offsetof(flash_agent, stream_host);
+	uint32_t chunk = agent->data_size / (lz4 ? 4 : 2);
+	uint32_t count = (data_sz + chunk - 1) / chunk;
+	uint32_t sent = 0, done = 0, packed_sz = 0;
+	uint8_t *packed = NULL;
+	long long t0 = now();
+
+	if (lz4 && ((packed = malloc(chunk + 3)) == NULL)) {
 		goto fail;
 	}
-	if (AGENT_sz > sizeof(buffer)) {
-		ERROR("flash agent too large\n");
+	while (done < count) {
+		if ((sent < count) && ((sent - done) < 2)) {
+			uint32_t off = sent * chunk;
+			uint32_t xfer = ((data_sz - off) > chunk) ? chunk : (data_sz - off);
+			uint8_t *src = data + off;
+			uint32_t len = 0;
+			if (lz4 && (len = lz4_compress(src, xfer, packed, xfer - 1))) {
+				memset(packed + len, 0, 3);
+				src = packed;
+				packed_sz += len;
+			} else {
+				packed_sz += xfer;
+			}
+			if (dc_mem_wr_words(dc, agent->data_addr + (sent & 1) * chunk,
+				(len ? (len + 3) : xfer) / 4, (void*) src)) {
+				ERROR("download to %08x failed\n", agent->data_addr);
+				goto fail;
+			}
+			sent++;
+			if (sent == 1) {
+				// the mailbox starts from zero, and then the agent
+				uint32_t init[4] = { 1, 0, len, 0 };
+				if (dc_mem_wr_words(dc, mbox, lz4 ? 4 : 2, init)) {
+					goto fail;
+				}
+				if (invoke_start(dc, agent->load_addr, agent->ioctl,
+					lz4 ? IOCTL_STREAM_LZ4 : IOCTL_STREAM,
+					agent->load_addr, flashaddr, data_sz)) {
+					goto fail;
+				}
+				continue;
+			}
+			dc_q_init(dc);
+			if (lz4) {
+				dc_q_mem_wr32(dc, mbox + 8 + ((sent - 1) & 1) * 4, len);
+			}
+			dc_q_mem_wr32(dc, mbox, sent);
+			if (dc_q_exec(dc)) {
+				goto fail;
+			}
+			continue;
+		}
+		uint32_t progress = done, dhcsr = 0;
+		dc_q_init(dc);
+		dc_q_mem_rd32(dc, mbox + 4, &progress);
+		dc_q_mem_rd32(dc, DHCSR, &dhcsr);
+		if (dc_q_exec(dc)) {
+			goto fail;
+		}
+		if (dhcsr & DHCSR_S_HALT) {
+			// the agent returned early: it failed
+			break;
+		}
+		long long t1 = now();
+		if (progress != done) {
+			done = progress;
+			t0 = t1;
+		} else if ((t1 - t0) > STREAM_STALL_US) {
+			ERROR("agent: stalled after %u of %u chunks\n", done, count);
+			dc_core_halt(dc);
+			free(packed);
+			return DBG_ERR;
+		}
+	}
+	if (invoke_finish(dc, agent->load_addr)) {
 		goto fail;
 	}
+	if (lz4) {
+		INFO("flash: sent %u bytes as %u\n", data_sz, packed_sz);
+	}
+	free(packed);
+	return 0;
+fail:
+	ERROR("failed to flash %d bytes to %08x\n", data_sz, flashaddr);
+	free(packed);
+	return DBG_ERR;
+}
+
+// write (already erased) flash, a buffer at a time, in chunks that
+// are whole multiples of the write size
+static int write_flash(DC* dc, flash_agent *agent,
+	uint32_t flashaddr, uint8_t *ptr, uint32_t data_sz) {
+	uint32_t align = write_align(agent, flashaddr);
+	uint32_t chunk = agent->data_size & ~(align - 1);
+	uint32_t xfer;
+	if ((agent->flags & FLAG_STREAM) && (agent->data_size >= 8) &&
+		(((agent->data_size / 2) % align) == 0)) {
+		int lz4 = (agent->flags & FLAG_LZ4) && (agent->data_size >= 16) &&
+			(((agent->data_size / 4) % align) == 0);
+		return stream_flash_agent(dc, agent, flashaddr, ptr, data_sz, lz4);
+	}
+	if (chunk == 0) {
+		ERROR("flash: agent buffer is smaller than a write\n");
+		return DBG_ERR;
+	}
+	while (data_sz > 0) {
+		if (data_sz > chunk) {
+			xfer = chunk;
+		} else {
+			xfer = data_sz;
+		}
+		if (dc_mem_wr_words(dc, agent->data_addr, xfer / 4, (void*) ptr)) {
+			ERROR("download to %08x failed\n", agent->data_addr);
+			return DBG_ERR;
+		}
+		if (invoke(dc, agent->load_addr, agent->write,
+			flashaddr, agent->data_addr, xfer, 0)) {
+			ERROR("failed to flash %d bytes to %08x\n", xfer, flashaddr);
+			return DBG_ERR;
+		}
+		ptr += xfer;
+		data_sz -= xfer;
+		flashaddr += xfer;
+	}
+	return 0;
+}
+
+static uint32_t crc_erased(uint32_t crc, uint32_t len) {
+	static uint8_t ff[256];
+	if (ff[0] == 0) {
+		memset(ff, 0xFF, sizeof(ff));
+	}
+	while (len > 0) {
+		uint32_t xfer = (len > sizeof(ff)) ? sizeof(ff) : len;
+		crc = flash_crc32(crc, ff, xfer);
+		len -= xfer;
+	}
+	return crc;
+}
+
+// erase sectors [start, end) and write the part of the image in them
+static int rewrite_sectors(DC* dc, flash_agent *agent, uint32_t start, uint32_t end,
+	uint32_t flashaddr, uint8_t *data, uint32_t data_sz) {
+	uint32_t lo = (start > flashaddr) ? start : flashaddr;
+	uint32_t hi = (end < (flashaddr + data_sz)) ? end : (flashaddr + data_sz);
+	if (invoke(dc, agent->load_addr, agent->erase, start, end - start, 0, 0)) {
+		ERROR("failed to erase %d bytes at %08x\n", end - start, start);
+		return DBG_ERR;
+	}
+	return write_flash(dc, agent, lo, data + (lo - flashaddr), hi - lo);
+}
+
+// The agent checksums the sectors the image covers, and only those
+// whose contents differ from what flashing would leave (the image,
+// and erased bytes around it) are erased and written, a run of
+// neighbouring sectors at a time.
+static int diff_flash(DC* dc, flash_agent *agent,
+	uint32_t flashaddr, uint8_t *data, uint32_t data_sz) {
+	uint32_t max = (agent->data_size / 4 - 1) / 3;
+	uint32_t end = flashaddr + data_sz;
+	uint32_t addr = flashaddr;
+	uint32_t run_start = 0, run_end = 0;
+	uint32_t total = 0, differ = 0;
+	uint32_t *info;
+	int r = DBG_ERR;
+
+	if ((info = malloc(max * 12)) == NULL) {
+		return DBG_ERR;
+	}
+	while (addr < end) {
+		uint32_t count = 0;
+		if (dc_mem_wr32(dc, agent->data_addr, max) ||
+			invoke(dc, agent->load_addr, agent->ioctl,
+				IOCTL_SECTOR_CRC, agent->data_addr, addr, end - addr) ||
+			dc_mem_rd32(dc, agent->data_addr, &count) ||
+			(count == 0) || (count > max) ||
+			dc_mem_rd_words(dc, agent->data_addr + 4, count * 3, info)) {
+			ERROR("flash: cannot checksum sectors at %08x\n", addr);
+			goto done;
+		}
+		for (uint32_t n = 0; n < count; n++) {
+			uint32_t base = info[n * 3];
+			uint32_t size = info[n * 3 + 1];
+			uint32_t lo = (base > flashaddr) ? base : flashaddr;
+			uint32_t hi = ((base + size) < end) ? (base + size) : end;
+			uint32_t crc = crc_erased(0, lo - base);
+			crc = flash_crc32(crc, data + (lo - flashaddr), hi - lo);
+			crc = crc_erased(crc, (base + size) - hi);
+			total++;
+			if (crc != info[n * 3 + 2]) {
+				differ++;
+				if ((run_end != base) || (run_start == run_end)) {
+					if ((run_start != run_end) && rewrite_sectors(dc, agent,
+						run_start, run_end, flashaddr, data, data_sz)) {
+						goto done;
+					}
+					run_start = base;
+				}
+				run_end = base + size;
+			}
+			addr = base + size;
+		}
+	}
+	if ((run_start != run_end) &&
+		rewrite_sectors(dc, agent, run_start, run_end, flashaddr, data, data_sz)) {
+		goto done;
+	}
+	INFO("flash: %u of %u sectors differed\n", differ, total);
+	r = 0;
+done:
+	free(info);
+	return r;
+}
+
+// the agent checksums what was written, rather than the host
+// reading it all back
+static int verify_flash(DC* dc, flash_agent *agent,
+	uint32_t flashaddr, uint8_t *data, uint32_t data_sz) {
+	uint32_t expect = flash_crc32(0, data, data_sz);
+	uint32_t crc;
+	if (invoke(dc, agent->load_addr, agent->ioctl,
+		IOCTL_CRC, agent->data_addr, flashaddr, data_sz) ||
+		dc_mem_rd32(dc, agent->data_addr, &crc)) {
+		ERROR("flash: cannot checksum %d bytes at %08x\n", data_sz, flashaddr);
+		return DBG_ERR;
+	}
+	if (crc != expect) {
+		ERROR("flash: verify failed (crc %08x, expected %08x)\n", crc, expect);
+		return DBG_ERR;
+	}
+	INFO("flash: verified\n");
+	return 0;
+}
+
+static uint32_t session_crc(uint8_t *image, uint32_t size) {
+	flash_agent *agent = (void*) image;
+	agent->stream_host = 0;
+	agent->stream_done = 0;
+	agent->stream_len[0] = 0;
+	agent->stream_len[1] = 0;
+	return flash_crc32(0, image, size);
+}
 
-	memcpy(buffer, AGENT, AGENT_sz);
-	agent_sz = AGENT_sz;
-	agent = (void*) buffer;
+static int session_valid(DC* dc) {
+	flash_agent *agent = (void*) SESSION.image;
+	uint32_t check[AGENT_MAX / 4];
+	uint32_t dhcsr = 0;
+	if (!SESSION.active || (SESSION.epoch != dc_core_epoch(dc))) {
+		return 0;
+	}
+	dc_q_init(dc);
+	dc_q_mem_rd32(dc, DHCSR, &dhcsr);
+	dc_q_mem_rd_words(dc, agent->load_addr, SESSION.size / 4, check);
+	if (dc_q_exec(dc) ||
+		((dhcsr & (DHCSR_S_HALT | DHCSR_S_RESET_ST)) != DHCSR_S_HALT) ||
+		(check[0] != 0xbe00be00)) {
+		return 0;
+	}
+	return session_crc((void*) check, SESSION.size) == SESSION.crc;
+}
+
+// ask the agent for the region table covering its flash
+static int session_geometry(DC* dc, flash_agent *agent) {
+	uint32_t addr = agent->flash_addr;
+	uint32_t left = agent->flash_size;
+	SESSION.regions = 0;
+	while (left > 0) {
+		uint32_t out[1 + REGION_MAX * 4];
+		uint32_t max = REGION_MAX - SESSION.regions;
+		if ((max == 0) ||
+			dc_mem_wr32(dc, agent->data_addr, max) ||
+			invoke(dc, agent->load_addr, agent->ioctl,
+				IOCTL_GEOMETRY, agent->data_addr, addr, left) ||
+			dc_mem_rd_words(dc, agent->data_addr, 1 + max * 4, out) ||
+			(out[0] == 0) || (out[0] > max)) {
+			ERROR("agent: cannot read flash geometry\n");
+			return DBG_ERR;
+		}
+		memcpy(SESSION.region + SESSION.regions, out + 1, out[0] * sizeof(flash_region));
+		SESSION.regions += out[0];
+		flash_region *r = SESSION.region + SESSION.regions - 1;
+		uint32_t end = r->base + r->sector_size * r->sector_count;
+		if ((end - addr) >= left) {
+			break;
+		}
+		left -= end - addr;
+		addr = end;
+	}
+	for (unsigned n = 0; n < SESSION.regions; n++) {
+		flash_region *r = SESSION.region + n;
+		INFO("agent: flash %u x %uK sectors @%08x, writes of %u\n",
+			r->sector_count, r->sector_size / 1024, r->base, r->write_size);
+	}
+	return 0;
+}
+
+// download the agent, set it up, and note what it looks like after
+static int session_start(DC* dc) {
+	flash_agent *agent = (void*) SESSION.image;
+	uint32_t agent_sz = AGENT_sz;
+
+	SESSION.active = 0;
+	memcpy(SESSION.image, AGENT, AGENT_sz);
 
 	// replace magic with bkpt instructions
 	agent->magic = 0xbe00be00;
 
 	if (do_attach(dc,0)) {
 		ERROR("failed to attach\n");
-		goto fail;
+		return DBG_ERR;
 	}
 	if (do_reset_stop(dc,0)) {
-		goto fail;
+		return DBG_ERR;
 	}
 
 	if (agent->flags & FLAG_BOOT_ROM_HACK) {
@@ -187,7 +577,7 @@ static int run_flash_agent(DC* dc, uint32_t flashaddr, void *data, uint32_t data
 #else
 		xprintf(XCORE, "executing boot rom\n");
 		if (swdp_watchpoint_rw(0, 0)) {
-			goto fail;
+			return DBG_ERR;
 		}
 		swdp_core_resume();
 		swdp_core_wait_for_halt();
@@ -199,27 +589,117 @@ static int run_flash_agent(DC* dc, uint32_t flashaddr, void *data, uint32_t data
 
 	if (dc_mem_wr_words(dc, agent->load_addr, agent_sz / 4, (void*) agent)) {
 		ERROR("failed to download agent\n");
-		goto fail;
+		return DBG_ERR;
 	}
 	INFO("agent: loaded @%08x (%d bytes)\n", agent->load_addr, agent_sz);
 
 	if (invoke(dc, agent->load_addr, agent->setup, agent->load_addr, 0, 0, 0)) {
-		goto fail;
-	if (r != 0) {
-		}
-		goto fail;
+		return DBG_ERR;
 	}
-	if (dc_mem_rd_words(dc, agent->load_addr + 16, 4, (void*) &agent->data_addr)) {
-		goto fail;
+	if (dc_mem_rd_words(dc, agent->load_addr, agent_sz / 4, (void*) agent)) {
+		return DBG_ERR;
 	}
 	INFO("agent: info: buffer %dK @%08x, flash %dK @%08x\n",
 		agent->data_size / 1024, agent->data_addr,
 		agent->flash_size / 1024, agent->flash_addr);
 
+	SESSION.regions = 0;
+	if ((agent->flags & FLAG_GEOMETRY) && session_geometry(dc, agent)) {
+		return DBG_ERR;
+	}
+
+	// snapshot .bss along with the image, in whole words like the
+	// download above (image leads SESSION, so it is word aligned)
+	uint32_t start = agent_sz & ~3;
+	uint32_t size = start;
+	if (agent->data_addr > agent->load_addr) {
+		uint32_t span = agent->data_addr - agent->load_addr;
+		size = (span > AGENT_MAX) ? AGENT_MAX : (span & ~3);
+	}
+	if ((size > start) &&
+		dc_mem_rd_words(dc, agent->load_addr + start, (size - start) / 4,
+			(uint32_t*) (SESSION.image + start))) {
+		return DBG_ERR;
+	}
+
+	SESSION.size = size;
+	SESSION.crc = session_crc(SESSION.image, size);
+	SESSION.epoch = dc_core_epoch(dc);
+	SESSION.active = 1;
+	return 0;
+}
+
+// the resident agent, downloading and setting it up if need be
+static flash_agent *agent_ready(DC* dc) {
+	flash_agent *agent = (void*) SESSION.image;
+
+	if (AGENT == NULL) {
+		ERROR("no flash agent selected\n");
+		ERROR("set architecture with: arch <name>\n");
+		return NULL;
+	}
+	if (AGENT_sz > AGENT_MAX) {
+		ERROR("flash agent too large\n");
+		return NULL;
+	}
+
+	if (session_valid(dc)) {
+		INFO("agent: resident @%08x\n", agent->load_addr);
+	} else if (session_start(dc)) {
+		return NULL;
+	}
+	return agent;
+}
+
+// erase [erase_addr, erase_addr + erase_sz), or (with FLASH_DIFF)
+// just the sectors that differ, and write data at flashaddr
+static int program(DC* dc, flash_agent *agent, uint32_t erase_addr, uint32_t erase_sz,
+	uint32_t flashaddr, uint8_t *data, uint32_t data_sz, unsigned opts) {
+	INFO("flash: writing %d bytes at %08x...\n", data_sz, flashaddr);
+	if ((opts & FLASH_DIFF) && !(agent->flags & FLAG_CRC)) {
+		INFO("flash: agent cannot checksum sectors, writing all\n");
+		opts &= ~FLASH_DIFF;
+	}
+	if ((opts & FLASH_VERIFY) && !(agent->flags & FLAG_CRC)) {
+		ERROR("flash: agent cannot verify\n");
+		return DBG_ERR;
+	}
+	if (opts & FLASH_DIFF) {
+		if (diff_flash(dc, agent, flashaddr, data, data_sz)) {
+			return DBG_ERR;
+		}
+	} else {
+		if (invoke(dc, agent->load_addr, agent->erase, erase_addr, erase_sz, 0, 0)) {
+			ERROR("failed to erase %d bytes at %08x\n", erase_sz, erase_addr);
+			return DBG_ERR;
+		}
+		if (write_flash(dc, agent, flashaddr, data, data_sz)) {
+			return DBG_ERR;
+		}
+	}
+	INFO("flash: OK\n");
+	if ((opts & FLASH_VERIFY) &&
+		verify_flash(dc, agent, flashaddr, data, data_sz)) {
+		return DBG_ERR;
+	}
+	return 0;
+}
+
+static int run_flash_agent(DC* dc, uint32_t flashaddr, void *data, uint32_t data_sz,
+	unsigned opts) {
+	flash_agent *agent;
+
+	if ((agent = agent_ready(dc)) == NULL) {
+		goto fail;
+	}
+
 	if ((flashaddr == 0) && (data == NULL) && (data_sz == 0xFFFFFFFF)) {
 		// erase all
 		flashaddr = agent->flash_addr;
 		data_sz = agent->flash_size;
+	} else if ((agent->flags & FLAG_ALIAS) &&
+		((flashaddr - agent->flash_alias) < agent->flash_size)) {
+		flashaddr = flashaddr - agent->flash_alias + agent->flash_addr;
 	}
 
 	if ((flashaddr < agent->flash_addr) ||
@@ -239,63 +719,286 @@ static int run_flash_agent(DC* dc, uint32_t flashaddr, void *data, uint32_t data
 		INFO("erase: OK\n");
 	} else {
 		// write
-		uint8_t *ptr = (void*) data;
-		uint32_t xfer;
-		INFO("flash: writing %d bytes at %08x...\n", data_sz, flashaddr);
-		if (invoke(dc, agent->load_addr, agent->erase, flashaddr, data_sz, 0, 0)) {
-			ERROR("failed to erase %d bytes at %08x\n", data_sz, flashaddr);
+		if (program(dc, agent, flashaddr, data_sz, flashaddr, data, data_sz, opts)) {
+			goto fail;
+		}
+	}
+
+	if (data) free(data);
+	return 0;
+fail:
+	// the agent may be in no state to be trusted again
+	SESSION.active = 0;
+	if (data) free(data);
+	return -1;
+}
+
+// Segments in flash are grouped into runs that share no erase sector
+// with another run, so each sector is erased at most once.  A run is
+// erased from the start of its first sector to the end of its last,
+// and written from that first sector on (so the write is as aligned
+// as the erase), to the end of its last segment rounded up to the
+// agent's write size.  Gaps between segments are written as erased
+// (0xFF).  Sector geometry comes from the agent's region table
+// (FLAG_GEOMETRY) or, failing that, from asking it sector by sector
+// (FLAG_CRC).  Without either, all of the flash segments form a
+// single run.  Segments linked at the agent's flash alias are moved
+// to its flash first.  Segments outside of flash are written to
+// memory afterwards, as the agent is done with the RAM it uses by
+// then, and must read back (be RAM) or the image is in error.
+static int flash_image_file(DC* dc, image *img, unsigned opts) {
+	const image_seg *seg, *t;
+	flash_agent *agent;
+	uint8_t *buf = NULL;
+
+	if ((agent = agent_ready(dc)) == NULL) {
+		goto fail;
+	}
+	uint32_t fbase = agent->flash_addr;
+	uint32_t fend = agent->flash_addr + agent->flash_size;
+	if ((agent->flags & FLAG_ALIAS) &&
+		image_move(img, agent->flash_alias, agent->flash_size, fbase)) {
+		goto fail;
+	}
+	int geometry = (SESSION.regions != 0) || (agent->flags & FLAG_CRC);
+
+	for (unsigned n = 0; (seg = image_segment(img, n)) != NULL; ) {
+		uint32_t end = seg->addr + seg->size;
+		if ((seg->addr >= fend) || (end <= fbase)) {
+			n++;
+			continue;
+		}
+		if ((seg->addr < fbase) || (end > fend)) {
+			ERROR("flash: segment %08x..%08x is partly outside of flash\n",
+				seg->addr, end);
 			goto fail;
 		}
-		while (data_sz > 0) {
-			if (data_sz > agent->data_size) {
-				xfer = agent->data_size;
+
+		uint32_t start = seg->addr, stop = end, base, size;
+		if (geometry) {
+			if (flash_sector(dc, agent, seg->addr, &start, &size) ||
+				flash_sector(dc, agent, end - 1, &base, &size)) {
+				goto fail;
+			}
+			stop = base + size;
+		}
+		unsigned m;
+		for (m = n + 1; (t = image_segment(img, m)) != NULL; m++) {
+			uint32_t tend = t->addr + t->size;
+			if ((t->addr >= fend) || (tend > fend)) {
+				break;
+			}
+			if (geometry) {
+				if (flash_sector(dc, agent, t->addr, &base, &size)) {
+					goto fail;
+				}
+				if (base >= stop) {
+					break;
+				}
+				if (flash_sector(dc, agent, tend - 1, &base, &size)) {
+					goto fail;
+				}
+				stop = base + size;
 			} else {
-				xfer = data_sz;
+				stop = tend;
 			}
-			if (dc_mem_wr_words(dc, agent->data_addr, xfer / 4, (void*) ptr)) {
-				ERROR("download to %08x failed\n", agent->data_addr);
+			end = tend;
+		}
+
+		// write from the start of the run to its last byte of data
+		uint32_t align = write_align(agent, start);
+		uint32_t len = end - start;
+		len = (len + align - 1) & ~(align - 1);
+		if (len > (stop - start)) {
+			len = (stop - start + 3) & ~3;
+		}
+		if ((buf = malloc(len)) == NULL) {
+			goto fail;
+		}
+		memset(buf, 0xFF, len);
+		for (unsigned k = n; k < m; k++) {
+			t = image_segment(img, k);
+			memcpy(buf + (t->addr - start), t->data, t->size);
+		}
+		if (program(dc, agent, start, stop - start, start, buf, len, opts)) {
+			goto fail;
+		}
+		free(buf);
+		buf = NULL;
+		n = m;
+	}
+
+	for (unsigned n = 0; (seg = image_segment(img, n)) != NULL; n++) {
+		if ((seg->addr >= fend) || ((seg->addr + seg->size) <= fbase)) {
+			INFO("download: %u bytes at %08x\n", seg->size, seg->addr);
+			if ((buf = malloc(seg->size)) == NULL) {
 				goto fail;
 			}
-			if (invoke(dc, agent->load_addr, agent->write,
-				flashaddr, agent->data_addr, xfer, 0)) {
-				ERROR("failed to flash %d bytes to %08x\n", xfer, flashaddr);
+			if (dc_mem_write(dc, seg->addr, seg->size, seg->data) ||
+				dc_mem_read(dc, seg->addr, seg->size, buf) ||
+				memcmp(buf, seg->data, seg->size)) {
+				ERROR("flash: segment %08x..%08x is neither flash nor RAM\n",
+					seg->addr, seg->addr + seg->size);
 				goto fail;
 			}
-			ptr += xfer;
-			data_sz -= xfer;
-			flashaddr += xfer;
+			free(buf);
+			buf = NULL;
 		}
-		INFO("flash: OK\n");
 	}
-
-	if (data) free(data);
 	return 0;
 fail:
-	if (data) free(data);
-	return -1;
+	SESSION.active = 0;
+	free(buf);
+	return DBG_ERR;
+}
+
+// the flash the selected agent declares, sized by its setup() if
+// it is resident, and if not, perhaps not yet (so the size may be 0)
+int get_flash_region(uint32_t* addr, uint32_t* size) {
+	if (AGENT == NULL) {
+		return DBG_ERR;
+	}
+	if (SESSION.active) {
+		flash_agent *agent = (void*) SESSION.image;
+		*addr = agent->flash_addr;
+		*size = agent->flash_size;
+		return 0;
+	}
+	*addr = AGENT->flash_addr;
+	*size = AGENT->flash_size;
+	return 0;
+}
+
+// add [base, base + size) to the map, extending its last region
+// if that has the same sector size and ends at base
+static int map_sector(flash_region* map, unsigned max, unsigned *count,
+	uint32_t base, uint32_t size, uint32_t write_size) {
+	flash_region *last = map + *count - 1;
+	if ((*count > 0) && (last->sector_size == size) &&
+		((last->base + last->sector_size * last->sector_count) == base)) {
+		last->sector_count++;
+		return 0;
+	}
+	if (*count == max) {
+		return -1;
+	}
+	map[*count].base = base;
+	map[*count].sector_size = size;
+	map[*count].sector_count = 1;
+	map[*count].write_size = write_size;
+	(*count)++;
+	return 0;
+}
+
+// The flash as regions of like-sized erase sectors, at the address
+// images are linked at (the alias, if the agent has one), for gdb's
+// memory map.  The agent is made resident (resetting the target) if
+// it is not.  Its region table is used if it has one, or else the
+// sectors it reports with IOCTL_SECTOR_CRC, or else (lacking both)
+// all of the flash is one sector.  Returns the count, or -1.
+int get_flash_map(DC* dc, flash_region* map, unsigned max) {
+	flash_agent *agent;
+	unsigned count = 0;
+
+	if ((agent = agent_ready(dc)) == NULL) {
+		return -1;
+	}
+	uint32_t align = write_align(agent, agent->flash_addr);
+	if (SESSION.regions) {
+		if (SESSION.regions > max) {
+			return -1;
+		}
+		memcpy(map, SESSION.region, SESSION.regions * sizeof(flash_region));
+		count = SESSION.regions;
+	} else if (agent->flags & FLAG_CRC) {
+		// as many sectors at a time as the data buffer holds
+		uint32_t cap = (agent->data_size - 4) / 12;
+		uint32_t *info = malloc(4 + cap * 12);
+		uint32_t addr = agent->flash_addr;
+		uint32_t left = agent->flash_size;
+		if (info == NULL) {
+			return -1;
+		}
+		while (left > 0) {
+			if (dc_mem_wr32(dc, agent->data_addr, cap) ||
+				invoke(dc, agent->load_addr, agent->ioctl,
+					IOCTL_SECTOR_CRC, agent->data_addr, addr, left) ||
+				dc_mem_rd_words(dc, agent->data_addr, 1 + cap * 3, info) ||
+				(info[0] == 0) || (info[0] > cap)) {
+				ERROR("flash: cannot read sectors at %08x\n", addr);
+				free(info);
+				return -1;
+			}
+			uint32_t end = addr;
+			for (unsigned n = 0; n < info[0]; n++) {
+				uint32_t base = info[1 + n * 3];
+				uint32_t size = info[2 + n * 3];
+				if (map_sector(map, max, &count, base, size, align)) {
+					free(info);
+					return -1;
+				}
+				end = base + size;
+			}
+			if ((end - addr) >= left) {
+				break;
+			}
+			left -= end - addr;
+			addr = end;
+		}
+		free(info);
+	} else {
+		map_sector(map, max, &count, agent->flash_addr, agent->flash_size, align);
+	}
+	if (agent->flags & FLAG_ALIAS) {
+		for (unsigned n = 0; n < count; n++) {
+			map[n].base = map[n].base - agent->flash_addr + agent->flash_alias;
+		}
+	}
+	return count;
+}
+
+// erase and write, taking ownership of data (from malloc())
+int flash_image(DC* dc, uint32_t addr, void* data, uint32_t data_sz) {
+	return run_flash_agent(dc, addr, data, data_sz, 0);
 }
 
 int do_flash(DC* dc, CC* cc) {
-	void *data = NULL;
-	size_t sz;
 	const char *fn;
 	uint32_t addr;
-	uint32_t data_sz;
-	if (cmd_arg_str(cc, 1, &fn)) return DBG_ERR;
-	if (cmd_arg_u32(cc, 2, &addr)) return DBG_ERR;
+	unsigned opts = 0;
+	unsigned n = 1;
+	image *img;
+	int r;
+	for (;;) {
+		if (cmd_arg_str(cc, n, &fn)) return DBG_ERR;
+		if (fn[0] != '-') {
+			break;
+		}
+		if (!strcmp(fn, "-diff")) {
+			opts |= FLASH_DIFF;
+		} else if (!strcmp(fn, "-verify")) {
+			opts |= FLASH_VERIFY;
+		} else {
+			ERROR("flash: unknown option '%s'\n", fn);
+			return DBG_ERR;
+		}
+		n++;
+	}
+	// a raw binary needs an address, other formats have their own
+	int raw = (cmd_argc(cc) > (n + 1));
+	if (raw && cmd_arg_u32(cc, n + 1, &addr)) return DBG_ERR;
 
-	if ((data = load_file(fn, &sz)) == NULL) {
-		ERROR("cannot load '%s'\n", fn);
-		return -1;
+	if ((img = image_load(fn, raw ? &addr : NULL)) == NULL) {
+		return DBG_ERR;
 	}
-	if (sz > (1024*1024)) {
-		ERROR("too large\n");
+	if (raw && strcmp(image_format(img), "raw")) {
+		ERROR("flash: '%s' is %s, which has its own addresses\n", fn, image_format(img));
+		image_free(img);
 		return DBG_ERR;
 	}
-
-	// word align
-	data_sz = (sz + 3) & ~3;
-	return run_flash_agent(dc, addr, data, data_sz);
+	r = flash_image_file(dc, img, opts);
+	image_free(img);
+	return r;
 }
 
 int do_erase(DC* dc, CC* cc) {
@@ -304,10 +1007,10 @@ int do_erase(DC* dc, CC* cc) {
 	uint32_t len;
 	cmd_arg_str_opt(cc, 1, &s, "");
 	if (!strcmp(s, "all")) {
-		return run_flash_agent(dc, 0, NULL, 0xFFFFFFFF);
+		return run_flash_agent(dc, 0, NULL, 0xFFFFFFFF, 0);
 	}
 	if (cmd_arg_u32(cc, 1, &addr)) return DBG_ERR;
 	if (cmd_arg_u32(cc, 2, &len)) return DBG_ERR;
-	return run_flash_agent(dc, addr, NULL, len);
+	return run_flash_agent(dc, addr, NULL, len, 0);
 }
 
@@ -12,6 +12,7 @@
 #include "transport.h"
 #include "arm-v7-debug.h"
 #include "arm-v7-system-control.h"
+#include "image.h"
 
 void *load_file(const char *fn, size_t *_sz) {
 	int fd;
@@ -97,30 +98,41 @@ done:
 int do_download(DC* dc, CC* cc) {
 	const char* fn;
 	uint32_t addr;
-	void *data;
-	size_t sz;
+	const image_seg* seg;
+	image* img;
+	size_t sz = 0;
 	long long t0, t1;
 
 	if (cmd_arg_str(cc, 1, &fn)) return DBG_ERR;
-	if (cmd_arg_u32(cc, 2, &addr)) return DBG_ERR;	
+	// a raw binary needs an address, other formats have their own
+	int raw = (cmd_argc(cc) > 2);
+	if (raw && cmd_arg_u32(cc, 2, &addr)) return DBG_ERR;
 
-	if ((data = load_file(fn, &sz)) == NULL) {
-		ERROR("cannot read '%s'\n", fn);
+	if ((img = image_load(fn, raw ? &addr : NULL)) == NULL) {
+		return DBG_ERR;
+	}
+	if (raw && strcmp(image_format(img), "raw")) {
+		ERROR("download: '%s' is %s, which has its own addresses\n", fn, image_format(img));
+		image_free(img);
 		return DBG_ERR;
 	}
-	sz = (sz + 3) & ~3;
+	for (unsigned n = 0; (seg = image_segment(img, n)) != NULL; n++) {
+		sz += seg->size;
+	}
 
 	INFO("download: sending %ld bytes...\n", sz);
 	t0 = now();
-	if (dc_mem_wr_words(dc, addr, sz / 4, data) < 0) {
-		ERROR("failed to write data\n");
-		free(data);
-		return DBG_ERR;
+	for (unsigned n = 0; (seg = image_segment(img, n)) != NULL; n++) {
+		if (dc_mem_write(dc, seg->addr, seg->size, seg->data) < 0) {
+			ERROR("failed to write data\n");
+			image_free(img);
+			return DBG_ERR;
+		}
 	}
 	t1 = now();
 	INFO("download: %lld uS -> %lld B/s\n", (t1 - t0), 
 		(((long long)sz) * 1000000LL) / (t1 - t0));
-	free(data);
+	image_free(img);
 	return 0;
 }
 
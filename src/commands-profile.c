@@ -0,0 +1,192 @@
+// Copyright 2023, Brian Swetland <swetland@frotz.net>
+// Licensed under the Apache License, Version 2.0.
+
+#include <string.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+#include "xdebug.h"
+#include "transport.h"
+#include "arm-v7-debug.h"
+#include "elf.h"
+
+// samples per batch: enough to keep the probe's packet window
+// full for a good while, so the pipeline rarely drains
+#define PROFILE_BATCH   4096
+#define PROFILE_MAX_MS  60000
+#define PROFILE_MAX     (16 * 1024 * 1024)
+
+// DWT_PCSR reads as all ones while the core is halted
+#define PCSR_HALTED     0xFFFFFFFF
+
+static long long now() {
+	struct timeval tv;
+	gettimeofday(&tv, 0);
+	return ((long long) tv.tv_usec) + ((long long) tv.tv_sec) * 1000000LL;
+}
+
+typedef struct {
+	uint32_t pc;
+	uint32_t count;
+	const elf_symbol* sym;
+} bucket;
+
+static int u32_cmp(const void* a, const void* b) {
+	uint32_t x = *((const uint32_t*) a);
+	uint32_t y = *((const uint32_t*) b);
+	return (x < y) ? -1 : ((x > y) ? 1 : 0);
+}
+
+static int bucket_cmp(const void* a, const void* b) {
+	const bucket* x = a;
+	const bucket* y = b;
+	if (x->count != y->count) {
+		return (x->count > y->count) ? -1 : 1;
+	}
+	return (x->pc < y->pc) ? -1 : ((x->pc > y->pc) ? 1 : 0);
+}
+
+// collapse sorted samples into per-pc buckets
+static unsigned histogram(const uint32_t* sample, unsigned count, bucket* out) {
+	unsigned n = 0;
+	for (unsigned i = 0; i < count; ) {
+		unsigned j = i + 1;
+		while ((j < count) && (sample[j] == sample[i])) {
+			j++;
+		}
+		out[n].pc = sample[i];
+		out[n].count = j - i;
+		out[n].sym = NULL;
+		n++;
+		i = j;
+	}
+	return n;
+}
+
+// merge per-pc buckets (sorted by pc) into per-function buckets,
+// with everything outside of a known function in the last one
+static unsigned by_function(bucket* b, unsigned n, elf_symtab* st) {
+	uint32_t unknown = 0;
+	unsigned out = 0;
+	for (unsigned i = 0; i < n; i++) {
+		const elf_symbol* sym = elf_symtab_find(st, b[i].pc);
+		if (sym == NULL) {
+			unknown += b[i].count;
+		} else if (out && (b[out - 1].sym == sym)) {
+			b[out - 1].count += b[i].count;
+		} else {
+			b[out].pc = sym->addr;
+			b[out].count = b[i].count;
+			b[out].sym = sym;
+			out++;
+		}
+	}
+	if (unknown) {
+		b[out].pc = 0;
+		b[out].count = unknown;
+		b[out].sym = NULL;
+		out++;
+	}
+	return out;
+}
+
+static int sample(DC* dc, uint32_t ms, uint32_t** _buf, unsigned* _count) {
+	unsigned count = 0, max = 0;
+	uint32_t* buf = NULL;
+	long long t1 = now() + ms * 1000LL;
+	do {
+		if ((count + PROFILE_BATCH) > max) {
+			uint32_t* tmp;
+			max = max ? (max * 2) : (PROFILE_BATCH * 16);
+			if ((tmp = realloc(buf, max * sizeof(uint32_t))) == NULL) {
+				ERROR("profile: out of memory\n");
+				break;
+			}
+			buf = tmp;
+		}
+		if (dc_mem_sample32(dc, DWT_PCSR, PROFILE_BATCH, buf + count) < 0) {
+			ERROR("profile: failed to sample DWT_PCSR\n");
+			free(buf);
+			return DBG_ERR;
+		}
+		count += PROFILE_BATCH;
+	} while ((now() < t1) && (count < PROFILE_MAX));
+	*_buf = buf;
+	*_count = count;
+	return 0;
+}
+
+int do_profile(DC* dc, CC* cc) {
+	elf_symtab* st = NULL;
+	uint32_t* buf = NULL;
+	bucket* b = NULL;
+	const char* fn;
+	uint32_t ms, top, demcr;
+	unsigned count, halted, n;
+	long long t0, t1;
+	int status = DBG_ERR;
+
+	if (cmd_arg_u32(cc, 1, &ms)) return DBG_ERR;
+	if (cmd_arg_str_opt(cc, 2, &fn, NULL)) return DBG_ERR;
+	if (cmd_arg_u32_opt(cc, 3, &top, 20)) return DBG_ERR;
+	if ((ms < 1) || (ms > PROFILE_MAX_MS)) {
+		ERROR("profile: duration must be 1..%u ms\n", PROFILE_MAX_MS);
+		return DBG_ERR;
+	}
+	if ((fn != NULL) && ((st = elf_symtab_load(fn)) == NULL)) {
+		return DBG_ERR;
+	}
+
+	// the DWT is only accessible with TRCENA set
+	if ((dc_mem_rd32(dc, DEMCR, &demcr) < 0) ||
+		(dc_mem_wr32(dc, DEMCR, demcr | DEMCR_TRCENA) < 0)) {
+		ERROR("profile: cannot enable DWT\n");
+		goto done;
+	}
+
+	t0 = now();
+	if (sample(dc, ms, &buf, &count) < 0) {
+		goto done;
+	}
+	if ((t1 = now()) == t0) {
+		t1++;
+	}
+
+	qsort(buf, count, sizeof(uint32_t), u32_cmp);
+	for (halted = 0; (halted < count) && (buf[count - halted - 1] == PCSR_HALTED); ) {
+		halted++;
+	}
+	INFO("profile: %u samples in %lld ms (%lld/s), %u while halted\n",
+		count, (t1 - t0) / 1000, (count * 1000000LL) / (t1 - t0), halted);
+	count -= halted;
+	if (count == 0) {
+		status = DBG_OK;
+		goto done;
+	}
+
+	if ((b = malloc(sizeof(bucket) * count)) == NULL) {
+		ERROR("profile: out of memory\n");
+		goto done;
+	}
+	n = histogram(buf, count, b);
+	if (st != NULL) {
+		n = by_function(b, n, st);
+	}
+	qsort(b, n, sizeof(bucket), bucket_cmp);
+	for (unsigned i = 0; (i < n) && (i < top); i++) {
+		double pct = (100.0 * b[i].count) / count;
+		if (st == NULL) {
+			INFO("%6.2f%% %8u  %08x\n", pct, b[i].count, b[i].pc);
+		} else if (b[i].sym == NULL) {
+			INFO("%6.2f%% %8u  <unknown>\n", pct, b[i].count);
+		} else {
+			INFO("%6.2f%% %8u  %s\n", pct, b[i].count, b[i].sym->name);
+		}
+	}
+	status = DBG_OK;
+done:
+	free(b);
+	free(buf);
+	elf_symtab_free(st);
+	return status;
+}
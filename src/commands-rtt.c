@@ -0,0 +1,192 @@
+// Copyright 2023, Brian Swetland <swetland@frotz.net>
+// Licensed under the Apache License, Version 2.0.
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "xdebug.h"
+#include "transport.h"
+#include "rtt.h"
+#include "tui.h"
+
+// The control block is searched for, and once found the up buffers
+// are polled, from the work thread between commands (rtt_periodic).
+// Polling speeds up while data is flowing and backs off when idle.
+
+#define RTT_SEARCH_ADDR 0x20000000
+#define RTT_SEARCH_LEN  0x10000
+
+#define RTT_SEARCH_MS   1000 // between searches for the control block
+#define RTT_POLL_MIN_MS 10
+#define RTT_POLL_MAX_MS 250
+
+#define RTT_OFF    0
+#define RTT_SEARCH 1
+#define RTT_ACTIVE 2
+
+static struct {
+	int state;
+	uint32_t addr;      // search range
+	uint32_t len;
+	uint32_t interval;  // current poll interval (ms)
+	uint32_t bytes;
+	rtt_cb cb;
+	tui_ch_t* ch[RTT_MAX_UP];
+	int bol[RTT_MAX_UP];
+} rtt;
+
+static void rtt_data(void* cookie, unsigned n, const uint8_t* ptr, unsigned len) {
+	if ((rtt.ch[n] == NULL) && tui_ch_create(rtt.ch + n, 0)) {
+		return;
+	}
+	// the channel assembles lines, we add the prefix
+	while (len > 0) {
+		unsigned xfer = 0;
+		while ((xfer < len) && (ptr[xfer++] != '\n')) ;
+		if (rtt.bol[n]) {
+			tui_ch_printf(rtt.ch[n], "rtt%u: ", n);
+		}
+		tui_ch_printf(rtt.ch[n], "%.*s", xfer, ptr);
+		rtt.bol[n] = (ptr[xfer - 1] == '\n');
+		ptr += xfer;
+		len -= xfer;
+	}
+}
+
+static int rtt_search(DC* dc) {
+	if (rtt_find(dc, rtt.addr, rtt.len, &rtt.cb) != 1) {
+		return 0;
+	}
+	INFO("rtt: control block at %08x, %u up, %u down\n",
+		rtt.cb.addr, rtt.cb.max_up, rtt.cb.max_down);
+	rtt.state = RTT_ACTIVE;
+	rtt.interval = RTT_POLL_MIN_MS;
+	return 1;
+}
+
+int rtt_periodic(DC* dc) {
+	int r;
+	// polling a detached target would auto-attach to it
+	if ((rtt.state != RTT_OFF) && (dc_get_status(dc) != DC_ATTACHED)) {
+		return RTT_SEARCH_MS;
+	}
+	switch (rtt.state) {
+	case RTT_SEARCH:
+		// failures here are expected (target running from reset, etc)
+		return rtt_search(dc) ? 0 : RTT_SEARCH_MS;
+	case RTT_ACTIVE:
+		if ((r = rtt_read(dc, &rtt.cb, rtt_data, NULL)) < 0) {
+			if (r == DC_ERR_BAD_STATE) {
+				INFO("rtt: control block gone, searching\n");
+			} else {
+				ERROR("rtt: read failed (%d), searching\n", r);
+			}
+			rtt.state = RTT_SEARCH;
+			return RTT_SEARCH_MS;
+		}
+		if (r > 0) {
+			rtt.bytes += r;
+			rtt.interval = RTT_POLL_MIN_MS;
+		} else if ((rtt.interval *= 2) > RTT_POLL_MAX_MS) {
+			rtt.interval = RTT_POLL_MAX_MS;
+		}
+		return rtt.interval;
+	default:
+		return RTT_SEARCH_MS;
+	}
+}
+
+int do_rtt(DC* dc, CC* cc) {
+	const char* cmd;
+
+	if (cmd_argc(cc) == 1) {
+		switch (rtt.state) {
+		case RTT_OFF:
+			INFO("rtt: start [ <addr> [ <len> ] ] | stop\n");
+			break;
+		case RTT_SEARCH:
+			INFO("rtt: searching %08x..%08x\n", rtt.addr, rtt.addr + rtt.len);
+			break;
+		case RTT_ACTIVE:
+			INFO("rtt: control block at %08x, %u bytes, polling every %u ms\n",
+				rtt.cb.addr, rtt.bytes, rtt.interval);
+			for (unsigned n = 0; n < rtt.cb.num_up; n++) {
+				INFO("rtt: up%u   %08x %u bytes\n", n, rtt.cb.up[n].buf, rtt.cb.up[n].size);
+			}
+			for (unsigned n = 0; n < rtt.cb.num_down; n++) {
+				INFO("rtt: down%u %08x %u bytes\n", n, rtt.cb.down[n].buf, rtt.cb.down[n].size);
+			}
+			break;
+		}
+		return 0;
+	}
+	if (cmd_arg_str(cc, 1, &cmd)) return DBG_ERR;
+	if (!strcmp(cmd, "start")) {
+		if (cmd_arg_u32_opt(cc, 2, &rtt.addr, RTT_SEARCH_ADDR)) return DBG_ERR;
+		if (cmd_arg_u32_opt(cc, 3, &rtt.len, RTT_SEARCH_LEN)) return DBG_ERR;
+		rtt.bytes = 0;
+		for (unsigned n = 0; n < RTT_MAX_UP; n++) {
+			rtt.bol[n] = 1;
+		}
+		rtt.state = RTT_SEARCH;
+		if (!rtt_search(dc)) {
+			INFO("rtt: searching %08x..%08x\n", rtt.addr, rtt.addr + rtt.len);
+		}
+		return 0;
+	} else if (!strcmp(cmd, "stop")) {
+		rtt.state = RTT_OFF;
+		return 0;
+	}
+	ERROR("rtt: unknown command '%s'\n", cmd);
+	return DBG_ERR;
+}
+
+int do_wconsole(DC* dc, CC* cc) {
+	const char* s;
+	char* line;
+	int r;
+
+	if (cmd_arg_str(cc, 1, &s)) return DBG_ERR;
+	if (rtt.state != RTT_ACTIVE) {
+		ERROR("rtt: not connected\n");
+		return DBG_ERR;
+	}
+	if (rtt.cb.num_down == 0) {
+		ERROR("rtt: target has no input buffer\n");
+		return DBG_ERR;
+	}
+	// the tokenizer split the line, so put it back together
+	unsigned argc = cmd_argc(cc);
+	unsigned len = 0;
+	for (unsigned n = 1; n < argc; n++) {
+		cmd_arg_str(cc, n, &s);
+		len += strlen(s) + 1;
+	}
+	if ((line = malloc(len)) == NULL) {
+		return DBG_ERR;
+	}
+	len = 0;
+	for (unsigned n = 1; n < argc; n++) {
+		cmd_arg_str(cc, n, &s);
+		if (n > 1) {
+			line[len++] = ' ';
+		}
+		memcpy(line + len, s, strlen(s));
+		len += strlen(s);
+	}
+	line[len++] = '\n';
+	r = rtt_write(dc, &rtt.cb, 0, line, len);
+	free(line);
+	if (r < 0) {
+		ERROR("rtt: write failed (%d)\n", r);
+		return DBG_ERR;
+	}
+	if (r < len) {
+		ERROR("rtt: input buffer full, %u of %u bytes dropped\n", len - r, len);
+		return DBG_ERR;
+	}
+	// the target is likely to answer
+	rtt.interval = RTT_POLL_MIN_MS;
+	return 0;
+}
@@ -0,0 +1,450 @@
+// Copyright 2023, Brian Swetland <swetland@frotz.net>
+// Licensed under the Apache License, Version 2.0.
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <pthread.h>
+
+#include "xdebug.h"
+#include "transport.h"
+#include "arm-v7-debug.h"
+#include "itm.h"
+#include "tui.h"
+
+// Trace data is copied into a large ring as it arrives and decoded
+// by a thread of its own, so that neither the probe's trace stream
+// nor the debugger ever waits on the TUI (or a slow disk).
+
+#define SWO_RING_SIZE (4 * 1024 * 1024)
+
+#define SWO_PORTS 32
+
+// TraceBusID for the ITM, which matters only with the formatter on
+#define SWO_ITM_BUS_ID 1
+
+// DWT_CTRL bits "swo dwt" controls, on top of CYCCNTENA and SYNCTAP
+// one PC sample every 16 * 1024 cycles
+#define SWO_DWT_PC  (DWT_CTRL_PCSAMPLENA | DWT_CTRL_CYCTAP | \
+	(15 << DWT_CTRL_POSTPRESET_SHIFT))
+#define SWO_DWT_EXC DWT_CTRL_EXCTRCENA
+#define SWO_DWT_MASK (DWT_CTRL_PCSAMPLENA | DWT_CTRL_EXCTRCENA | \
+	DWT_CTRL_CYCTAP | DWT_CTRL_POSTPRESET_MASK)
+
+typedef struct {
+	tui_ch_t* ch;       // created on first use by the decoder thread
+	FILE* fp;           // open while capturing, if logging to a file
+	char* fn;
+	int bol;            // at the beginning of a line
+} swo_output;
+
+static struct {
+	uint8_t* ring;
+	uint32_t rd;        // free running, so (wr - rd) is the fill level
+	uint32_t wr;
+	uint32_t lost;      // bytes dropped because the ring was full
+	int running;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t thread;
+
+	itm_decoder itm;
+	swo_output port[SWO_PORTS];
+	swo_output dwt;
+	uint32_t dwt_ctrl;  // SWO_DWT_* enabled by "swo dwt"
+
+	uint32_t packets;
+	uint32_t overflows;
+	uint32_t errors;
+	uint32_t dropped;
+} swo = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+};
+
+// called by the transport, possibly from its own thread
+static void swo_data(void* cookie, const uint8_t* data, unsigned len) {
+	pthread_mutex_lock(&swo.lock);
+	uint32_t wr = swo.wr;
+	uint32_t space = SWO_RING_SIZE - (wr - swo.rd);
+	pthread_mutex_unlock(&swo.lock);
+
+	// only this thread moves wr, and rd only ever grows the space
+	uint32_t lost = 0;
+	if (len > space) {
+		lost = len - space;
+		len = space;
+	}
+	while (len > 0) {
+		uint32_t off = wr % SWO_RING_SIZE;
+		uint32_t xfer = SWO_RING_SIZE - off;
+		if (xfer > len) {
+			xfer = len;
+		}
+		memcpy(swo.ring + off, data, xfer);
+		data += xfer;
+		wr += xfer;
+		len -= xfer;
+	}
+
+	pthread_mutex_lock(&swo.lock);
+	swo.wr = wr;
+	swo.lost += lost;
+	pthread_cond_signal(&swo.cond);
+	pthread_mutex_unlock(&swo.lock);
+}
+
+static tui_ch_t* output_ch(swo_output* out) {
+	if ((out->ch == NULL) && tui_ch_create(&out->ch, 0)) {
+		return NULL;
+	}
+	return out->ch;
+}
+
+static void dwt_printf(const char* fmt, ...) {
+	va_list ap;
+	tui_ch_t* ch;
+	va_start(ap, fmt);
+	if (swo.dwt.fp != NULL) {
+		vfprintf(swo.dwt.fp, fmt, ap);
+	} else if ((ch = output_ch(&swo.dwt)) != NULL) {
+		tui_ch_printf(ch, "dwt: ");
+		tui_ch_vprintf(ch, fmt, ap);
+	}
+	va_end(ap);
+}
+
+static void swo_stimulus(unsigned n, const itm_packet* pkt) {
+	swo_output* out = swo.port + n;
+	tui_ch_t* ch;
+	uint8_t data[4];
+	for (unsigned i = 0; i < pkt->len; i++) {
+		data[i] = pkt->value >> (8 * i);
+	}
+	if (out->fp != NULL) {
+		fwrite(data, 1, pkt->len, out->fp);
+		return;
+	}
+	if ((ch = output_ch(out)) == NULL) {
+		return;
+	}
+	// the channel assembles lines, we add the prefix
+	for (unsigned i = 0; i < pkt->len; i++) {
+		if (out->bol) {
+			tui_ch_printf(ch, "itm%u: ", n);
+			out->bol = 0;
+		}
+		tui_ch_printf(ch, "%c", data[i]);
+		if (data[i] == '\n') {
+			out->bol = 1;
+		}
+	}
+}
+
+static void swo_hardware(const itm_packet* pkt) {
+	static const char* fn[4] = { "?", "enter", "exit", "return" };
+	unsigned id = pkt->id;
+	uint32_t v = pkt->value;
+	switch (id) {
+	case ITM_DWT_EVENT:
+		dwt_printf("event counter overflow%s%s%s%s%s%s\n",
+			(v & ITM_EVENT_CPI) ? " cpi" : "",
+			(v & ITM_EVENT_EXC) ? " exc" : "",
+			(v & ITM_EVENT_SLEEP) ? " sleep" : "",
+			(v & ITM_EVENT_LSU) ? " lsu" : "",
+			(v & ITM_EVENT_FOLD) ? " fold" : "",
+			(v & ITM_EVENT_CYC) ? " cyc" : "");
+		return;
+	case ITM_DWT_EXCEPTION:
+		dwt_printf("exception %u %s\n", ITM_EXC_NUM(v), fn[ITM_EXC_FN(v)]);
+		return;
+	case ITM_DWT_PC:
+		if (pkt->len == 4) {
+			dwt_printf("pc %08x\n", v);
+		} else {
+			dwt_printf("pc sleeping\n");
+		}
+		return;
+	}
+	if ((id >= ITM_DWT_DATA_PC) && (id <= (ITM_DWT_DATA_WR + 6))) {
+		unsigned comp = (id >> 1) & 3;
+		if (id >= ITM_DWT_DATA_RD) {
+			dwt_printf("comp%u %s %0*x\n", comp, (id & 1) ? "write" : "read",
+				pkt->len * 2, v);
+		} else if (id & 1) {
+			dwt_printf("comp%u addr %04x\n", comp, v);
+		} else {
+			dwt_printf("comp%u pc %08x\n", comp, v);
+		}
+		return;
+	}
+	dwt_printf("source %u: %0*x\n", id, pkt->len * 2, v);
+}
+
+static void swo_packet(void* cookie, const itm_packet* pkt) {
+	swo.packets++;
+	switch (pkt->type) {
+	case ITM_SWIT:
+		swo_stimulus(pkt->id, pkt);
+		break;
+	case ITM_HWIT:
+		swo_hardware(pkt);
+		break;
+	case ITM_OVERFLOW:
+		swo.overflows++;
+		break;
+	case ITM_ERROR:
+		swo.errors++;
+		break;
+	}
+}
+
+static void* swo_decoder(void* arg) {
+	pthread_mutex_lock(&swo.lock);
+	for (;;) {
+		while (swo.running && (swo.rd == swo.wr) && (swo.lost == 0)) {
+			pthread_cond_wait(&swo.cond, &swo.lock);
+		}
+		uint32_t rd = swo.rd;
+		uint32_t avail = swo.wr - rd;
+		uint32_t lost = swo.lost;
+		swo.lost = 0;
+		if ((avail == 0) && (lost == 0)) {
+			// stopped, and drained
+			break;
+		}
+		pthread_mutex_unlock(&swo.lock);
+
+		if (lost) {
+			// whatever was in progress won't be completed
+			swo.dropped += lost;
+			itm_reset(&swo.itm);
+		}
+		uint32_t off = rd % SWO_RING_SIZE;
+		if (avail > (SWO_RING_SIZE - off)) {
+			avail = SWO_RING_SIZE - off;
+		}
+		itm_decode(&swo.itm, swo.ring + off, avail);
+
+		pthread_mutex_lock(&swo.lock);
+		swo.rd = rd + avail;
+	}
+	pthread_mutex_unlock(&swo.lock);
+	return NULL;
+}
+
+static void swo_close_outputs(void) {
+	for (unsigned n = 0; n <= SWO_PORTS; n++) {
+		swo_output* out = (n == SWO_PORTS) ? &swo.dwt : (swo.port + n);
+		if (out->fp != NULL) {
+			fclose(out->fp);
+			out->fp = NULL;
+		}
+	}
+}
+
+static int swo_open_outputs(void) {
+	for (unsigned n = 0; n <= SWO_PORTS; n++) {
+		swo_output* out = (n == SWO_PORTS) ? &swo.dwt : (swo.port + n);
+		out->bol = 1;
+		if ((out->fn != NULL) && ((out->fp = fopen(out->fn, "wb")) == NULL)) {
+			ERROR("swo: cannot open '%s'\n", out->fn);
+			swo_close_outputs();
+			return DBG_ERR;
+		}
+	}
+	return 0;
+}
+
+static void swo_stop(DC* dc) {
+	dc_swo_stop(dc);
+	if (swo.running) {
+		pthread_mutex_lock(&swo.lock);
+		swo.running = 0;
+		pthread_cond_signal(&swo.cond);
+		pthread_mutex_unlock(&swo.lock);
+		pthread_join(swo.thread, NULL);
+		swo_close_outputs();
+	}
+}
+
+// route the ITM and DWT to the TPIU, and the TPIU to the SWO pin
+static int swo_target_config(DC* dc, uint32_t hz, uint32_t baud, uint32_t mode, uint32_t ports) {
+	uint32_t demcr, ctrl;
+	uint32_t acpr = ((hz + baud / 2) / baud);
+	if ((acpr < 1) || ((acpr - 1) > TPIU_ACPR_MAX)) {
+		ERROR("swo: cannot divide %u Hz down to %u baud\n", hz, baud);
+		return DBG_ERR;
+	}
+	if ((hz / acpr) > (baud + baud / 32) || (hz / acpr) < (baud - baud / 32)) {
+		ERROR("swo: %u Hz / %u is not close enough to %u baud\n", hz, acpr, baud);
+		return DBG_ERR;
+	}
+	if (dc_mem_rd32(dc, DEMCR, &demcr) ||
+		dc_mem_wr32(dc, DEMCR, demcr | DEMCR_TRCENA) ||
+		dc_mem_wr32(dc, TPIU_CSPSR, 1) ||
+		dc_mem_wr32(dc, TPIU_ACPR, acpr - 1) ||
+		dc_mem_wr32(dc, TPIU_SPPR, (mode == DC_SWO_UART) ?
+			TPIU_SPPR_NRZ : TPIU_SPPR_MANCHESTER) ||
+		dc_mem_wr32(dc, TPIU_FFCR, TPIU_FFCR_TRIGIN) ||
+		dc_mem_wr32(dc, ITM_LAR, ITM_LAR_KEY) ||
+		dc_mem_wr32(dc, ITM_TCR, 0) ||
+		dc_mem_wr32(dc, ITM_TER, ports) ||
+		dc_mem_wr32(dc, ITM_TCR, ITM_TCR_TRACEBUSID(SWO_ITM_BUS_ID) |
+			ITM_TCR_TXENA | ITM_TCR_SYNCENA | ITM_TCR_ITMENA) ||
+		dc_mem_rd32(dc, DWT_CTRL, &ctrl)) {
+		ERROR("swo: cannot configure ITM and TPIU\n");
+		return DBG_ERR;
+	}
+	// sync packets (which need CYCCNT running) let the decoder
+	// recover if trace data is ever lost
+	ctrl = (ctrl & ~(SWO_DWT_MASK | DWT_CTRL_SYNCTAP_MASK)) | swo.dwt_ctrl;
+	if (!(ctrl & DWT_CTRL_NOCYCCNT)) {
+		ctrl |= DWT_CTRL_CYCCNTENA | DWT_CTRL_SYNCTAP_24;
+	}
+	if (dc_mem_wr32(dc, DWT_CTRL, ctrl)) {
+		ERROR("swo: cannot configure DWT\n");
+		return DBG_ERR;
+	}
+	return 0;
+}
+
+static int swo_start(DC* dc, uint32_t hz, uint32_t baud, uint32_t ports) {
+	uint32_t mode;
+	int r;
+
+	swo_stop(dc);
+	if ((swo.ring == NULL) && ((swo.ring = malloc(SWO_RING_SIZE)) == NULL)) {
+		ERROR("swo: out of memory\n");
+		return DBG_ERR;
+	}
+	if (swo_open_outputs()) {
+		return DBG_ERR;
+	}
+	itm_init(&swo.itm, swo_packet, NULL);
+	swo.rd = swo.wr = swo.lost = 0;
+	swo.packets = swo.overflows = swo.errors = swo.dropped = 0;
+	swo.running = 1;
+	if (pthread_create(&swo.thread, NULL, swo_decoder, NULL) != 0) {
+		ERROR("swo: cannot start decoder\n");
+		swo.running = 0;
+		swo_close_outputs();
+		return DBG_ERR;
+	}
+
+	if ((r = dc_swo_start(dc, &baud, &mode, swo_data, NULL)) < 0) {
+		if (r == DC_ERR_UNSUPPORTED) {
+			ERROR("swo: not supported by the probe (at that rate)\n");
+		} else {
+			ERROR("swo: cannot start capture (%d)\n", r);
+		}
+		swo_stop(dc);
+		return DBG_ERR;
+	}
+	if (swo_target_config(dc, hz, baud, mode, ports)) {
+		swo_stop(dc);
+		return DBG_ERR;
+	}
+	INFO("swo: capturing at %u baud (%s), ports %08x\n", baud,
+		(mode == DC_SWO_UART) ? "uart" : "manchester", ports);
+	return 0;
+}
+
+static int swo_log(DC* dc, CC* cc) {
+	const char* name;
+	const char* fn;
+	swo_output* out;
+	uint32_t n;
+
+	if (cmd_arg_str(cc, 2, &name)) return DBG_ERR;
+	if (cmd_arg_str_opt(cc, 3, &fn, NULL)) return DBG_ERR;
+	if (!strcmp(name, "dwt")) {
+		out = &swo.dwt;
+	} else {
+		if (cmd_arg_u32(cc, 2, &n)) return DBG_ERR;
+		if (n >= SWO_PORTS) {
+			ERROR("swo: no stimulus port %u\n", n);
+			return DBG_ERR;
+		}
+		out = swo.port + n;
+	}
+	if (swo.running) {
+		ERROR("swo: stop capture first\n");
+		return DBG_ERR;
+	}
+	free(out->fn);
+	out->fn = NULL;
+	if (fn != NULL) {
+		if ((out->fn = malloc(strlen(fn) + 1)) == NULL) {
+			return DBG_ERR;
+		}
+		strcpy(out->fn, fn);
+	}
+	return 0;
+}
+
+static int swo_dwt(DC* dc, CC* cc) {
+	const char* s;
+	uint32_t ctrl = 0;
+	for (unsigned n = 2; (cmd_arg_str_opt(cc, n, &s, NULL) == 0) && (s != NULL); n++) {
+		if (!strcmp(s, "pc")) {
+			ctrl |= SWO_DWT_PC;
+		} else if (!strcmp(s, "exc")) {
+			ctrl |= SWO_DWT_EXC;
+		} else {
+			ERROR("swo: dwt [ pc ] [ exc ]\n");
+			return DBG_ERR;
+		}
+	}
+	swo.dwt_ctrl = ctrl;
+	if (swo.running) {
+		uint32_t val;
+		if (dc_mem_rd32(dc, DWT_CTRL, &val) ||
+			dc_mem_wr32(dc, DWT_CTRL, (val & ~SWO_DWT_MASK) | ctrl)) {
+			ERROR("swo: cannot configure DWT\n");
+			return DBG_ERR;
+		}
+	}
+	return 0;
+}
+
+int do_swo(DC* dc, CC* cc) {
+	const char* cmd;
+	uint32_t hz, baud, ports;
+
+	if (cmd_argc(cc) == 1) {
+		uint32_t bytes, overruns;
+		if (!swo.running) {
+			INFO("swo: start <cpu-hz> <baud> [ <ports> ] | stop\n");
+			INFO("swo: log <port> | dwt [ <file> ]\n");
+			INFO("swo: dwt [ pc ] [ exc ]\n");
+			return 0;
+		}
+		dc_swo_stats(dc, &bytes, &overruns);
+		INFO("swo: %u bytes, %u packets, %u probe overruns, %u bytes dropped\n",
+			bytes, swo.packets, overruns, swo.dropped);
+		INFO("swo: %u ITM overflows, %u bad packets\n", swo.overflows, swo.errors);
+		return 0;
+	}
+	if (cmd_arg_str(cc, 1, &cmd)) return DBG_ERR;
+	if (!strcmp(cmd, "start")) {
+		if (cmd_arg_u32(cc, 2, &hz)) return DBG_ERR;
+		if (cmd_arg_u32(cc, 3, &baud)) return DBG_ERR;
+		if (cmd_arg_u32_opt(cc, 4, &ports, 0xFFFFFFFF)) return DBG_ERR;
+		if ((hz == 0) || (baud == 0)) {
+			ERROR("swo: clock and baud rate must not be zero\n");
+			return DBG_ERR;
+		}
+		return swo_start(dc, hz, baud, ports);
+	} else if (!strcmp(cmd, "stop")) {
+		swo_stop(dc);
+		return 0;
+	} else if (!strcmp(cmd, "log")) {
+		return swo_log(dc, cc);
+	} else if (!strcmp(cmd, "dwt")) {
+		return swo_dwt(dc, cc);
+	}
+	ERROR("swo: unknown command '%s'\n", cmd);
+	return DBG_ERR;
+}
@@ -110,8 +110,8 @@ int do_dw(DC* dc, CC* cc) {
 }
 
 int do_db(DC* dc, CC* cc) {
-	uint32_t data[1024 + 8];
-	uint32_t addr, count, bytecount;
+	uint8_t data[1024];
+	uint32_t addr, count;
 	uint8_t *x;
 	unsigned n;
 
@@ -121,25 +121,14 @@ int do_db(DC* dc, CC* cc) {
 	lastaddr = addr;
 	lastcount = count;
 
-	bytecount = count;
-	x = (void*) data;
-	if (addr & 3) {
-		x += (addr & 3);
-		count += 4 - (addr & 3);
-		addr &= 3;
-	}
-	if (count & 3) {
-		count += 4 - (count & 3);
-	}
-	count /= 4;
 	if (count < 1) return 0;
+	if (dc_mem_read(dc, addr, count, data)) return DBG_ERR;
 
-	if (dc_mem_rd_words(dc, addr, count, data)) return DBG_ERR;
-
-	while (bytecount > 0) {
-		n = (bytecount > 16) ? 16 : bytecount;
+	x = data;
+	while (count > 0) {
+		n = (count > 16) ? 16 : count;
 		INFO("%08x:", addr);
-		bytecount -= n;
+		count -= n;
 		addr += n;
 		while (n-- > 0) {
 			INFO(" %02x", *x++);
@@ -279,6 +268,8 @@ static struct {
 	{ DCF_POLL,        "poll",        "verify target state while attached" },
 	{ DCF_AUTO_ATTACH, "auto-attach", "automatically attach to target on command" },
 	{ DCF_AUTO_CONFIG, "auto-config", "set flags based on target probe on attach" },
+	{ DCF_REG_CACHE,   "reg-cache",   "keep DP/AP register caches between commands" },
+	{ DCF_WRITE_COMBINE, "write-combine", "defer word and register writes until a read" },
 };
 
 #define NUMFLAGS (sizeof(FLAGS)/sizeof(FLAGS[0]))
@@ -286,7 +277,7 @@ static struct {
 static int text_to_flag(const char* s, uint32_t* flag) {
 	for (unsigned n = 0; n < NUMFLAGS; n++) {
 		if (!strcmp(FLAGS[n].name, s)) {
-			*flag = FLAGS[n].flag;
+			*flag |= FLAGS[n].flag;
 			return 0;
 		}
 	}
@@ -297,7 +288,7 @@ int do_set(DC* dc, CC* cc) {
 	if (cmd_argc(cc) == 1) {
 		uint32_t set = dc_flags(dc, 0, 0);
 		for (unsigned n = 0; n < NUMFLAGS; n++) {
-			INFO("%c%-12s %s\n", set & FLAGS[n].flag ? '+' : '-',
+			INFO("%c%-14s %s\n", set & FLAGS[n].flag ? '+' : '-',
 				FLAGS[n].name, FLAGS[n].info);
 		}
 		return 0;
@@ -313,7 +304,7 @@ int do_set(DC* dc, CC* cc) {
 				return DBG_ERR;
 			}
 		} else if (s[0] == '+') {
-			if (text_to_flag(s + 1, &clr)) {
+			if (text_to_flag(s + 1, &set)) {
 				ERROR("unknown flag '%s'\n", s + 1);
 				return DBG_ERR;
 			}
@@ -326,6 +317,134 @@ int do_set(DC* dc, CC* cc) {
 	return 0;
 }
 
+int do_cache(DC* dc, CC* cc) {
+	uint32_t addr, len;
+	const char* s;
+	if (cmd_argc(cc) == 1) {
+		for (unsigned n = 0; dc_cache_region(dc, n, &addr, &len) == 0; n++) {
+			INFO("cache: %08x - %08x\n", addr, addr + len - 1);
+		}
+		dc_cache_stats(dc, &addr, &len);
+		INFO("cache: %u page hits, %u page misses\n", addr, len);
+		return 0;
+	}
+	if (cmd_argc(cc) == 2) {
+		if (cmd_arg_str(cc, 1, &s)) return DBG_ERR;
+		if (!strcmp(s, "off")) {
+			dc_cache_clear(dc);
+			return 0;
+		}
+	}
+	if (cmd_arg_u32(cc, 1, &addr)) return DBG_ERR;
+	if (cmd_arg_u32(cc, 2, &len)) return DBG_ERR;
+	if (dc_cache_add(dc, addr, len) < 0) {
+		ERROR("cache: cannot cache %08x (%u bytes)\n", addr, len);
+		return DBG_ERR;
+	}
+	return 0;
+}
+
+static const char* wp_kinds[] = { "", "r", "w", "rw" };
+
+int do_bp(DC* dc, CC* cc) {
+	uint32_t addr, nbp, nwp;
+	const char* s;
+	int r;
+	if (cmd_argc(cc) == 1) {
+		dc_bp_info(dc, &nbp, &nwp);
+		for (unsigned n = 0; dc_bp_get(dc, n, &addr) == 0; n++) {
+			INFO("bp: %08x\n", addr);
+		}
+		INFO("bp: %u hardware breakpoints\n", nbp);
+		return 0;
+	}
+	if (cmd_arg_str(cc, 1, &s)) return DBG_ERR;
+	if (!strcmp(s, "clear")) {
+		if (cmd_argc(cc) == 2) {
+			while (dc_bp_get(dc, 0, &addr) == 0) {
+				dc_bp_clr(dc, addr);
+			}
+			return 0;
+		}
+		if (cmd_arg_u32(cc, 2, &addr)) return DBG_ERR;
+		if (dc_bp_clr(dc, addr) < 0) {
+			ERROR("bp: no breakpoint at %08x\n", addr);
+			return DBG_ERR;
+		}
+		return 0;
+	}
+	if (cmd_arg_u32(cc, 1, &addr)) return DBG_ERR;
+	if ((r = dc_bp_set(dc, addr)) < 0) {
+		if (r == DC_ERR_FAILED) {
+			ERROR("bp: no free comparators\n");
+		} else {
+			ERROR("bp: cannot break at %08x\n", addr);
+		}
+		return DBG_ERR;
+	}
+	return 0;
+}
+
+int do_wp(DC* dc, CC* cc) {
+	uint32_t addr, len, kind, nbp, nwp;
+	const char* s;
+	int r;
+	if (cmd_argc(cc) == 1) {
+		dc_bp_info(dc, &nbp, &nwp);
+		for (unsigned n = 0; dc_wp_get(dc, n, &addr, &len, &kind) == 0; n++) {
+			INFO("wp: %08x %u %s\n", addr, len, wp_kinds[kind]);
+		}
+		INFO("wp: %u hardware watchpoints\n", nwp);
+		return 0;
+	}
+	if (cmd_arg_str(cc, 1, &s)) return DBG_ERR;
+	if (!strcmp(s, "clear")) {
+		unsigned n = 0, found = 0;
+		if (cmd_argc(cc) == 2) {
+			while (dc_wp_get(dc, 0, &addr, &len, &kind) == 0) {
+				dc_wp_clr(dc, addr, len, kind);
+			}
+			return 0;
+		}
+		uint32_t match;
+		if (cmd_arg_u32(cc, 2, &match)) return DBG_ERR;
+		while (dc_wp_get(dc, n, &addr, &len, &kind) == 0) {
+			if (addr == match) {
+				dc_wp_clr(dc, addr, len, kind);
+				found++;
+			} else {
+				n++;
+			}
+		}
+		if (!found) {
+			ERROR("wp: no watchpoint at %08x\n", match);
+			return DBG_ERR;
+		}
+		return 0;
+	}
+	if (cmd_arg_u32(cc, 1, &addr)) return DBG_ERR;
+	if (cmd_arg_u32_opt(cc, 2, &len, 4)) return DBG_ERR;
+	if (cmd_arg_str_opt(cc, 3, &s, "rw")) return DBG_ERR;
+	for (kind = DC_WP_ACCESS; kind > 0; kind--) {
+		if (!strcmp(s, wp_kinds[kind])) {
+			break;
+		}
+	}
+	if (kind == 0) {
+		ERROR("wp: access must be r, w, or rw\n");
+		return DBG_ERR;
+	}
+	if ((r = dc_wp_set(dc, addr, len, kind)) < 0) {
+		if (r == DC_ERR_FAILED) {
+			ERROR("wp: no free comparators\n");
+		} else {
+			ERROR("wp: cannot watch %08x (%u bytes)\n", addr, len);
+		}
+		return DBG_ERR;
+	}
+	return 0;
+}
+
 int do_exit(DC* dc, CC* cc) {
 	debugger_exit();
 	return 0;
@@ -351,12 +470,20 @@ struct {
 { "wr",         do_wr,         "write word            wr <addr> <val>" },
 { "regs",       do_regs,       "dump registers" },
 { "setarch",    do_setarch,    "select flash agent    setarch <name>" },
-{ "flash",      do_flash,      "write file to flash   flash <file> <addr>" },
+{ "flash",      do_flash,      "write file to flash   flash [ -diff ] [ -verify ] <file> [ <addr> ]" },
 { "erase",      do_erase,      "erase flash           erase all | erase <addr> <len>" },
-{ "download",   do_download,   "write file to memory  download <file> <addr>" },
+{ "download",   do_download,   "write file to memory  download <file> [ <addr> ]" },
 { "upload",     do_upload,     "read memory to file   upload <file> <addr> <len>" },
+{ "profile",    do_profile,    "sample PC             profile <ms> [ <elf> [ <count> ] ]" },
+{ "swo",        do_swo,        "capture SWO trace     swo start <cpu-hz> <baud> [ <ports> ] | stop" },
+{ "gdbserver",  do_gdbserver,  "serve gdb remote      gdbserver <port> | <path> | stop" },
+{ "rtt",        do_rtt,        "RAM console           rtt start [ <addr> [ <len> ] ] | stop" },
+{ "wconsole",   do_wconsole,   "write RAM console     wconsole <text> (or /<text>)" },
 { "setclock",   do_setclock,   "set SWD clock freq    setclock <mhz>" },
 { "set",        do_set,        "adjust features       set [+-]<feature>" },
+{ "bp",         do_bp,         "hw breakpoint         bp [ <addr> | clear [ <addr> ] ]" },
+{ "wp",         do_wp,         "hw watchpoint         wp [ <addr> [ <len> [ r|w|rw ] ] | clear [ <addr> ] ]" },
+{ "cache",      do_cache,      "cache memory (halted) cache [ <addr> <len> | off ]" },
 { "help",       do_help,       "list commands" },
 { "exit",       do_exit,       "exit debugger" },
 { "quit",       do_exit,       NULL },
@@ -382,6 +509,9 @@ void debugger_command(DC* dc, CC* cc) {
 	for (int n = 0; n < sizeof(CMDS)/sizeof(CMDS[0]); n++) {
 		if (!strcmp(cmd, CMDS[n].name)) {
 			CMDS[n].func(dc, cc);
+			if (dc_flush(dc) < 0) {
+				ERROR("%s: deferred writes failed\n", cmd);
+			}
 			return;
 		}
 	}
@@ -0,0 +1,142 @@
+// Copyright 2023, Brian Swetland <swetland@frotz.net>
+// Licensed under the Apache License, Version 2.0.
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "xdebug.h"
+#include "elf.h"
+
+int elf_check(const void* data, uint32_t sz, elf32_hdr* hdr) {
+	if (sz < sizeof(elf32_hdr)) {
+		return -1;
+	}
+	memcpy(hdr, data, sizeof(elf32_hdr));
+	if (memcmp(hdr->ident, "\x7f" "ELF", 4) ||
+		(hdr->ident[4] != ELFCLASS32) ||
+		(hdr->ident[5] != ELFDATA2LSB)) {
+		return -1;
+	}
+	if (hdr->shnum && ((hdr->shentsize != sizeof(elf32_shdr)) ||
+		(hdr->shoff > sz) ||
+		(hdr->shnum > ((sz - hdr->shoff) / sizeof(elf32_shdr))))) {
+		return -1;
+	}
+	if (hdr->phnum && ((hdr->phentsize != sizeof(elf32_phdr)) ||
+		(hdr->phoff > sz) ||
+		(hdr->phnum > ((sz - hdr->phoff) / sizeof(elf32_phdr))))) {
+		return -1;
+	}
+	return 0;
+}
+
+struct elf_symtab {
+	elf_symbol* sym;
+	unsigned count;
+	char* strtab;
+};
+
+static int sym_cmp(const void* a, const void* b) {
+	const elf_symbol* x = a;
+	const elf_symbol* y = b;
+	if (x->addr < y->addr) return -1;
+	if (x->addr > y->addr) return 1;
+	// prefer sized symbols at the same address
+	if (x->size > y->size) return -1;
+	if (x->size < y->size) return 1;
+	return 0;
+}
+
+elf_symtab* elf_symtab_load(const char* fn) {
+	elf_symtab* st = NULL;
+	elf32_hdr hdr;
+	size_t sz;
+	uint8_t* data;
+
+	if ((data = load_file(fn, &sz)) == NULL) {
+		ERROR("elf: cannot read '%s'\n", fn);
+		return NULL;
+	}
+	if (elf_check(data, sz, &hdr)) {
+		ERROR("elf: '%s' is not a 32bit little endian ELF file\n", fn);
+		goto done;
+	}
+	for (unsigned n = 0; n < hdr.shnum; n++) {
+		elf32_shdr sh, strsh;
+		memcpy(&sh, data + hdr.shoff + n * sizeof(elf32_shdr), sizeof(sh));
+		if ((sh.type != SHT_SYMTAB) || (sh.link >= hdr.shnum)) {
+			continue;
+		}
+		memcpy(&strsh, data + hdr.shoff + sh.link * sizeof(elf32_shdr), sizeof(strsh));
+		if ((sh.offset > sz) || (sh.size > (sz - sh.offset)) ||
+			(strsh.offset > sz) || (strsh.size > (sz - strsh.offset)) ||
+			(strsh.size == 0)) {
+			break;
+		}
+		unsigned max = sh.size / sizeof(elf32_sym);
+		if ((st = calloc(1, sizeof(elf_symtab))) == NULL) {
+			goto done;
+		}
+		st->sym = malloc(sizeof(elf_symbol) * (max ? max : 1));
+		st->strtab = malloc(strsh.size + 1);
+		if ((st->sym == NULL) || (st->strtab == NULL)) {
+			elf_symtab_free(st);
+			st = NULL;
+			goto done;
+		}
+		memcpy(st->strtab, data + strsh.offset, strsh.size);
+		st->strtab[strsh.size] = 0;
+		for (unsigned i = 0; i < max; i++) {
+			elf32_sym s;
+			memcpy(&s, data + sh.offset + i * sizeof(elf32_sym), sizeof(s));
+			if ((ELF_ST_TYPE(s.info) != STT_FUNC) || (s.name >= strsh.size)) {
+				continue;
+			}
+			elf_symbol* sym = st->sym + st->count++;
+			sym->addr = s.value & ~1U; // thumb bit
+			sym->size = s.size;
+			sym->name = st->strtab + s.name;
+		}
+		qsort(st->sym, st->count, sizeof(elf_symbol), sym_cmp);
+		break;
+	}
+	if (st == NULL) {
+		ERROR("elf: '%s' has no symbol table\n", fn);
+	}
+done:
+	free(data);
+	return st;
+}
+
+void elf_symtab_free(elf_symtab* st) {
+	if (st != NULL) {
+		free(st->sym);
+		free(st->strtab);
+		free(st);
+	}
+}
+
+const elf_symbol* elf_symtab_find(elf_symtab* st, uint32_t addr) {
+	unsigned lo = 0, hi = st->count;
+	// find the last symbol starting at or before addr
+	while (lo < hi) {
+		unsigned mid = lo + (hi - lo) / 2;
+		if (st->sym[mid].addr <= addr) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	if (lo == 0) {
+		return NULL;
+	}
+	// of several symbols at the same address, the first is the sized one
+	const elf_symbol* sym = st->sym + lo - 1;
+	while ((sym > st->sym) && (sym[-1].addr == sym->addr)) {
+		sym--;
+	}
+	if (sym->size && (addr - sym->addr) >= sym->size) {
+		return NULL;
+	}
+	return sym;
+}
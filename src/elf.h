@@ -0,0 +1,92 @@
+// Copyright 2023, Brian Swetland <swetland@frotz.net>
+// Licensed under the Apache License, Version 2.0.
+
+#pragma once
+
+#include <stdint.h>
+
+// 32bit little endian ELF, as produced for Cortex-M targets
+
+#define ELF_IDENT_SZ 16
+
+typedef struct {
+	uint8_t  ident[ELF_IDENT_SZ];
+	uint16_t type;
+	uint16_t machine;
+	uint32_t version;
+	uint32_t entry;
+	uint32_t phoff;
+	uint32_t shoff;
+	uint32_t flags;
+	uint16_t ehsize;
+	uint16_t phentsize;
+	uint16_t phnum;
+	uint16_t shentsize;
+	uint16_t shnum;
+	uint16_t shstrndx;
+} elf32_hdr;
+
+typedef struct {
+	uint32_t type;
+	uint32_t offset;
+	uint32_t vaddr;
+	uint32_t paddr;
+	uint32_t filesz;
+	uint32_t memsz;
+	uint32_t flags;
+	uint32_t align;
+} elf32_phdr;
+
+typedef struct {
+	uint32_t name;
+	uint32_t type;
+	uint32_t flags;
+	uint32_t addr;
+	uint32_t offset;
+	uint32_t size;
+	uint32_t link;
+	uint32_t info;
+	uint32_t addralign;
+	uint32_t entsize;
+} elf32_shdr;
+
+typedef struct {
+	uint32_t name;
+	uint32_t value;
+	uint32_t size;
+	uint8_t  info;
+	uint8_t  other;
+	uint16_t shndx;
+} elf32_sym;
+
+#define ELFCLASS32    1
+#define ELFDATA2LSB   1
+#define EM_ARM        40
+
+#define PT_LOAD       1
+
+#define SHT_SYMTAB    2
+#define SHT_STRTAB    3
+
+#define STT_FUNC      2
+#define ELF_ST_TYPE(info) ((info) & 0xF)
+
+// validate the header of an ELF file in memory
+int elf_check(const void* data, uint32_t sz, elf32_hdr* hdr);
+
+
+// function symbols, sorted by address
+typedef struct {
+	uint32_t addr;
+	uint32_t size; // 0 if unknown (extends to the next symbol)
+	const char* name;
+} elf_symbol;
+
+typedef struct elf_symtab elf_symtab;
+
+elf_symtab* elf_symtab_load(const char* fn);
+void elf_symtab_free(elf_symtab* st);
+
+// the function containing addr, or NULL
+const elf_symbol* elf_symtab_find(elf_symtab* st, uint32_t addr);
+
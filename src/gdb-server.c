@@ -0,0 +1,876 @@
+// Copyright 2023, Brian Swetland <swetland@frotz.net>
+// Licensed under the Apache License, Version 2.0.
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "xdebug.h"
+#include "transport.h"
+
+#define _AGENT_HOST_
+#include <agent/flash.h>
+
+// GDB Remote Serial Protocol server
+//
+// The listening socket (and then the connection) is polled by the
+// work thread along with console commands, so gdb and the console
+// take turns with the transport.  While gdb has the target running,
+// gdb_server_periodic() watches for it to halt.
+
+#define GDB_PACKET_SIZE 16384 // largest payload, as offered in qSupported
+#define GDB_BUF_SIZE    (GDB_PACKET_SIZE + 8)
+
+#define GDB_POLL_MS 10 // for a halt, while the target runs
+#define GDB_IDLE_MS 1000
+
+#define GDB_SIGINT  2
+#define GDB_SIGTRAP 5
+
+// gdb numbers registers in target description order, which is
+// laid out to match the DCRSR register selectors
+#define GDB_REGS 19 // r0-r12 sp lr pc xpsr msp psp
+
+// gdb erases whole sectors of the memory map, which has a region
+// for each run of like-sized sectors
+#define GDB_FLASH_REGIONS 16
+#define GDB_FLASH_SPANS 16
+
+static const char target_xml[] =
+	"<?xml version=\"1.0\"?>"
+	"<!DOCTYPE target SYSTEM \"gdb-target.dtd\">"
+	"<target version=\"1.0\">"
+	"<architecture>arm</architecture>"
+	"<feature name=\"org.gnu.gdb.arm.m-profile\">"
+	"<reg name=\"r0\" bitsize=\"32\"/>"
+	"<reg name=\"r1\" bitsize=\"32\"/>"
+	"<reg name=\"r2\" bitsize=\"32\"/>"
+	"<reg name=\"r3\" bitsize=\"32\"/>"
+	"<reg name=\"r4\" bitsize=\"32\"/>"
+	"<reg name=\"r5\" bitsize=\"32\"/>"
+	"<reg name=\"r6\" bitsize=\"32\"/>"
+	"<reg name=\"r7\" bitsize=\"32\"/>"
+	"<reg name=\"r8\" bitsize=\"32\"/>"
+	"<reg name=\"r9\" bitsize=\"32\"/>"
+	"<reg name=\"r10\" bitsize=\"32\"/>"
+	"<reg name=\"r11\" bitsize=\"32\"/>"
+	"<reg name=\"r12\" bitsize=\"32\"/>"
+	"<reg name=\"sp\" bitsize=\"32\" type=\"data_ptr\"/>"
+	"<reg name=\"lr\" bitsize=\"32\"/>"
+	"<reg name=\"pc\" bitsize=\"32\" type=\"code_ptr\"/>"
+	"<reg name=\"xpsr\" bitsize=\"32\"/>"
+	"</feature>"
+	"<feature name=\"org.gnu.gdb.arm.m-system\">"
+	"<reg name=\"msp\" bitsize=\"32\" type=\"data_ptr\"/>"
+	"<reg name=\"psp\" bitsize=\"32\" type=\"data_ptr\"/>"
+	"</feature>"
+	"</target>";
+
+typedef struct {
+	uint32_t addr;
+	uint32_t len;
+	uint8_t* data;      // allocated on the first write
+} gdb_span;
+
+static struct {
+	int listen_fd;
+	int fd;
+	char* path;         // unix domain socket, to remove when done
+	int noack;
+	int running;        // resumed by gdb, which awaits a stop reply
+	int failed;         // the connection broke mid-reply
+	uint32_t rxlen;
+	char rx[GDB_BUF_SIZE];
+	char tx[GDB_BUF_SIZE];
+	gdb_span span[GDB_FLASH_SPANS];
+	unsigned spans;
+} gdb = {
+	.listen_fd = -1,
+	.fd = -1,
+};
+
+static int hexval(char c) {
+	if ((c >= '0') && (c <= '9')) return c - '0';
+	if ((c >= 'a') && (c <= 'f')) return c - 'a' + 10;
+	if ((c >= 'A') && (c <= 'F')) return c - 'A' + 10;
+	return -1;
+}
+
+// parse hex digits up to the next non-digit, which must be one of end
+static int get_u32(char** s, uint32_t* out, const char* end) {
+	char* x = *s;
+	uint32_t val = 0;
+	int d;
+	while ((d = hexval(*x)) >= 0) {
+		val = (val << 4) | d;
+		x++;
+	}
+	if ((x == *s) || (strchr(end, *x) == NULL)) {
+		return -1;
+	}
+	*out = val;
+	*s = (*x) ? (x + 1) : x;
+	return 0;
+}
+
+static int get_hex(const char* s, void* ptr, unsigned len) {
+	uint8_t* data = ptr;
+	while (len-- > 0) {
+		int hi = hexval(*s++);
+		int lo = (hi < 0) ? -1 : hexval(*s++);
+		if (lo < 0) {
+			return -1;
+		}
+		*data++ = (hi << 4) | lo;
+	}
+	return 0;
+}
+
+static unsigned put_hex(char* s, const void* ptr, unsigned len) {
+	static const char hex[] = "0123456789abcdef";
+	const uint8_t* data = ptr;
+	for (unsigned n = 0; n < len; n++) {
+		*s++ = hex[data[n] >> 4];
+		*s++ = hex[data[n] & 15];
+	}
+	return len * 2;
+}
+
+// binary data escapes '#', '$', '}', and '*' as '}' then c ^ 0x20
+static unsigned unescape(char* data, unsigned len) {
+	char* out = data;
+	char* end = data + len;
+	while (data < end) {
+		char c = *data++;
+		if ((c == '}') && (data < end)) {
+			c = *data++ ^ 0x20;
+		}
+		*out++ = c;
+	}
+	return out - (end - len);
+}
+
+static void gdb_write(const void* data, unsigned len) {
+	const char* ptr = data;
+	while ((len > 0) && !gdb.failed) {
+		ssize_t r = send(gdb.fd, ptr, len, MSG_NOSIGNAL);
+		if (r < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			gdb.failed = 1;
+			break;
+		}
+		ptr += r;
+		len -= r;
+	}
+}
+
+// the payload is already in place after the '$'
+static void gdb_send(unsigned len) {
+	uint8_t sum = 0;
+	gdb.tx[0] = '$';
+	for (unsigned n = 1; n <= len; n++) {
+		sum += gdb.tx[n];
+	}
+	snprintf(gdb.tx + len + 1, 4, "#%02x", sum);
+	gdb_write(gdb.tx, len + 4);
+}
+
+static void reply(const char* s) {
+	unsigned len = strlen(s);
+	memcpy(gdb.tx + 1, s, len);
+	gdb_send(len);
+}
+
+static void reply_stop(int sig) {
+	char s[4];
+	snprintf(s, sizeof(s), "S%02x", sig);
+	reply(s);
+}
+
+// a stop after running or stepping may have been a watchpoint
+static void reply_halted(DC* dc) {
+	static const char* kinds[] = { "", "rwatch", "watch", "awatch" };
+	uint32_t addr, kind;
+	char s[32];
+	if (dc_wp_matched(dc, &addr, &kind) == 1) {
+		snprintf(s, sizeof(s), "T%02x%s:%08x;", GDB_SIGTRAP, kinds[kind], addr);
+		reply(s);
+	} else {
+		reply_stop(GDB_SIGTRAP);
+	}
+}
+
+// qXfer reads are of offset,length windows onto a document
+static void reply_xfer(const char* doc, unsigned len, char* args) {
+	uint32_t off, max;
+	if (get_u32(&args, &off, ",") || get_u32(&args, &max, "")) {
+		reply("E01");
+		return;
+	}
+	if (off >= len) {
+		reply("l");
+		return;
+	}
+	if (max > (GDB_PACKET_SIZE - 1)) {
+		max = GDB_PACKET_SIZE - 1;
+	}
+	len -= off;
+	gdb.tx[1] = (len > max) ? 'm' : 'l';
+	if (len > max) {
+		len = max;
+	}
+	memcpy(gdb.tx + 2, doc + off, len);
+	gdb_send(len + 1);
+}
+
+static unsigned memory_map(DC* dc, char* out, unsigned max) {
+	flash_region map[GDB_FLASH_REGIONS];
+	unsigned len = 0;
+	int count;
+	if ((count = get_flash_map(dc, map, GDB_FLASH_REGIONS)) <= 0) {
+		return 0;
+	}
+	// gdb refuses accesses outside the map, so it covers everything
+	uint64_t addr = 0;
+	len += snprintf(out + len, max - len, "<memory-map>");
+	for (int n = 0; n < count; n++) {
+		flash_region* r = map + n;
+		if (r->base > addr) {
+			len += snprintf(out + len, max - len,
+				"<memory type=\"ram\" start=\"0x%llx\" length=\"0x%llx\"/>",
+				(unsigned long long) addr, (unsigned long long) (r->base - addr));
+		}
+		len += snprintf(out + len, max - len,
+			"<memory type=\"flash\" start=\"0x%x\" length=\"0x%x\">"
+			"<property name=\"blocksize\">0x%x</property></memory>",
+			r->base, r->sector_size * r->sector_count, r->sector_size);
+		addr = ((uint64_t) r->base) + r->sector_size * r->sector_count;
+	}
+	if (addr < 0x100000000ULL) {
+		len += snprintf(out + len, max - len,
+			"<memory type=\"ram\" start=\"0x%llx\" length=\"0x%llx\"/>",
+			(unsigned long long) addr, (unsigned long long) (0x100000000ULL - addr));
+	}
+	len += snprintf(out + len, max - len, "</memory-map>");
+	return (len < max) ? len : 0;
+}
+
+static void flash_reset(void) {
+	for (unsigned n = 0; n < gdb.spans; n++) {
+		free(gdb.span[n].data);
+	}
+	gdb.spans = 0;
+}
+
+static int flash_erase(uint32_t addr, uint32_t len) {
+	uint64_t end = ((uint64_t) addr) + len;
+	gdb_span* s;
+	for (unsigned n = 0; n < gdb.spans; n++) {
+		s = gdb.span + n;
+		uint64_t s_end = ((uint64_t) s->addr) + s->len;
+		// only ranges that touch are merged, so nothing gdb did
+		// not ask to erase is
+		if ((addr > s_end) || (end < s->addr)) {
+			continue;
+		}
+		uint32_t n_addr = (addr < s->addr) ? addr : s->addr;
+		uint32_t n_len = ((end > s_end) ? end : s_end) - n_addr;
+		if (s->data != NULL) {
+			uint8_t* data = malloc(n_len);
+			if (data == NULL) {
+				return -1;
+			}
+			memset(data, 0xFF, n_len);
+			memcpy(data + (s->addr - n_addr), s->data, s->len);
+			free(s->data);
+			s->data = data;
+		}
+		s->addr = n_addr;
+		s->len = n_len;
+		return 0;
+	}
+	if (gdb.spans == GDB_FLASH_SPANS) {
+		return -1;
+	}
+	s = gdb.span + gdb.spans++;
+	s->addr = addr;
+	s->len = len;
+	s->data = NULL;
+	return 0;
+}
+
+static int flash_write(uint32_t addr, const void* data, uint32_t len) {
+	for (unsigned n = 0; n < gdb.spans; n++) {
+		gdb_span* s = gdb.span + n;
+		if ((addr < s->addr) || ((((uint64_t) addr) + len) > (((uint64_t) s->addr) + s->len))) {
+			continue;
+		}
+		if (s->data == NULL) {
+			if ((s->data = malloc(s->len)) == NULL) {
+				return -1;
+			}
+			memset(s->data, 0xFF, s->len);
+		}
+		memcpy(s->data + (addr - s->addr), data, len);
+		return 0;
+	}
+	ERROR("gdb: flash write to %08x outside of erased blocks\n", addr);
+	return -1;
+}
+
+static int flash_done(DC* dc) {
+	int r = 0;
+	for (unsigned n = 0; n < gdb.spans; n++) {
+		gdb_span* s = gdb.span + n;
+		// the agent takes ownership of the data (and NULL is erase)
+		if (flash_image(dc, s->addr, s->data, s->len)) {
+			r = -1;
+		}
+		s->data = NULL;
+	}
+	gdb.spans = 0;
+	// leave the target as gdb will expect to find it after a load
+	if (do_reset_stop(dc, 0)) {
+		r = -1;
+	}
+	return r;
+}
+
+static void gdb_regs_rd(DC* dc) {
+	uint32_t id[GDB_REGS], val[GDB_REGS];
+	for (unsigned n = 0; n < GDB_REGS; n++) {
+		id[n] = n;
+	}
+	if (dc_core_reg_rd_list(dc, id, val, GDB_REGS)) {
+		reply("E01");
+		return;
+	}
+	gdb_send(put_hex(gdb.tx + 1, val, sizeof(val)));
+}
+
+static void gdb_regs_wr(DC* dc, const char* s) {
+	uint32_t val[GDB_REGS];
+	if ((strlen(s) != (sizeof(val) * 2)) || get_hex(s, val, sizeof(val))) {
+		reply("E01");
+		return;
+	}
+	// the register writes all go out in one batch
+	uint32_t wc = dc_flags(dc, 0, 0) & DCF_WRITE_COMBINE;
+	dc_flags(dc, 0, DCF_WRITE_COMBINE);
+	for (unsigned n = 0; n < GDB_REGS; n++) {
+		dc_core_reg_wr(dc, n, val[n]);
+	}
+	int r = dc_flush(dc);
+	dc_flags(dc, wc ? 0 : DCF_WRITE_COMBINE, 0);
+	reply(r ? "E01" : "OK");
+}
+
+static void gdb_mem_rd(DC* dc, char* args) {
+	uint32_t addr, len;
+	uint8_t data[GDB_PACKET_SIZE / 2];
+	if (get_u32(&args, &addr, ",") || get_u32(&args, &len, "")) {
+		reply("E01");
+		return;
+	}
+	// gdb copes with a short read
+	if (len > sizeof(data)) {
+		len = sizeof(data);
+	}
+	if (dc_mem_read(dc, addr, len, data)) {
+		reply("E01");
+		return;
+	}
+	gdb_send(put_hex(gdb.tx + 1, data, len));
+}
+
+// M addr,len:hex or X addr,len:binary
+static void gdb_mem_wr(DC* dc, char* args, unsigned argslen, int binary) {
+	uint32_t addr, len;
+	uint8_t buf[GDB_PACKET_SIZE / 2];
+	const void* data = buf;
+	char* start = args;
+	if (get_u32(&args, &addr, ",") || get_u32(&args, &len, ":")) {
+		reply("E01");
+		return;
+	}
+	argslen -= (args - start);
+	if (binary) {
+		if (unescape(args, argslen) != len) {
+			reply("E01");
+			return;
+		}
+		data = args;
+	} else if ((len > sizeof(buf)) || (argslen != (len * 2)) || get_hex(args, buf, len)) {
+		reply("E01");
+		return;
+	}
+	if ((len > 0) && dc_mem_write(dc, addr, len, data)) {
+		reply("E01");
+		return;
+	}
+	reply("OK");
+}
+
+static void gdb_resume(DC* dc, char action, uint32_t pc, int set_pc) {
+	if (set_pc && dc_core_reg_wr(dc, 15, pc)) {
+		reply("E01");
+		return;
+	}
+	if ((action == 's') || (action == 'S')) {
+		if (dc_core_step(dc)) {
+			reply("E01");
+			return;
+		}
+		// the step is usually over by now, saving a poll interval
+		if (dc_core_check_halt(dc) == 1) {
+			reply_halted(dc);
+			return;
+		}
+	} else if (dc_core_resume(dc)) {
+		reply("E01");
+		return;
+	}
+	gdb.running = 1;
+}
+
+// Z/z type,addr,kind: software breakpoints (which could not be
+// written into flash anyway) are hardware ones too, and for
+// watchpoints kind is the length
+static void gdb_breakpoint(DC* dc, char* p) {
+	static const uint32_t wp_kinds[] = { DC_WP_WRITE, DC_WP_READ, DC_WP_ACCESS };
+	uint32_t type, addr, kind;
+	char* args = p + 1;
+	int r;
+	if (get_u32(&args, &type, ",") || get_u32(&args, &addr, ",") ||
+		get_u32(&args, &kind, ";")) {
+		reply("E01");
+		return;
+	}
+	if (type <= 1) {
+		r = (p[0] == 'Z') ? dc_bp_set(dc, addr & ~1U) : dc_bp_clr(dc, addr & ~1U);
+	} else if (type <= 4) {
+		r = (p[0] == 'Z') ? dc_wp_set(dc, addr, kind, wp_kinds[type - 2]) :
+			dc_wp_clr(dc, addr, kind, wp_kinds[type - 2]);
+	} else {
+		reply("");
+		return;
+	}
+	reply((r < 0) ? "E01" : "OK");
+}
+
+// vCont;action[:thread][;action[:thread]]... there is only one thread
+static void gdb_vcont(DC* dc, char* args) {
+	if (!strcmp(args, "?")) {
+		reply("vCont;c;C;s;S");
+		return;
+	}
+	if ((*args++ != ';') || !strchr("cCsS", *args)) {
+		reply("E01");
+		return;
+	}
+	gdb_resume(dc, *args, 0, 0);
+}
+
+static void gdb_query(DC* dc, char* p, unsigned len) {
+	if (!strncmp(p, "qSupported", 10)) {
+		// with no flash agent, there is no memory map
+		uint32_t addr, size;
+		snprintf(gdb.tx + 1, GDB_PACKET_SIZE,
+			"PacketSize=%x;QStartNoAckMode+;qXfer:features:read+;%svContSupported+",
+			GDB_PACKET_SIZE, get_flash_region(&addr, &size) ? "" : "qXfer:memory-map:read+;");
+		gdb_send(strlen(gdb.tx + 1));
+	} else if (!strncmp(p, "qXfer:features:read:target.xml:", 31)) {
+		reply_xfer(target_xml, sizeof(target_xml) - 1, p + 31);
+	} else if (!strncmp(p, "qXfer:memory-map:read::", 23)) {
+		char map[4096];
+		unsigned maplen = memory_map(dc, map, sizeof(map));
+		if (maplen == 0) {
+			reply("E01");
+		} else {
+			reply_xfer(map, maplen, p + 23);
+		}
+	} else if (!strncmp(p, "qRcmd,", 6)) {
+		// monitor commands run as if typed at the console
+		char line[256];
+		unsigned n = (len - 6) / 2;
+		if ((n >= sizeof(line)) || get_hex(p + 6, line, n)) {
+			reply("E01");
+			return;
+		}
+		line[n] = 0;
+		debug_command(line);
+		reply("OK");
+	} else if (!strcmp(p, "qAttached")) {
+		reply("1");
+	} else if (!strcmp(p, "qC")) {
+		reply("QC1");
+	} else if (!strcmp(p, "qfThreadInfo")) {
+		reply("m1");
+	} else if (!strcmp(p, "qsThreadInfo")) {
+		reply("l");
+	} else if (!strcmp(p, "QStartNoAckMode")) {
+		// gdb acknowledges this reply, and then no more
+		reply("OK");
+		gdb.noack = 1;
+	} else {
+		reply("");
+	}
+}
+
+static void gdb_flash(DC* dc, char* p, unsigned len) {
+	uint32_t addr, xfer;
+	char* start = p;
+	if (!strncmp(p, "vFlashErase:", 12)) {
+		p += 12;
+		if (get_u32(&p, &addr, ",") || get_u32(&p, &xfer, "") || flash_erase(addr, xfer)) {
+			reply("E01");
+		} else {
+			reply("OK");
+		}
+	} else if (!strncmp(p, "vFlashWrite:", 12)) {
+		p += 12;
+		if (get_u32(&p, &addr, ":")) {
+			reply("E01");
+			return;
+		}
+		xfer = unescape(p, len - (p - start));
+		reply(flash_write(addr, p, xfer) ? "E01" : "OK");
+	} else if (!strcmp(p, "vFlashDone")) {
+		reply(flash_done(dc) ? "E01" : "OK");
+	} else {
+		reply("");
+	}
+}
+
+static void gdb_close(void) {
+	if (gdb.fd >= 0) {
+		close(gdb.fd);
+		gdb.fd = -1;
+		INFO("gdb: disconnected\n");
+	}
+	gdb.running = 0;
+	gdb.rxlen = 0;
+	flash_reset();
+}
+
+static void gdb_packet(DC* dc, char* p, unsigned len) {
+	uint32_t n, val;
+	char* args = p + 1;
+	switch (p[0]) {
+	case '?':
+		reply_stop(GDB_SIGTRAP);
+		break;
+	case 'g':
+		gdb_regs_rd(dc);
+		break;
+	case 'G':
+		gdb_regs_wr(dc, args);
+		break;
+	case 'p':
+		if (get_u32(&args, &n, "") || (n >= GDB_REGS) || dc_core_reg_rd(dc, n, &val)) {
+			reply("E01");
+		} else {
+			gdb_send(put_hex(gdb.tx + 1, &val, 4));
+		}
+		break;
+	case 'P':
+		if (get_u32(&args, &n, "=") || (n >= GDB_REGS) || (strlen(args) != 8) ||
+			get_hex(args, &val, 4) || dc_core_reg_wr(dc, n, val)) {
+			reply("E01");
+		} else {
+			reply("OK");
+		}
+		break;
+	case 'm':
+		gdb_mem_rd(dc, args);
+		break;
+	case 'M':
+		gdb_mem_wr(dc, args, len - 1, 0);
+		break;
+	case 'X':
+		gdb_mem_wr(dc, args, len - 1, 1);
+		break;
+	case 'c':
+	case 's':
+		if (*args == 0) {
+			gdb_resume(dc, p[0], 0, 0);
+		} else if (get_u32(&args, &val, "")) {
+			reply("E01");
+		} else {
+			gdb_resume(dc, p[0], val, 1);
+		}
+		break;
+	case 'D':
+		reply("OK");
+		dc_core_resume(dc);
+		gdb_close();
+		break;
+	case 'k':
+		gdb_close();
+		break;
+	case 'H':
+	case 'T':
+		reply("OK");
+		break;
+	case 'Z':
+	case 'z':
+		gdb_breakpoint(dc, p);
+		break;
+	case 'q':
+	case 'Q':
+		gdb_query(dc, p, len);
+		break;
+	case 'v':
+		if (!strncmp(p, "vCont", 5)) {
+			gdb_vcont(dc, p + 5);
+		} else if (!strncmp(p, "vFlash", 6)) {
+			gdb_flash(dc, p, len);
+		} else {
+			reply("");
+		}
+		break;
+	default:
+		reply("");
+		break;
+	}
+}
+
+static void gdb_interrupt(DC* dc) {
+	if (!gdb.running) {
+		return;
+	}
+	if (dc_core_halt(dc)) {
+		ERROR("gdb: cannot halt the target\n");
+	}
+	// either way, give gdb back control
+	gdb.running = 0;
+	reply_stop(GDB_SIGINT);
+}
+
+static void gdb_accept(DC* dc) {
+	int one = 1;
+	int fd = accept(gdb.listen_fd, NULL, NULL);
+	if (fd < 0) {
+		return;
+	}
+	// replies are small and latency is what matters (fails on unix sockets)
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	gdb.fd = fd;
+	gdb.noack = 0;
+	gdb.failed = 0;
+	gdb.running = 0;
+	gdb.rxlen = 0;
+	INFO("gdb: connected\n");
+
+	// gdb expects to find the target halted
+	if (dc_core_halt(dc) && (do_attach(dc, 0) || dc_core_halt(dc))) {
+		ERROR("gdb: cannot halt the target\n");
+	}
+}
+
+void gdb_server_io(DC* dc) {
+	if (gdb.fd < 0) {
+		if (gdb.listen_fd >= 0) {
+			gdb_accept(dc);
+		}
+		return;
+	}
+	ssize_t r = recv(gdb.fd, gdb.rx + gdb.rxlen, sizeof(gdb.rx) - gdb.rxlen, MSG_DONTWAIT);
+	if (r < 0) {
+		if ((errno != EAGAIN) && (errno != EINTR)) {
+			gdb_close();
+		}
+		return;
+	}
+	if (r == 0) {
+		gdb_close();
+		return;
+	}
+	gdb.rxlen += r;
+
+	// $payload#cs packets, with acks and ^C in between
+	uint32_t n = 0;
+	while (n < gdb.rxlen) {
+		char* p = gdb.rx + n;
+		if (*p == 0x03) {
+			gdb_interrupt(dc);
+			n++;
+			continue;
+		}
+		if (*p != '$') {
+			n++;
+			continue;
+		}
+		char* end = memchr(p, '#', gdb.rxlen - n);
+		if ((end == NULL) || ((end + 3) > (gdb.rx + gdb.rxlen))) {
+			if (n == 0 && (gdb.rxlen == sizeof(gdb.rx))) {
+				ERROR("gdb: packet too large\n");
+				gdb_close();
+				return;
+			}
+			break;
+		}
+		n = (end + 3) - gdb.rx;
+		if (!gdb.noack) {
+			uint8_t sum = 0;
+			int hi = hexval(end[1]);
+			int lo = hexval(end[2]);
+			for (char* x = p + 1; x < end; x++) {
+				sum += *x;
+			}
+			if ((hi < 0) || (lo < 0) || (sum != ((hi << 4) | lo))) {
+				gdb_write("-", 1);
+				continue;
+			}
+			gdb_write("+", 1);
+		}
+		*end = 0;
+		gdb_packet(dc, p + 1, end - (p + 1));
+		if (gdb.failed) {
+			gdb_close();
+		}
+		if (gdb.fd < 0) {
+			return;
+		}
+	}
+	memmove(gdb.rx, gdb.rx + n, gdb.rxlen - n);
+	gdb.rxlen -= n;
+}
+
+int gdb_server_fd(void) {
+	return (gdb.fd >= 0) ? gdb.fd : gdb.listen_fd;
+}
+
+int gdb_server_periodic(DC* dc) {
+	if (!gdb.running) {
+		return GDB_IDLE_MS;
+	}
+	int r = dc_core_check_halt(dc);
+	if (r == 1) {
+		gdb.running = 0;
+		reply_halted(dc);
+		if (gdb.failed) {
+			gdb_close();
+		}
+		return GDB_IDLE_MS;
+	}
+	// on error, keep trying: gdb can still interrupt
+	return (r < 0) ? GDB_IDLE_MS : GDB_POLL_MS;
+}
+
+static void gdb_stop(void) {
+	gdb_close();
+	if (gdb.listen_fd >= 0) {
+		close(gdb.listen_fd);
+		gdb.listen_fd = -1;
+	}
+	if (gdb.path != NULL) {
+		unlink(gdb.path);
+		free(gdb.path);
+		gdb.path = NULL;
+	}
+}
+
+// accept() must not block the work thread if gdb gives up on
+// connecting, but the connection itself is blocking for replies
+static int gdb_listening(int fd) {
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	return fd;
+}
+
+static int gdb_listen_tcp(uint32_t port) {
+	struct sockaddr_in sa;
+	int one = 1;
+	int fd;
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_port = htons(port);
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+		return -1;
+	}
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	if (bind(fd, (void*) &sa, sizeof(sa)) || listen(fd, 1)) {
+		close(fd);
+		return -1;
+	}
+	return gdb_listening(fd);
+}
+
+static int gdb_listen_unix(const char* path) {
+	struct sockaddr_un sa;
+	int fd;
+	if (strlen(path) >= sizeof(sa.sun_path)) {
+		return -1;
+	}
+	memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	strcpy(sa.sun_path, path);
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+		return -1;
+	}
+	// a stale socket from an earlier run would block the bind
+	unlink(path);
+	if (bind(fd, (void*) &sa, sizeof(sa)) || listen(fd, 1)) {
+		close(fd);
+		return -1;
+	}
+	return gdb_listening(fd);
+}
+
+int do_gdbserver(DC* dc, CC* cc) {
+	const char* s;
+	char* end;
+
+	if (cmd_argc(cc) == 1) {
+		if (gdb.listen_fd < 0) {
+			INFO("gdbserver: <port> | <path> | stop\n");
+		} else {
+			INFO("gdbserver: %s\n", (gdb.fd >= 0) ? "connected" : "waiting for gdb");
+		}
+		return 0;
+	}
+	if (cmd_arg_str(cc, 1, &s)) return DBG_ERR;
+	if (!strcmp(s, "stop")) {
+		gdb_stop();
+		return 0;
+	}
+	if (gdb.listen_fd >= 0) {
+		ERROR("gdbserver: already listening\n");
+		return DBG_ERR;
+	}
+	// (the console parses numbers as hex, but ports are decimal)
+	unsigned long port = strtoul(s, &end, 10);
+	if (*end == 0) {
+		if ((port == 0) || (port > 65535) ||
+			((gdb.listen_fd = gdb_listen_tcp(port)) < 0)) {
+			ERROR("gdbserver: cannot listen on port %lu\n", port);
+			return DBG_ERR;
+		}
+		INFO("gdbserver: target remote localhost:%lu\n", port);
+		return 0;
+	}
+	if ((gdb.path = malloc(strlen(s) + 1)) == NULL) {
+		return DBG_ERR;
+	}
+	strcpy(gdb.path, s);
+	if ((gdb.listen_fd = gdb_listen_unix(s)) < 0) {
+		ERROR("gdbserver: cannot listen on '%s'\n", s);
+		free(gdb.path);
+		gdb.path = NULL;
+		return DBG_ERR;
+	}
+	INFO("gdbserver: target remote %s\n", s);
+	return 0;
+}
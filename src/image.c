@@ -0,0 +1,384 @@
+// Copyright 2023, Brian Swetland <swetland@frotz.net>
+// Licensed under the Apache License, Version 2.0.
+
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "xdebug.h"
+#include "elf.h"
+#include "image.h"
+
+struct image {
+	image_seg* seg;
+	unsigned count;
+	unsigned max;
+	const char* format;
+
+	// the mapped file
+	void* map;
+	size_t map_sz;
+
+	// buffers decoded or merged segments live in
+	uint8_t** buf;
+	unsigned buf_count;
+};
+
+static int add_seg(image* img, uint32_t addr, uint32_t size, const uint8_t* data) {
+	if (size == 0) {
+		return 0;
+	}
+	if (((uint64_t) addr + size) > 0x100000000ULL) {
+		ERROR("image: segment at %08x wraps\n", addr);
+		return -1;
+	}
+	// extend the last segment if this one continues it
+	if (img->count) {
+		image_seg* last = img->seg + img->count - 1;
+		if (((last->addr + last->size) == addr) &&
+			((last->data + last->size) == data)) {
+			last->size += size;
+			return 0;
+		}
+	}
+	if (img->count == img->max) {
+		unsigned max = img->max ? img->max * 2 : 16;
+		image_seg* seg = realloc(img->seg, max * sizeof(image_seg));
+		if (seg == NULL) {
+			return -1;
+		}
+		img->seg = seg;
+		img->max = max;
+	}
+	img->seg[img->count].addr = addr;
+	img->seg[img->count].size = size;
+	img->seg[img->count].data = data;
+	img->count++;
+	return 0;
+}
+
+static uint8_t* add_buf(image* img, size_t size) {
+	uint8_t** buf = realloc(img->buf, (img->buf_count + 1) * sizeof(uint8_t*));
+	if (buf == NULL) {
+		return NULL;
+	}
+	img->buf = buf;
+	if ((buf[img->buf_count] = malloc(size ? size : 1)) == NULL) {
+		return NULL;
+	}
+	return buf[img->buf_count++];
+}
+
+static int load_elf(image* img, const uint8_t* data, size_t sz) {
+	elf32_hdr hdr;
+	if (elf_check(data, sz, &hdr)) {
+		ERROR("image: bad ELF header\n");
+		return -1;
+	}
+	for (unsigned n = 0; n < hdr.phnum; n++) {
+		elf32_phdr ph;
+		memcpy(&ph, data + hdr.phoff + n * sizeof(ph), sizeof(ph));
+		if ((ph.type != PT_LOAD) || (ph.filesz == 0)) {
+			continue;
+		}
+		if ((ph.offset > sz) || (ph.filesz > (sz - ph.offset))) {
+			ERROR("image: ELF segment %u outside of file\n", n);
+			return -1;
+		}
+		// the file contents, at their load (not run) address
+		if (add_seg(img, ph.paddr, ph.filesz, data + ph.offset)) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+#define UF2_MAGIC0        0x0A324655
+#define UF2_MAGIC1        0x9E5D5157
+#define UF2_MAGIC_END     0x0AB16F30
+#define UF2_FLAG_NOFLASH  0x00000001
+#define UF2_BLOCK_SZ      512
+#define UF2_DATA_MAX      476
+
+static uint32_t rd32le(const uint8_t* p) {
+	return p[0] | (p[1] << 8) | (p[2] << 16) | (((uint32_t) p[3]) << 24);
+}
+
+static int is_uf2(const uint8_t* data, size_t sz) {
+	return (sz >= UF2_BLOCK_SZ) &&
+		(rd32le(data) == UF2_MAGIC0) && (rd32le(data + 4) == UF2_MAGIC1);
+}
+
+static int load_uf2(image* img, const uint8_t* data, size_t sz) {
+	if (sz % UF2_BLOCK_SZ) {
+		ERROR("image: UF2 file is not a whole number of blocks\n");
+		return -1;
+	}
+	for (size_t off = 0; off < sz; off += UF2_BLOCK_SZ) {
+		const uint8_t* b = data + off;
+		if ((rd32le(b) != UF2_MAGIC0) || (rd32le(b + 4) != UF2_MAGIC1) ||
+			(rd32le(b + UF2_BLOCK_SZ - 4) != UF2_MAGIC_END)) {
+			ERROR("image: bad UF2 block at offset %zu\n", off);
+			return -1;
+		}
+		if (rd32le(b + 8) & UF2_FLAG_NOFLASH) {
+			continue;
+		}
+		uint32_t size = rd32le(b + 16);
+		if (size > UF2_DATA_MAX) {
+			ERROR("image: bad UF2 block at offset %zu\n", off);
+			return -1;
+		}
+		if (add_seg(img, rd32le(b + 12), size, b + 32)) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int hexval(const uint8_t* p, size_t avail, unsigned* out) {
+	unsigned v = 0;
+	if (avail < 2) {
+		return -1;
+	}
+	for (unsigned n = 0; n < 2; n++) {
+		unsigned c = p[n];
+		if ((c >= '0') && (c <= '9')) {
+			c -= '0';
+		} else if ((c >= 'a') && (c <= 'f')) {
+			c -= 'a' - 10;
+		} else if ((c >= 'A') && (c <= 'F')) {
+			c -= 'A' - 10;
+		} else {
+			return -1;
+		}
+		v = (v << 4) | c;
+	}
+	*out = v;
+	return 0;
+}
+
+static int is_hex(const uint8_t* data, size_t sz) {
+	return (sz > 0) && (data[0] == ':');
+}
+
+// each record's bytes are decoded after the last, so records that
+// follow on from one another become a single segment
+static int load_hex(image* img, const uint8_t* data, size_t sz) {
+	uint8_t* out = add_buf(img, sz / 2);
+	uint32_t upper = 0;
+	unsigned line = 0;
+	size_t off = 0;
+	if (out == NULL) {
+		return -1;
+	}
+	while (off < sz) {
+		uint8_t rec[255 + 5];
+		unsigned count, sum = 0;
+		if ((data[off] == '\r') || (data[off] == '\n')) {
+			off++;
+			continue;
+		}
+		line++;
+		if ((data[off++] != ':') || hexval(data + off, sz - off, &count)) {
+			goto bad;
+		}
+		for (unsigned n = 0; n < (count + 5); n++) {
+			unsigned v;
+			if (hexval(data + off, sz - off, &v)) {
+				goto bad;
+			}
+			rec[n] = v;
+			sum += v;
+			off += 2;
+		}
+		if (sum & 0xFF) {
+			ERROR("image: HEX checksum error on line %u\n", line);
+			return -1;
+		}
+		uint32_t addr = upper + ((rec[1] << 8) | rec[2]);
+		switch (rec[3]) {
+		case 0x00: // data
+			memcpy(out, rec + 4, count);
+			if (add_seg(img, addr, count, out)) {
+				return -1;
+			}
+			out += count;
+			break;
+		case 0x01: // end of file
+			return 0;
+		case 0x02: // extended segment address
+			if (count != 2) goto bad;
+			upper = ((rec[4] << 8) | rec[5]) << 4;
+			break;
+		case 0x04: // extended linear address
+			if (count != 2) goto bad;
+			upper = ((uint32_t) ((rec[4] << 8) | rec[5])) << 16;
+			break;
+		case 0x03: // start segment address
+		case 0x05: // start linear address
+			break;
+		default:
+			goto bad;
+		}
+	}
+	return 0;
+bad:
+	ERROR("image: bad HEX record on line %u\n", line);
+	return -1;
+}
+
+static int seg_cmp(const void* a, const void* b) {
+	const image_seg* x = a;
+	const image_seg* y = b;
+	if (x->addr < y->addr) return -1;
+	if (x->addr > y->addr) return 1;
+	return 0;
+}
+
+// sort, reject overlaps, and merge touching segments (copying them
+// into one buffer if they are not already contiguous in memory)
+static int coalesce(image* img) {
+	unsigned count = 0;
+	qsort(img->seg, img->count, sizeof(image_seg), seg_cmp);
+	for (unsigned n = 0; n < img->count; ) {
+		image_seg* s = img->seg + n;
+		uint32_t end = s->addr + s->size;
+		int copy = 0;
+		unsigned m;
+		for (m = n + 1; m < img->count; m++) {
+			image_seg* t = img->seg + m;
+			if (t->addr < end) {
+				ERROR("image: segments overlap at %08x\n", t->addr);
+				return -1;
+			}
+			if (t->addr != end) {
+				break;
+			}
+			if (t->data != (s->data + (end - s->addr))) {
+				copy = 1;
+			}
+			end = t->addr + t->size;
+		}
+		image_seg merged = *s;
+		merged.size = end - s->addr;
+		if (copy) {
+			uint8_t* buf = add_buf(img, merged.size);
+			if (buf == NULL) {
+				return -1;
+			}
+			for (unsigned k = n; k < m; k++) {
+				memcpy(buf + (img->seg[k].addr - s->addr),
+					img->seg[k].data, img->seg[k].size);
+			}
+			merged.data = buf;
+		}
+		img->seg[count++] = merged;
+		n = m;
+	}
+	img->count = count;
+	return 0;
+}
+
+image* image_load(const char* fn, const uint32_t* base) {
+	image* img;
+	struct stat st;
+	int fd, r;
+
+	if ((img = calloc(1, sizeof(image))) == NULL) {
+		return NULL;
+	}
+	img->map = MAP_FAILED;
+	if ((fd = open(fn, O_RDONLY)) < 0) {
+		ERROR("image: cannot open '%s'\n", fn);
+		goto fail;
+	}
+	if ((fstat(fd, &st) < 0) || (st.st_size == 0)) {
+		ERROR("image: '%s' is empty\n", fn);
+		close(fd);
+		goto fail;
+	}
+	img->map_sz = st.st_size;
+	img->map = mmap(NULL, img->map_sz, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (img->map == MAP_FAILED) {
+		ERROR("image: cannot map '%s'\n", fn);
+		goto fail;
+	}
+
+	const uint8_t* data = img->map;
+	size_t sz = img->map_sz;
+	if ((sz >= 4) && !memcmp(data, "\x7f" "ELF", 4)) {
+		img->format = "ELF";
+		r = load_elf(img, data, sz);
+	} else if (is_uf2(data, sz)) {
+		img->format = "UF2";
+		r = load_uf2(img, data, sz);
+	} else if (is_hex(data, sz)) {
+		img->format = "HEX";
+		r = load_hex(img, data, sz);
+	} else if (base != NULL) {
+		img->format = "raw";
+		r = add_seg(img, *base, sz, data);
+	} else {
+		ERROR("image: '%s' is not ELF, HEX, or UF2 (raw needs an address)\n", fn);
+		goto fail;
+	}
+	if (r || coalesce(img)) {
+		goto fail;
+	}
+	if (img->count == 0) {
+		ERROR("image: '%s' has nothing to load\n", fn);
+		goto fail;
+	}
+	return img;
+fail:
+	image_free(img);
+	return NULL;
+}
+
+void image_free(image* img) {
+	if (img == NULL) {
+		return;
+	}
+	if (img->map != MAP_FAILED) {
+		munmap(img->map, img->map_sz);
+	}
+	for (unsigned n = 0; n < img->buf_count; n++) {
+		free(img->buf[n]);
+	}
+	free(img->buf);
+	free(img->seg);
+	free(img);
+}
+
+int image_move(image* img, uint32_t addr, uint32_t size, uint32_t to) {
+	for (unsigned n = 0; n < img->count; n++) {
+		image_seg* s = img->seg + n;
+		uint32_t end = s->addr + s->size;
+		if ((s->addr - addr) < size) {
+			if ((end - addr) > size) {
+				ERROR("image: segment %08x..%08x is partly outside of %08x..%08x\n",
+					s->addr, end, addr, addr + size);
+				return -1;
+			}
+			s->addr = s->addr - addr + to;
+		} else if ((s->addr < addr) && (end > addr)) {
+			ERROR("image: segment %08x..%08x is partly outside of %08x..%08x\n",
+				s->addr, end, addr, addr + size);
+			return -1;
+		}
+	}
+	return coalesce(img);
+}
+
+const image_seg* image_segment(image* img, unsigned n) {
+	return (n < img->count) ? (img->seg + n) : NULL;
+}
+
+const char* image_format(image* img) {
+	return img->format;
+}
@@ -0,0 +1,37 @@
+// Copyright 2023, Brian Swetland <swetland@frotz.net>
+// Licensed under the Apache License, Version 2.0.
+
+#pragma once
+
+#include <stdint.h>
+
+// A file to load into the target: the PT_LOAD segments of an ELF
+// file (at their physical addresses), the data records of an Intel
+// HEX file, the main flash blocks of a UF2 file, or (if it is none
+// of those) a raw binary at a given address.
+//
+// The file is mapped rather than read, and segments point into the
+// mapping where they can.  Segments are sorted by address, never
+// overlap, and ones that touch are merged.
+
+typedef struct {
+	uint32_t addr;
+	uint32_t size;
+	const uint8_t* data;
+} image_seg;
+
+typedef struct image image;
+
+// base is where a raw binary loads (NULL if it must not be raw)
+image* image_load(const char* fn, const uint32_t* base);
+void image_free(image* img);
+
+// move the segments within [addr, addr + size) by to - addr (as
+// from where flash is linked to where a flash agent addresses it)
+int image_move(image* img, uint32_t addr, uint32_t size, uint32_t to);
+
+// the nth segment, or NULL
+const image_seg* image_segment(image* img, unsigned n);
+
+// "ELF", "HEX", "UF2", or "raw"
+const char* image_format(image* img);
@@ -0,0 +1,139 @@
+// Copyright 2023, Brian Swetland <swetland@frotz.net>
+// Licensed under the Apache License, Version 2.0.
+
+#include <string.h>
+
+#include "itm.h"
+
+#define S_HEADER   0
+#define S_PAYLOAD  1 // fixed size source packet payload
+#define S_CONTINUE 2 // 7 bits per byte while bit 7 is set
+
+// a synchronization packet is at least 47 zero bits then a one
+#define SYNC_ZEROS 5
+
+void itm_init(itm_decoder* d, void (*packet)(void* cookie, const itm_packet* pkt), void* cookie) {
+	memset(d, 0, sizeof(itm_decoder));
+	d->packet = packet;
+	d->cookie = cookie;
+}
+
+void itm_reset(itm_decoder* d) {
+	d->state = S_HEADER;
+	d->zeros = 0;
+}
+
+static void emit(itm_decoder* d) {
+	d->state = S_HEADER;
+	d->packet(d->cookie, &d->pkt);
+}
+
+static void error(itm_decoder* d, uint8_t b) {
+	d->pkt.type = ITM_ERROR;
+	d->pkt.id = 0;
+	d->pkt.len = 0;
+	d->pkt.value = b;
+	emit(d);
+}
+
+static void header(itm_decoder* d, uint8_t b) {
+	itm_packet* p = &d->pkt;
+	p->id = 0;
+	p->len = 0;
+	p->value = 0;
+	d->shift = 0;
+
+	if (b & 3) {
+		// source packet: 1, 2, or 4 bytes of payload
+		p->type = (b & 4) ? ITM_HWIT : ITM_SWIT;
+		p->id = b >> 3;
+		d->need = ((b & 3) == 3) ? 4 : (b & 3);
+		d->state = S_PAYLOAD;
+	} else if (b == 0x70) {
+		p->type = ITM_OVERFLOW;
+		emit(d);
+	} else if ((b & 0x8F) == 0x00) {
+		// local timestamp, format 2: the value is in the header
+		p->type = ITM_TIMESTAMP;
+		p->value = (b >> 4) & 7;
+		emit(d);
+	} else if ((b & 0xCF) == 0xC0) {
+		// local timestamp, format 1: id is the TC field
+		p->type = ITM_TIMESTAMP;
+		p->id = (b >> 4) & 3;
+		d->need = 4;
+		d->state = S_CONTINUE;
+	} else if ((b & 0x0B) == 0x08) {
+		// extension: 3 bits here, and maybe more to follow
+		p->type = ITM_EXTENSION;
+		p->id = (b >> 2) & 1;
+		p->value = (b >> 4) & 7;
+		d->shift = 3;
+		if (b & 0x80) {
+			d->need = 4;
+			d->state = S_CONTINUE;
+		} else {
+			emit(d);
+		}
+	} else if ((b == 0x94) || (b == 0xB4)) {
+		// global timestamp: id 0 for the low bits, 1 for the high
+		p->type = ITM_GTS;
+		p->id = (b >> 5) & 1;
+		d->need = (b == 0x94) ? 4 : 6;
+		d->state = S_CONTINUE;
+	} else {
+		error(d, b);
+	}
+}
+
+void itm_decode(itm_decoder* d, const uint8_t* data, unsigned len) {
+	itm_packet* p = &d->pkt;
+	while (len-- > 0) {
+		uint8_t b = *data++;
+
+		// synchronization overrides everything, as it is how the
+		// decoder recovers from lost data landing mid-packet
+		if (b == 0) {
+			d->zeros++;
+			if (d->state == S_HEADER) {
+				continue;
+			}
+		} else if ((b == 0x80) && (d->zeros >= SYNC_ZEROS)) {
+			d->zeros = 0;
+			p->type = ITM_SYNC;
+			p->id = 0;
+			p->len = 0;
+			p->value = 0;
+			emit(d);
+			continue;
+		} else {
+			d->zeros = 0;
+		}
+
+		switch (d->state) {
+		case S_HEADER:
+			header(d, b);
+			break;
+		case S_PAYLOAD:
+			p->value |= ((uint32_t) b) << (8 * p->len);
+			p->len++;
+			if (--d->need == 0) {
+				emit(d);
+			}
+			break;
+		case S_CONTINUE:
+			if (d->shift < 32) {
+				p->value |= ((uint32_t) (b & 0x7F)) << d->shift;
+			}
+			d->shift += 7;
+			p->len++;
+			if (!(b & 0x80)) {
+				emit(d);
+			} else if (--d->need == 0) {
+				// too long to be a valid packet
+				error(d, b);
+			}
+			break;
+		}
+	}
+}
@@ -0,0 +1,67 @@
+// Copyright 2023, Brian Swetland <swetland@frotz.net>
+// Licensed under the Apache License, Version 2.0.
+
+#pragma once
+
+#include <stdint.h>
+
+// ITM/DWT trace packet decoder (ARMv7-M ARM, Appendix D4)
+//
+// Bytes may be fed in arbitrarily sized pieces, and packets are
+// delivered to the callback as soon as their last byte arrives.
+
+#define ITM_SWIT      1 // stimulus port write: id = port
+#define ITM_HWIT      2 // DWT packet: id = discriminator (ITM_DWT_*)
+#define ITM_OVERFLOW  3 // the ITM or DWT had to drop packets
+#define ITM_SYNC      4
+#define ITM_TIMESTAMP 5 // local timestamp: value = cycles since the last
+#define ITM_GTS       6 // global timestamp: value = low 32 bits
+#define ITM_EXTENSION 7 // value = page (stimulus ports 32 * value + ...)
+#define ITM_ERROR     8 // reserved header byte: value = the byte
+
+// hardware source packet discriminators
+#define ITM_DWT_EVENT     0  // 1 byte of ITM_EVENT_* counter overflows
+#define ITM_DWT_EXCEPTION 1  // 2 bytes, ITM_EXC_*
+#define ITM_DWT_PC        2  // 4 byte PC, or 1 byte 0 (sleeping)
+#define ITM_DWT_DATA_PC   8  // +2n: comparator n matched at 4 byte PC
+#define ITM_DWT_DATA_ADDR 9  // +2n: comparator n matched at address (low 16 bits)
+#define ITM_DWT_DATA_RD   16 // +2n: comparator n read value
+#define ITM_DWT_DATA_WR   17 // +2n: comparator n wrote value
+
+#define ITM_EVENT_CPI   0x01
+#define ITM_EVENT_EXC   0x02
+#define ITM_EVENT_SLEEP 0x04
+#define ITM_EVENT_LSU   0x08
+#define ITM_EVENT_FOLD  0x10
+#define ITM_EVENT_CYC   0x20
+
+#define ITM_EXC_NUM(v)  ((v) & 0x1FF)
+#define ITM_EXC_FN(v)   (((v) >> 12) & 3)
+#define ITM_EXC_ENTER   1
+#define ITM_EXC_EXIT    2
+#define ITM_EXC_RETURN  3
+
+typedef struct {
+	uint32_t type;
+	uint32_t id;
+	uint32_t len;   // payload bytes
+	uint32_t value; // payload, little endian
+} itm_packet;
+
+typedef struct {
+	void (*packet)(void* cookie, const itm_packet* pkt);
+	void* cookie;
+
+	uint32_t state;
+	uint32_t zeros; // run of 0x00 bytes, for spotting sync
+	uint32_t need;  // payload bytes remaining (or allowed, if continued)
+	uint32_t shift;
+	itm_packet pkt;
+} itm_decoder;
+
+void itm_init(itm_decoder* d, void (*packet)(void* cookie, const itm_packet* pkt), void* cookie);
+
+// forget any partial packet (after trace data was lost, say)
+void itm_reset(itm_decoder* d);
+
+void itm_decode(itm_decoder* d, const uint8_t* data, unsigned len);
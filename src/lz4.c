@@ -0,0 +1,100 @@
+// Copyright 2023, Brian Swetland <swetland@frotz.net>
+// Licensed under the Apache License, Version 2.0.
+
+#include <string.h>
+
+#include "lz4.h"
+
+#define MIN_MATCH    4
+#define MAX_OFFSET   65535
+// the block format wants the last 5 bytes to be literals and
+// the last match to start at least 12 bytes before the end
+#define LAST_LITERALS 5
+#define MATCH_LIMIT  12
+
+#define HASH_BITS    12
+
+static uint32_t rd32(const uint8_t* p) {
+	uint32_t v;
+	memcpy(&v, p, 4);
+	return v;
+}
+
+static unsigned hash(uint32_t v) {
+	return (v * 2654435761U) >> (32 - HASH_BITS);
+}
+
+static uint8_t* put_len(uint8_t* out, uint32_t len) {
+	while (len >= 255) {
+		*out++ = 255;
+		len -= 255;
+	}
+	*out++ = len;
+	return out;
+}
+
+// a sequence of literals and then a match (none if mlen is 0)
+static uint8_t* put_seq(uint8_t* out, uint8_t* end, const uint8_t* lit,
+	uint32_t nlit, uint32_t offset, uint32_t mlen) {
+	// the most it can need
+	uint64_t need = 1 + (nlit / 255 + 1) + nlit + 2 + (mlen / 255 + 1);
+	if (need > (uint64_t) (end - out)) {
+		return NULL;
+	}
+	uint8_t* token = out++;
+	*token = ((nlit < 15) ? nlit : 15) << 4;
+	if (nlit >= 15) {
+		out = put_len(out, nlit - 15);
+	}
+	memcpy(out, lit, nlit);
+	out += nlit;
+	if (mlen) {
+		*out++ = offset;
+		*out++ = offset >> 8;
+		mlen -= MIN_MATCH;
+		*token |= (mlen < 15) ? mlen : 15;
+		if (mlen >= 15) {
+			out = put_len(out, mlen - 15);
+		}
+	}
+	return out;
+}
+
+uint32_t lz4_compress(const uint8_t* src, uint32_t len, uint8_t* dst, uint32_t max) {
+	// positions (plus one, so zero is empty) of recent 4 byte strings
+	uint32_t table[1 << HASH_BITS];
+	uint8_t* out = dst;
+	uint8_t* end = dst + max;
+	uint32_t anchor = 0;
+	uint32_t pos = 0;
+
+	memset(table, 0, sizeof(table));
+	while ((pos + MATCH_LIMIT) < len) {
+		uint32_t v = rd32(src + pos);
+		unsigned h = hash(v);
+		uint32_t ref = table[h];
+		table[h] = pos + 1;
+		if ((ref == 0) || ((pos - (ref - 1)) > MAX_OFFSET) ||
+			(rd32(src + ref - 1) != v)) {
+			pos++;
+			continue;
+		}
+		ref--;
+		uint32_t mlen = MIN_MATCH;
+		uint32_t mmax = len - LAST_LITERALS - pos;
+		while ((mlen < mmax) && (src[pos + mlen] == src[ref + mlen])) {
+			mlen++;
+		}
+		out = put_seq(out, end, src + anchor, pos - anchor, pos - ref, mlen);
+		if (out == NULL) {
+			return 0;
+		}
+		pos += mlen;
+		anchor = pos;
+	}
+	out = put_seq(out, end, src + anchor, len - anchor, 0, 0);
+	if (out == NULL) {
+		return 0;
+	}
+	return out - dst;
+}
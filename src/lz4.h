@@ -0,0 +1,12 @@
+// Copyright 2023, Brian Swetland <swetland@frotz.net>
+// Licensed under the Apache License, Version 2.0.
+
+#pragma once
+
+#include <stdint.h>
+
+// Compress len bytes at src into an LZ4 block (as agent/lz4.h
+// decompresses) at dst, returning its size, or 0 if it would not
+// fit in max bytes.  A simple greedy compressor: flash images are
+// small and it only needs to beat the debug link.
+uint32_t lz4_compress(const uint8_t* src, uint32_t len, uint8_t* dst, uint32_t max);
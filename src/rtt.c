@@ -0,0 +1,255 @@
+// Copyright 2023, Brian Swetland <swetland@frotz.net>
+// Licensed under the Apache License, Version 2.0.
+
+#include <string.h>
+#include <stdlib.h>
+
+#include "rtt.h"
+
+// RAM is searched this many bytes per batch
+#define RTT_SCAN_CHUNK (16 * 1024)
+
+// sanity limits on the control block's buffer counts and sizes
+#define RTT_LIMIT 32
+#define RTT_SIZE_LIMIT (1024 * 1024)
+
+// each up buffer yields at most this many bytes per rtt_read()
+#define RTT_READ_MAX 4096
+
+#define WORDS(n) ((n) / 4)
+
+static void rtt_desc(rtt_buffer* b, const uint32_t* w) {
+	b->name = w[0];
+	b->buf = w[1];
+	b->size = w[2];
+	b->wr = w[3];
+	b->rd = w[4];
+	b->flags = w[5];
+}
+
+// a target may configure buffers after the control block exists
+static int rtt_desc_ok(const rtt_buffer* b) {
+	return (b->buf != 0) && (b->size > 1) && (b->size <= RTT_SIZE_LIMIT) &&
+		(b->wr < b->size) && (b->rd < b->size);
+}
+
+static uint32_t rtt_desc_addr(rtt_cb* cb, int up, unsigned n) {
+	return cb->addr + RTT_CB_SZ +
+		RTT_DESC_SZ * (up ? n : (cb->max_up + n));
+}
+
+// read the header and tracked descriptors of a candidate control block
+static int rtt_load(dctx_t* dc, uint32_t addr, rtt_cb* cb) {
+	uint32_t hdr[WORDS(RTT_CB_SZ)];
+	uint32_t up[WORDS(RTT_DESC_SZ) * RTT_MAX_UP];
+	uint32_t down[WORDS(RTT_DESC_SZ) * RTT_MAX_DOWN];
+	int r;
+
+	if ((r = dc_mem_rd_words(dc, addr, WORDS(RTT_CB_SZ), hdr)) < 0) {
+		return r;
+	}
+	if (memcmp(hdr, RTT_ID, sizeof(RTT_ID)) ||
+		(hdr[4] < 1) || (hdr[4] > RTT_LIMIT) || (hdr[5] > RTT_LIMIT)) {
+		return 0;
+	}
+	cb->addr = addr;
+	cb->max_up = hdr[4];
+	cb->max_down = hdr[5];
+	cb->num_up = (cb->max_up > RTT_MAX_UP) ? RTT_MAX_UP : cb->max_up;
+	cb->num_down = (cb->max_down > RTT_MAX_DOWN) ? RTT_MAX_DOWN : cb->max_down;
+
+	dc_q_init(dc);
+	dc_q_mem_rd_words(dc, rtt_desc_addr(cb, 1, 0), WORDS(RTT_DESC_SZ) * cb->num_up, up);
+	dc_q_mem_rd_words(dc, rtt_desc_addr(cb, 0, 0), WORDS(RTT_DESC_SZ) * cb->num_down, down);
+	if ((r = dc_q_exec(dc)) < 0) {
+		return r;
+	}
+	for (unsigned n = 0; n < cb->num_up; n++) {
+		rtt_desc(cb->up + n, up + WORDS(RTT_DESC_SZ) * n);
+	}
+	for (unsigned n = 0; n < cb->num_down; n++) {
+		rtt_desc(cb->down + n, down + WORDS(RTT_DESC_SZ) * n);
+	}
+	// the console (up buffer 0) is always configured
+	return rtt_desc_ok(cb->up) ? 1 : 0;
+}
+
+int rtt_find(dctx_t* dc, uint32_t addr, uint32_t len, rtt_cb* cb) {
+	uint32_t* data;
+	int r = 0;
+
+	addr &= ~3U;
+	len &= ~3U;
+	if ((data = malloc(RTT_SCAN_CHUNK)) == NULL) {
+		return DC_ERR_FAILED;
+	}
+	// chunks overlap so an ID straddling two is seen whole in one
+	while (len >= RTT_ID_SZ) {
+		uint32_t xfer = (len > RTT_SCAN_CHUNK) ? RTT_SCAN_CHUNK : len;
+		if ((r = dc_mem_rd_words(dc, addr, WORDS(xfer), data)) < 0) {
+			break;
+		}
+		for (uint32_t off = 0; (off + RTT_ID_SZ) <= xfer; off += 4) {
+			if (memcmp((uint8_t*) data + off, RTT_ID, sizeof(RTT_ID))) {
+				continue;
+			}
+			if ((r = rtt_load(dc, addr + off, cb)) != 0) {
+				goto done;
+			}
+		}
+		if (xfer == len) {
+			break;
+		}
+		xfer -= RTT_ID_SZ;
+		addr += xfer;
+		len -= xfer;
+	}
+done:
+	free(data);
+	return r;
+}
+
+typedef struct {
+	uint32_t addr; // word aligned start
+	uint32_t words;
+	uint32_t skip; // bytes before the data in the first word
+	uint32_t len;
+	uint32_t n;    // up buffer
+	uint32_t* ptr;
+} rtt_range;
+
+static uint32_t rtt_range_add(rtt_range* rr, unsigned n, uint32_t addr, uint32_t len) {
+	rr->addr = addr & ~3U;
+	rr->skip = addr & 3;
+	rr->words = WORDS(rr->skip + len + 3);
+	rr->len = len;
+	rr->n = n;
+	return rr->words;
+}
+
+int rtt_read(dctx_t* dc, rtt_cb* cb,
+	void (*data)(void* cookie, unsigned n, const uint8_t* ptr, unsigned len),
+	void* cookie) {
+	uint32_t w[WORDS(RTT_CB_SZ) + WORDS(RTT_DESC_SZ) * RTT_MAX_UP];
+	rtt_range rr[RTT_MAX_UP * 2];
+	uint32_t next[RTT_MAX_UP]; // read offsets once the data is read
+	unsigned count = 0;
+	uint32_t total = 0;
+	int r;
+
+	// 1: the header, to notice a reset target, and the up descriptors
+	if ((r = dc_mem_rd_words(dc, cb->addr,
+		WORDS(RTT_CB_SZ) + WORDS(RTT_DESC_SZ) * cb->num_up, w)) < 0) {
+		return r;
+	}
+	if (memcmp(w, RTT_ID, sizeof(RTT_ID)) ||
+		(w[4] != cb->max_up) || (w[5] != cb->max_down)) {
+		return DC_ERR_BAD_STATE;
+	}
+	for (unsigned n = 0; n < cb->num_up; n++) {
+		rtt_buffer* b = cb->up + n;
+		rtt_desc(b, w + WORDS(RTT_CB_SZ) + WORDS(RTT_DESC_SZ) * n);
+		next[n] = b->rd;
+		if (!rtt_desc_ok(b) || (b->wr == b->rd)) {
+			continue;
+		}
+		// up to the write offset or the end, then (if it wrapped
+		// and there is room) on from the start
+		uint32_t len = (b->wr > b->rd) ? (b->wr - b->rd) : (b->size - b->rd);
+		if (len > RTT_READ_MAX) {
+			len = RTT_READ_MAX;
+		}
+		total += rtt_range_add(rr + count++, n, b->buf + b->rd, len);
+		uint32_t used = len;
+		if ((b->wr < b->rd) && (b->wr > 0) && ((b->rd + len) == b->size) &&
+			(len < RTT_READ_MAX)) {
+			len = RTT_READ_MAX - len;
+			if (len > b->wr) {
+				len = b->wr;
+			}
+			total += rtt_range_add(rr + count++, n, b->buf, len);
+			used += len;
+		}
+		next[n] = (b->rd + used) % b->size;
+	}
+	if (count == 0) {
+		return 0;
+	}
+
+	// 2: the data, and then the new read offsets
+	uint32_t* buf = malloc(total * 4);
+	if (buf == NULL) {
+		return DC_ERR_FAILED;
+	}
+	dc_q_init(dc);
+	uint32_t* ptr = buf;
+	for (unsigned i = 0; i < count; i++) {
+		rr[i].ptr = ptr;
+		dc_q_mem_rd_words(dc, rr[i].addr, rr[i].words, ptr);
+		ptr += rr[i].words;
+	}
+	for (unsigned n = 0; n < cb->num_up; n++) {
+		if (next[n] != cb->up[n].rd) {
+			dc_q_mem_wr32(dc, rtt_desc_addr(cb, 1, n) + RTT_DESC_RD, next[n]);
+		}
+	}
+	if ((r = dc_q_exec(dc)) == DC_OK) {
+		r = 0;
+		for (unsigned i = 0; i < count; i++) {
+			data(cookie, rr[i].n, (uint8_t*) rr[i].ptr + rr[i].skip, rr[i].len);
+			r += rr[i].len;
+		}
+		for (unsigned n = 0; n < cb->num_up; n++) {
+			cb->up[n].rd = next[n];
+		}
+	}
+	free(buf);
+	return r;
+}
+
+int rtt_write(dctx_t* dc, rtt_cb* cb, unsigned n, const void* ptr, unsigned len) {
+	uint32_t w[WORDS(RTT_DESC_SZ)];
+	uint32_t addr;
+	int r;
+
+	if (n >= cb->num_down) {
+		return DC_ERR_BAD_PARAMS;
+	}
+	addr = rtt_desc_addr(cb, 0, n);
+	if ((r = dc_mem_rd_words(dc, addr, WORDS(RTT_DESC_SZ), w)) < 0) {
+		return r;
+	}
+	rtt_buffer* b = cb->down + n;
+	rtt_desc(b, w);
+	if (!rtt_desc_ok(b)) {
+		return DC_ERR_BAD_STATE;
+	}
+
+	uint32_t space = (b->rd > b->wr) ? (b->rd - b->wr - 1) : (b->size - (b->wr - b->rd) - 1);
+	if (len > space) {
+		len = space;
+	}
+	if (len == 0) {
+		return 0;
+	}
+	uint32_t xfer = b->size - b->wr;
+	if (xfer > len) {
+		xfer = len;
+	}
+	if ((r = dc_mem_write(dc, b->buf + b->wr, xfer, ptr)) < 0) {
+		return r;
+	}
+	if ((xfer < len) &&
+		((r = dc_mem_write(dc, b->buf, len - xfer, (const uint8_t*) ptr + xfer)) < 0)) {
+		return r;
+	}
+	// only once the data is there may the target see it
+	uint32_t wr = (b->wr + len) % b->size;
+	dc_q_init(dc);
+	dc_q_mem_wr32(dc, addr + RTT_DESC_WR, wr);
+	if ((r = dc_q_exec(dc)) < 0) {
+		return r;
+	}
+	b->wr = wr;
+	return len;
+}
@@ -0,0 +1,68 @@
+// Copyright 2023, Brian Swetland <swetland@frotz.net>
+// Licensed under the Apache License, Version 2.0.
+
+#pragma once
+
+#include <stdint.h>
+
+#include "transport.h"
+
+// RTT-style console: ring buffers in target RAM, described by a
+// control block the debugger finds by scanning for its ID string
+//
+// control block:        buffer descriptor (24 bytes):
+//   char id[16]           uint32_t name (pointer)
+//   int32 max_num_up      uint32_t buf (pointer)
+//   int32 max_num_down    uint32_t size
+//   up[max_num_up]        uint32_t wr (written by the producer)
+//   down[max_num_down]    uint32_t rd (written by the consumer)
+//                         uint32_t flags
+//
+// The target produces into up buffers and consumes from down
+// buffers.  A buffer is empty when rd == wr, so holds size - 1 bytes.
+
+#define RTT_ID "SEGGER RTT"
+#define RTT_ID_SZ 16
+
+#define RTT_MAX_UP   8 // buffers past these are ignored
+#define RTT_MAX_DOWN 8
+
+#define RTT_CB_SZ   24
+#define RTT_DESC_SZ 24
+#define RTT_DESC_WR 12
+#define RTT_DESC_RD 16
+
+typedef struct {
+	uint32_t name;
+	uint32_t buf;
+	uint32_t size;
+	uint32_t wr;
+	uint32_t rd;
+	uint32_t flags;
+} rtt_buffer;
+
+typedef struct {
+	uint32_t addr;
+	uint32_t max_up;    // as the target declares them
+	uint32_t max_down;
+	uint32_t num_up;    // as many as are tracked
+	uint32_t num_down;
+	rtt_buffer up[RTT_MAX_UP];
+	rtt_buffer down[RTT_MAX_DOWN];
+} rtt_cb;
+
+// search [addr, addr + len) for a control block
+// 1 = found (and *cb filled in), 0 = not found, < 0 = error
+int rtt_find(dctx_t* dc, uint32_t addr, uint32_t len, rtt_cb* cb);
+
+// read what is pending in every up buffer (at most 4K of each),
+// handing the data to the callback and advancing the target's
+// read offsets past it, all in two batches
+// returns bytes read, DC_ERR_BAD_STATE if the control block is gone
+int rtt_read(dctx_t* dc, rtt_cb* cb,
+	void (*data)(void* cookie, unsigned n, const uint8_t* ptr, unsigned len),
+	void* cookie);
+
+// queue as much of ptr as fits in down buffer n
+// returns bytes written (maybe 0, if it is full), or < 0 on error
+int rtt_write(dctx_t* dc, rtt_cb* cb, unsigned n, const void* ptr, unsigned len);
@@ -1,23 +1,28 @@
 // Copyright 2023, Brian Swetland <swetland@frotz.net>
 // Licensed under the Apache License, Version 2.0.
 
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
 #include "transport.h"
 #include "transport-private.h"
 
 #include "arm-debug.h"
 #include "arm-v7-debug.h"
+#include "arm-v7-system-control.h"
 
 static void dc_q_map_csw_wr(DC* dc, uint32_t val) {
 	if (val != dc->map_csw_cache) {
-		dc->map_csw_cache = val;
 		dc_q_map_wr(dc, MAP_CSW, val | dc->map_csw_keep);
+		dc->map_csw_cache = val;
 	}
 }
 
 static void dc_q_map_tar_wr(DC* dc, uint32_t val) {
 	if (val != dc->map_tar_cache) {
-		dc->map_tar_cache = val;
 		dc_q_map_wr(dc, MAP_TAR, val);
+		dc->map_tar_cache = val;
 	}
 }
 
@@ -42,9 +47,16 @@ void dc_q_mem_match32(DC* dc, uint32_t addr, uint32_t val) {
 	}
 }
 
+static void dc_q_mem_wr_run(DC* dc, uint32_t csw, uint32_t addr, uint32_t num, const uint32_t* ptr);
+
 void dc_q_mem_wr32(DC* dc, uint32_t addr, uint32_t val) {
 	if (addr & 3) {
 		dc->qerror = DC_ERR_BAD_PARAMS;
+	} else if (dc->flags & DCF_WRITE_COMBINE) {
+		// with TAR auto-incrementing, a sequence of writes to
+		// consecutive addresses becomes a run of DRW writes
+		dc_q_mem_wr_run(dc, MAP_CSW_SZ_32 | MAP_CSW_INC_SINGLE | MAP_CSW_DEVICE_EN,
+			addr, 1, &val);
 	} else {
 		dc_q_map_csw_wr(dc, MAP_CSW_SZ_32 | MAP_CSW_INC_OFF | MAP_CSW_DEVICE_EN);
 		dc_q_map_tar_wr(dc, addr);
@@ -53,91 +65,664 @@ void dc_q_mem_wr32(DC* dc, uint32_t addr, uint32_t val) {
 }
 
 int dc_mem_rd32(DC* dc, uint32_t addr, uint32_t* val) {
+	if (dc_cache_covers(dc, addr, 4) && !(addr & 3)) {
+		return dc_cache_read(dc, addr, 4, val);
+	}
 	dc_q_init(dc);
 	dc_q_mem_rd32(dc, addr, val);
-	return dc_q_exec(dc);
+	int r = dc_q_exec(dc);
+	if ((r == DC_OK) && (addr == DHCSR)) {
+		dc_cache_observe(dc, *val);
+	}
+	return r;
 }
 
 int dc_mem_wr32(DC* dc, uint32_t addr, uint32_t val) {
 	dc_q_init(dc);
 	dc_q_mem_wr32(dc, addr, val);
-	return dc_q_exec(dc);
+	return dc_q_exec_wr(dc);
 }
 
 
 
-#if 0
-int dc_mem_rd_words(dctx_t* dc, uint32_t addr, uint32_t num, uint32_t* ptr) {
-	while (num > 0) {
-		dc_q_mem_rd32(dc, addr, ptr);
-		num--;
-		addr += 4;
-		ptr++;
+// TAR auto-increment is only guaranteed within a 1K block, which is
+// the minimum required by spec (and some targets like rp2040 are
+// limited to this), but many implementations support 4K
+#define WRAPSIZE_MIN MAP_TAR_WRAP_MIN
+#define WRAPSIZE_MAX 0x1000
+
+// Find the supported access sizes of the active MAP, and its
+// TAR auto-increment wrap size, by reading
+// the last word of the 4K ROM table at MAP.BASE (always safe to read)
+// and checking where TAR ends up: BASE + 4K - wrap, or a 4K boundary
+// if the wrap is 4K or larger.
+int dc_map_probe(DC* dc) {
+	uint32_t base, tar, csw8, csw16, cswp;
+	dc->map_wrap_size = WRAPSIZE_MIN;
+	dc->map_sizes = 1U << MAP_CSW_SZ_32;
+	dc->map_packed = 0;
+
+	// CSW.Size and CSW.AddrInc read back as written only if the
+	// MAP supports that access size or packed transfers
+	dc_q_init(dc);
+	dc_q_map_wr(dc, MAP_CSW, MAP_CSW_SZ_8 | MAP_CSW_DEVICE_EN | dc->map_csw_keep);
+	dc_q_map_rd(dc, MAP_CSW, &csw8);
+	dc_q_map_wr(dc, MAP_CSW, MAP_CSW_SZ_16 | MAP_CSW_DEVICE_EN | dc->map_csw_keep);
+	dc_q_map_rd(dc, MAP_CSW, &csw16);
+	dc_q_map_wr(dc, MAP_CSW, MAP_CSW_SZ_8 | MAP_CSW_INC_PACKED | MAP_CSW_DEVICE_EN | dc->map_csw_keep);
+	dc_q_map_rd(dc, MAP_CSW, &cswp);
+	dc_q_map_rd(dc, MAP_BASE, &base);
+	int r = dc_q_exec(dc);
+	if (r != DC_OK) {
+		return r;
 	}
-	return dc_q_exec(dc);
+	if ((csw8 & MAP_CSW_SZ_MASK) == MAP_CSW_SZ_8) {
+		dc->map_sizes |= 1U << MAP_CSW_SZ_8;
+	}
+	if ((csw16 & MAP_CSW_SZ_MASK) == MAP_CSW_SZ_16) {
+		dc->map_sizes |= 1U << MAP_CSW_SZ_16;
+	}
+	if (((cswp & MAP_CSW_SZ_MASK) == MAP_CSW_SZ_8) &&
+		((cswp & MAP_CSW_INC_MASK) == MAP_CSW_INC_PACKED)) {
+		dc->map_packed = 1;
+	}
+	DEBUG("attach: MAP access%s%s 32%s\n",
+		(dc->map_sizes & (1U << MAP_CSW_SZ_8)) ? " 8" : "",
+		(dc->map_sizes & (1U << MAP_CSW_SZ_16)) ? " 16" : "",
+		dc->map_packed ? " packed" : "");
+
+	// need an ADIv5 format base address that's present
+	if ((base & 3) != 3) {
+		DEBUG("attach: MAP.BASE    %08x (no rom table)\n", base);
+		return DC_OK;
+	}
+	base &= ~(WRAPSIZE_MAX - 1);
+
+	dc_q_init(dc);
+	dc_q_map_csw_wr(dc, MAP_CSW_SZ_32 | MAP_CSW_INC_SINGLE | MAP_CSW_DEVICE_EN);
+	dc_q_map_tar_wr(dc, base + WRAPSIZE_MAX - 4);
+	dc_q_map_rd(dc, MAP_DRW, &tar);
+	dc_q_map_rd(dc, MAP_TAR, &tar);
+	if ((r = dc_q_exec(dc)) != DC_OK) {
+		return r;
+	}
+	dc->map_tar_cache = tar;
+
+	uint32_t wrap = 0;
+	if ((tar & (WRAPSIZE_MAX - 1)) == 0) {
+		// carried or wrapped at 4K or above, as far as we can tell
+		wrap = WRAPSIZE_MAX;
+	} else if ((tar & ~(WRAPSIZE_MAX - 1)) == base) {
+		wrap = WRAPSIZE_MAX - (tar & (WRAPSIZE_MAX - 1));
+	}
+	if ((wrap == WRAPSIZE_MIN) || (wrap == (WRAPSIZE_MIN * 2)) ||
+		(wrap == WRAPSIZE_MAX)) {
+		dc->map_wrap_size = wrap;
+	} else {
+		DEBUG("attach: MAP TAR %08x after wrap probe?\n", tar);
+	}
+	DEBUG("attach: MAP TAR wrap %u bytes\n", dc->map_wrap_size);
+	return DC_OK;
 }
 
-int dc_mem_wr_words(dctx_t* dc, uint32_t addr, uint32_t num, const uint32_t* ptr) {
-	while (num > 0) {
-		dc_q_mem_wr32(dc, addr, *ptr);
-		num--;
-		addr += 4;
-		ptr++;
+// TAR auto-increments through a run, but may wrap rather than
+// cross a wrap boundary, so if we end on one, we don't know
+static void dc_q_map_tar_track(DC* dc, uint32_t next) {
+	if ((dc->qerror == DC_OK) && (next & (dc->map_wrap_size - 1))) {
+		dc->map_tar_cache = next;
+	} else {
+		dc->map_tar_cache = INVALID;
 	}
-	return dc_q_exec(dc);
 }
-#else
-// some implementations support >10 bits, but 10 is the minimum required
-// by spec (and some targets like rp2040 are limited to this)
-#define WRAPSIZE 0x400
-#define WRAPMASK (WRAPSIZE - 1)
 
-int dc_mem_rd_words(dctx_t* dc, uint32_t addr, uint32_t num, uint32_t* ptr) {
+// queue a run of DRW accesses with TAR auto-incrementing by 4 per
+// access, split at wrap boundaries (csw selects word or packed byte)
+static void dc_q_mem_rd_run(DC* dc, uint32_t csw, uint32_t addr, uint32_t num, uint32_t* ptr) {
 	while (num > 0) {
-		uint32_t xfer = (WRAPSIZE - (addr & WRAPMASK)) / 4;
+		uint32_t xfer = (dc->map_wrap_size - (addr & (dc->map_wrap_size - 1))) / 4;
 		if (xfer > num) {
 			xfer = num;
 		}
-		dc_q_init(dc);
-		dc_q_map_csw_wr(dc, MAP_CSW_SZ_32 | MAP_CSW_INC_SINGLE | MAP_CSW_DEVICE_EN);
+		dc_q_map_csw_wr(dc, csw);
 		dc_q_map_tar_wr(dc, addr);
 		num -= xfer;
 		addr += xfer * 4;
-		while (xfer > 0) {
-			dc_q_map_rd(dc, MAP_DRW, ptr++);
-			xfer--;
-		}
-		int r = dc_q_exec(dc);
-		if (r != DC_OK) {
-			return r;
-		}
+		dc_q_map_rd_block(dc, MAP_DRW, ptr, xfer);
+		ptr += xfer;
+		dc_q_map_tar_track(dc, addr);
 	}
-	return DC_OK;
 }
 
-int dc_mem_wr_words(dctx_t* dc, uint32_t addr, uint32_t num, const uint32_t* ptr) {
+static void dc_q_mem_wr_run(DC* dc, uint32_t csw, uint32_t addr, uint32_t num, const uint32_t* ptr) {
 	while (num > 0) {
-		uint32_t xfer = (WRAPSIZE - (addr & WRAPMASK)) / 4;
+		uint32_t xfer = (dc->map_wrap_size - (addr & (dc->map_wrap_size - 1))) / 4;
 		if (xfer > num) {
 			xfer = num;
 		}
-		dc_q_init(dc);
-		dc_q_map_csw_wr(dc, MAP_CSW_SZ_32 | MAP_CSW_INC_SINGLE | MAP_CSW_DEVICE_EN);
+		dc_q_map_csw_wr(dc, csw);
 		dc_q_map_tar_wr(dc, addr);
 		num -= xfer;
 		addr += xfer * 4;
-		while (xfer > 0) {
-			dc_q_map_wr(dc, MAP_DRW, *ptr++);
-			xfer--;
+		dc_q_map_wr_block(dc, MAP_DRW, ptr, xfer);
+		ptr += xfer;
+		dc_q_map_tar_track(dc, addr);
+	}
+}
+
+void dc_q_mem_rd_words(DC* dc, uint32_t addr, uint32_t num, uint32_t* ptr) {
+	dc_q_mem_rd_run(dc, MAP_CSW_SZ_32 | MAP_CSW_INC_SINGLE | MAP_CSW_DEVICE_EN,
+		addr, num, ptr);
+}
+
+static void dc_q_mem_wr_words(DC* dc, uint32_t addr, uint32_t num, const uint32_t* ptr) {
+	dc_q_mem_wr_run(dc, MAP_CSW_SZ_32 | MAP_CSW_INC_SINGLE | MAP_CSW_DEVICE_EN,
+		addr, num, ptr);
+}
+
+int dc_mem_rd_words(dctx_t* dc, uint32_t addr, uint32_t num, uint32_t* ptr) {
+	if (dc_cache_covers(dc, addr, num * 4) && !(addr & 3)) {
+		return dc_cache_read(dc, addr, num * 4, ptr);
+	}
+	// one queue for the whole run keeps the probe's packet window full
+	dc_q_init(dc);
+	dc_q_mem_rd_words(dc, addr, num, ptr);
+	return dc_q_exec(dc);
+}
+
+int dc_mem_wr_words(dctx_t* dc, uint32_t addr, uint32_t num, const uint32_t* ptr) {
+	dc_q_init(dc);
+	dc_q_mem_wr_words(dc, addr, num, ptr);
+	return dc_q_exec(dc);
+}
+
+int dc_mem_sample32(DC* dc, uint32_t addr, uint32_t num, uint32_t* ptr) {
+	if (addr & 3) {
+		return DC_ERR_BAD_PARAMS;
+	}
+	// with TAR not incrementing, a run of DRW reads is a run of
+	// samples, packed as densely as the probe allows
+	dc_q_init(dc);
+	dc_q_map_csw_wr(dc, MAP_CSW_SZ_32 | MAP_CSW_INC_OFF | MAP_CSW_DEVICE_EN);
+	dc_q_map_tar_wr(dc, addr);
+	dc_q_map_rd_block(dc, MAP_DRW, ptr, num);
+	return dc_q_exec(dc);
+}
+
+static int iovec_cmp(const void* a, const void* b) {
+	const dc_iovec* x = *((const dc_iovec**) a);
+	const dc_iovec* y = *((const dc_iovec**) b);
+	if (x->addr < y->addr) return -1;
+	if (x->addr > y->addr) return 1;
+	return 0;
+}
+
+// Sort the ranges, merge the ones that overlap or are close, and
+// read each merged run with one auto-incrementing block transfer,
+// all in a single queue, into one scratch buffer.
+int dc_mem_readv(DC* dc, const dc_iovec* iov, unsigned count) {
+	if (count == 0) {
+		return DC_OK;
+	}
+	const dc_iovec** v = malloc(count * sizeof(dc_iovec*));
+	uint32_t* off = malloc(count * sizeof(uint32_t));
+	uint32_t* run = malloc(count * 2 * sizeof(uint32_t));
+	uint32_t* data = NULL;
+	int r = DC_ERR_FAILED;
+	if ((v == NULL) || (off == NULL) || (run == NULL)) {
+		goto done;
+	}
+	for (unsigned n = 0; n < count; n++) {
+		v[n] = iov + n;
+	}
+	qsort(v, count, sizeof(dc_iovec*), iovec_cmp);
+
+	// plan the runs (start, end) and where each range lands
+	unsigned runs = 0;
+	uint32_t total = 0;
+	for (unsigned n = 0; n < count; ) {
+		uint32_t start = v[n]->addr & ~3U;
+		uint32_t end = (v[n]->addr + v[n]->len + 3) & ~3U;
+		unsigned first = n++;
+		while (n < count) {
+			uint32_t s = v[n]->addr & ~3U;
+			uint32_t e = (v[n]->addr + v[n]->len + 3) & ~3U;
+			if (s > (end + DC_READV_GAP)) {
+				break;
+			}
+			if (e > end) {
+				end = e;
+			}
+			n++;
 		}
-		int r = dc_q_exec(dc);
-		if (r != DC_OK) {
-			return r;
+		for (unsigned i = first; i < n; i++) {
+			off[v[i] - iov] = total + (v[i]->addr - start);
 		}
+		run[runs * 2 + 0] = start;
+		run[runs * 2 + 1] = end;
+		runs++;
+		total += end - start;
+	}
+
+	if ((data = malloc(total ? total : 4)) == NULL) {
+		goto done;
+	}
+	dc_q_init(dc);
+	uint32_t* next = data;
+	for (unsigned n = 0; n < runs; n++) {
+		uint32_t words = (run[n * 2 + 1] - run[n * 2 + 0]) / 4;
+		dc_q_mem_rd_words(dc, run[n * 2 + 0], words, next);
+		next += words;
+	}
+	if ((r = dc_q_exec(dc)) == DC_OK) {
+		for (unsigned i = 0; i < count; i++) {
+			memcpy(iov[i].dst, ((uint8_t*) data) + off[i], iov[i].len);
+		}
+	}
+done:
+	free(v);
+	free(off);
+	free(run);
+	free(data);
+	return r;
+}
+
+// 8 and 16 bit accesses use the DRW byte lanes matching the address
+static inline uint32_t lane_shift(uint32_t addr) {
+	return (addr & 3) * 8;
+}
+
+// queue a single 8/16/32 bit read, leaving the whole DRW value in *word
+static void dc_q_mem_rd_sz(DC* dc, uint32_t addr, uint32_t sz, uint32_t* word) {
+	if (!(dc->map_sizes & (1U << sz))) {
+		dc->qerror = DC_ERR_UNSUPPORTED;
+	} else if (addr & ((1U << sz) - 1)) {
+		dc->qerror = DC_ERR_BAD_PARAMS;
+	} else {
+		dc_q_map_csw_wr(dc, sz | MAP_CSW_INC_OFF | MAP_CSW_DEVICE_EN);
+		dc_q_map_tar_wr(dc, addr);
+		dc_q_map_rd(dc, MAP_DRW, word);
+	}
+}
+
+static void dc_q_mem_wr_sz(DC* dc, uint32_t addr, uint32_t sz, uint32_t val) {
+	if (!(dc->map_sizes & (1U << sz))) {
+		dc->qerror = DC_ERR_UNSUPPORTED;
+	} else if (addr & ((1U << sz) - 1)) {
+		dc->qerror = DC_ERR_BAD_PARAMS;
+	} else {
+		dc_q_map_csw_wr(dc, sz | MAP_CSW_INC_OFF | MAP_CSW_DEVICE_EN);
+		dc_q_map_tar_wr(dc, addr);
+		dc_q_map_wr(dc, MAP_DRW, val << lane_shift(addr));
 	}
-	return DC_OK;
 }
-#endif
+
+void dc_q_mem_wr8(DC* dc, uint32_t addr, uint8_t val) {
+	dc_q_mem_wr_sz(dc, addr, MAP_CSW_SZ_8, val);
+}
+
+void dc_q_mem_wr16(DC* dc, uint32_t addr, uint16_t val) {
+	dc_q_mem_wr_sz(dc, addr, MAP_CSW_SZ_16, val);
+}
+
+int dc_mem_rd8(DC* dc, uint32_t addr, uint8_t* val) {
+	uint32_t word;
+	dc_q_init(dc);
+	dc_q_mem_rd_sz(dc, addr, MAP_CSW_SZ_8, &word);
+	int r = dc_q_exec(dc);
+	if (r == DC_OK) {
+		*val = word >> lane_shift(addr);
+	}
+	return r;
+}
+
+int dc_mem_rd16(DC* dc, uint32_t addr, uint16_t* val) {
+	uint32_t word;
+	dc_q_init(dc);
+	dc_q_mem_rd_sz(dc, addr, MAP_CSW_SZ_16, &word);
+	int r = dc_q_exec(dc);
+	if (r == DC_OK) {
+		*val = word >> lane_shift(addr);
+	}
+	return r;
+}
+
+int dc_mem_wr8(DC* dc, uint32_t addr, uint8_t val) {
+	dc_q_init(dc);
+	dc_q_mem_wr8(dc, addr, val);
+	return dc_q_exec(dc);
+}
+
+int dc_mem_wr16(DC* dc, uint32_t addr, uint16_t val) {
+	dc_q_init(dc);
+	dc_q_mem_wr16(dc, addr, val);
+	return dc_q_exec(dc);
+}
+
+// The unaligned head or tail of a transfer (at most 3 bytes, within
+// one word) is done with the largest naturally aligned accesses that
+// fit.  Without 8/16 bit support, reads fall back to the whole word.
+#define EDGE_MAX 3
+
+typedef struct {
+	uint32_t addr;
+	uint32_t sz;
+	uint32_t word;
+} dc_edge;
+
+static unsigned dc_mem_edge_plan(DC* dc, uint32_t addr, uint32_t len, dc_edge* e) {
+	unsigned n = 0;
+	if (len == 0) {
+		return 0;
+	}
+	if (!(dc->map_sizes & (1U << MAP_CSW_SZ_8))) {
+		e[0].addr = addr & ~3;
+		e[0].sz = MAP_CSW_SZ_32;
+		return 1;
+	}
+	while (len > 0) {
+		if (((addr & 1) == 0) && (len >= 2) &&
+			(dc->map_sizes & (1U << MAP_CSW_SZ_16))) {
+			e[n].sz = MAP_CSW_SZ_16;
+		} else {
+			e[n].sz = MAP_CSW_SZ_8;
+		}
+		e[n].addr = addr;
+		addr += 1U << e[n].sz;
+		len -= 1U << e[n].sz;
+		n++;
+	}
+	return n;
+}
+
+// copy the bytes of [addr, addr + len) out of the edge accesses
+static void dc_mem_edge_unpack(dc_edge* e, unsigned n, uint32_t addr, uint32_t len, uint8_t* out) {
+	for (unsigned i = 0; i < n; i++) {
+		for (uint32_t j = 0; j < (1U << e[i].sz); j++) {
+			uint32_t a = e[i].addr + j;
+			if ((a >= addr) && (a < (addr + len))) {
+				out[a - addr] = e[i].word >> lane_shift(a);
+			}
+		}
+	}
+}
+
+// aligned bulk transfers go directly to/from the caller's buffer
+// if it is word aligned, otherwise through a bounce buffer
+int dc_mem_read(DC* dc, uint32_t addr, uint32_t len, void* buf) {
+	if (dc_cache_covers(dc, addr, len)) {
+		return dc_cache_read(dc, addr, len, buf);
+	}
+	uint8_t* out = buf;
+	dc_edge head[EDGE_MAX], tail[EDGE_MAX];
+	uint32_t hlen = (4 - (addr & 3)) & 3;
+	if (hlen > len) {
+		hlen = len;
+	}
+	uint32_t blen = (len - hlen) & ~3U;
+	uint32_t tlen = len - hlen - blen;
+	uint32_t* body = (void*) (out + hlen);
+	if ((blen > 0) && ((uintptr_t) body & 3)) {
+		if ((body = malloc(blen)) == NULL) {
+			return DC_ERR_FAILED;
+		}
+	}
+	unsigned hn = dc_mem_edge_plan(dc, addr, hlen, head);
+	unsigned tn = dc_mem_edge_plan(dc, addr + hlen + blen, tlen, tail);
+
+	dc_q_init(dc);
+	for (unsigned i = 0; i < hn; i++) {
+		dc_q_mem_rd_sz(dc, head[i].addr, head[i].sz, &head[i].word);
+	}
+	dc_q_mem_rd_words(dc, addr + hlen, blen / 4, body);
+	for (unsigned i = 0; i < tn; i++) {
+		dc_q_mem_rd_sz(dc, tail[i].addr, tail[i].sz, &tail[i].word);
+	}
+	int r = dc_q_exec(dc);
+
+	if (r == DC_OK) {
+		dc_mem_edge_unpack(head, hn, addr, hlen, out);
+		dc_mem_edge_unpack(tail, tn, addr + hlen + blen, tlen, out + hlen + blen);
+		if ((void*) body != (void*) (out + hlen)) {
+			memcpy(out + hlen, body, blen);
+		}
+	}
+	if ((void*) body != (void*) (out + hlen)) {
+		free(body);
+	}
+	return r;
+}
+
+int dc_mem_write(DC* dc, uint32_t addr, uint32_t len, const void* buf) {
+	const uint8_t* in = buf;
+	dc_edge head[EDGE_MAX], tail[EDGE_MAX];
+	uint32_t hlen = (4 - (addr & 3)) & 3;
+	if (hlen > len) {
+		hlen = len;
+	}
+	uint32_t blen = (len - hlen) & ~3U;
+	uint32_t tlen = len - hlen - blen;
+	if ((hlen || tlen) && !(dc->map_sizes & (1U << MAP_CSW_SZ_8))) {
+		// a read-modify-write of the word is not safe in general
+		return DC_ERR_UNSUPPORTED;
+	}
+	const uint32_t* body = (const void*) (in + hlen);
+	uint32_t* bounce = NULL;
+	if ((blen > 0) && ((uintptr_t) body & 3)) {
+		if ((bounce = malloc(blen)) == NULL) {
+			return DC_ERR_FAILED;
+		}
+		memcpy(bounce, in + hlen, blen);
+		body = bounce;
+	}
+	unsigned hn = dc_mem_edge_plan(dc, addr, hlen, head);
+	unsigned tn = dc_mem_edge_plan(dc, addr + hlen + blen, tlen, tail);
+
+	dc_q_init(dc);
+	for (unsigned i = 0; i < hn; i++) {
+		uint32_t val = 0;
+		memcpy(&val, in + (head[i].addr - addr), 1U << head[i].sz);
+		dc_q_mem_wr_sz(dc, head[i].addr, head[i].sz, val);
+	}
+	dc_q_mem_wr_words(dc, addr + hlen, blen / 4, body);
+	for (unsigned i = 0; i < tn; i++) {
+		uint32_t val = 0;
+		memcpy(&val, in + (tail[i].addr - addr), 1U << tail[i].sz);
+		dc_q_mem_wr_sz(dc, tail[i].addr, tail[i].sz, val);
+	}
+	free(bounce);
+	return dc_q_exec(dc);
+}
+
+// one byte per DRW access, with TAR incrementing between them
+static void dc_q_mem_rd_byte(DC* dc, uint32_t addr, uint32_t* word) {
+	dc_q_map_csw_wr(dc, MAP_CSW_SZ_8 | MAP_CSW_INC_SINGLE | MAP_CSW_DEVICE_EN);
+	dc_q_map_tar_wr(dc, addr);
+	dc_q_map_rd(dc, MAP_DRW, word);
+	dc_q_map_tar_track(dc, addr + 1);
+}
+
+static void dc_q_mem_wr_byte(DC* dc, uint32_t addr, uint8_t val) {
+	dc_q_map_csw_wr(dc, MAP_CSW_SZ_8 | MAP_CSW_INC_SINGLE | MAP_CSW_DEVICE_EN);
+	dc_q_map_tar_wr(dc, addr);
+	dc_q_map_wr(dc, MAP_DRW, ((uint32_t) val) << lane_shift(addr));
+	dc_q_map_tar_track(dc, addr + 1);
+}
+
+// Byte accesses only, for regions that cannot take wider accesses.
+// With packed transfer support, the aligned middle moves four bytes
+// per DRW access.  Otherwise, it's one DRW access per byte.
+static int dc_mem_bytes(DC* dc, uint32_t addr, uint32_t len, uint8_t* ptr, int wr) {
+	if (!(dc->map_sizes & (1U << MAP_CSW_SZ_8))) {
+		return DC_ERR_UNSUPPORTED;
+	}
+	if (len == 0) {
+		return DC_OK;
+	}
+	uint32_t hlen = 0;
+	uint32_t blen = 0;
+	if (dc->map_packed) {
+		hlen = (4 - (addr & 3)) & 3;
+		if (hlen > len) {
+			hlen = len;
+		}
+		blen = (len - hlen) & ~3U;
+	} else {
+		hlen = len;
+	}
+	uint32_t tlen = len - hlen - blen;
+	uint32_t* scratch = malloc((hlen + tlen) * 4 + blen);
+	if (scratch == NULL) {
+		return DC_ERR_FAILED;
+	}
+	uint32_t* body = scratch + hlen + tlen;
+	uint32_t csw = MAP_CSW_SZ_8 | MAP_CSW_INC_PACKED | MAP_CSW_DEVICE_EN;
+
+	dc_q_init(dc);
+	for (uint32_t i = 0; i < hlen; i++) {
+		if (wr) {
+			dc_q_mem_wr_byte(dc, addr + i, ptr[i]);
+		} else {
+			dc_q_mem_rd_byte(dc, addr + i, scratch + i);
+		}
+	}
+	if (blen) {
+		// packed bytes are in address order in the DRW word,
+		// which is host (little endian) order
+		if (wr) {
+			memcpy(body, ptr + hlen, blen);
+			dc_q_mem_wr_run(dc, csw, addr + hlen, blen / 4, body);
+		} else {
+			dc_q_mem_rd_run(dc, csw, addr + hlen, blen / 4, body);
+		}
+	}
+	for (uint32_t i = hlen + blen; i < len; i++) {
+		if (wr) {
+			dc_q_mem_wr_byte(dc, addr + i, ptr[i]);
+		} else {
+			dc_q_mem_rd_byte(dc, addr + i, scratch + hlen + (i - hlen - blen));
+		}
+	}
+	int r = dc_q_exec(dc);
+
+	if ((r == DC_OK) && !wr) {
+		for (uint32_t i = 0; i < hlen; i++) {
+			ptr[i] = scratch[i] >> lane_shift(addr + i);
+		}
+		memcpy(ptr + hlen, body, blen);
+		for (uint32_t i = hlen + blen; i < len; i++) {
+			ptr[i] = scratch[hlen + (i - hlen - blen)] >> lane_shift(addr + i);
+		}
+	}
+	free(scratch);
+	return r;
+}
+
+int dc_mem_rd_bytes(DC* dc, uint32_t addr, uint32_t len, uint8_t* ptr) {
+	return dc_mem_bytes(dc, addr, len, ptr, 0);
+}
+
+int dc_mem_wr_bytes(DC* dc, uint32_t addr, uint32_t len, const uint8_t* ptr) {
+	return dc_mem_bytes(dc, addr, len, (void*) ptr, 1);
+}
+
+static long long now_us(void) {
+	struct timeval tv;
+	gettimeofday(&tv, 0);
+	return ((long long) tv.tv_usec) + ((long long) tv.tv_sec) * 1000000LL;
+}
+
+// The probe does the polling: a value match read of DHCSR is
+// retried up to match_retry times before the probe gives up and
+// reports a mismatch.  Each window of retries is twice as long as
+// the last, up to about WAIT_WINDOW_MAX_US, so a change shortly
+// after the request (a step, a halt) is seen on the first round
+// trip, while a running target costs one round trip per window
+// and the host sleeps in the USB read.  A change lands either
+// within a window (seen on the next retry) or in the gap between
+// windows (seen on the first retry of the next).  The first window
+// keeps the probe's current retry count (if in range), so a wait
+// that ends on the first poll costs no reconfiguration of it.
+
+#define WAIT_RETRY_MIN     8
+#define WAIT_WINDOW_MAX_US 20000
+#define WAIT_RETRY_CLOCKS  64    // ~SWD clocks per retried AP read
+
+#define HALT_TIMEOUT_US    100000
+
+static void dc_q_core_reg_rd(DC* dc, unsigned id, uint32_t* val);
+
+// wait until (DHCSR & mask) == val, or the timeout (if nonzero)
+// expires, or the attention value changes, and then read count
+// core registers (so the match must be a halt) in a second queue,
+// as DCRSR must not be written while the core may still be running
+static int dc_core_wait_regs(DC* dc, uint32_t mask, uint32_t val, uint32_t timeout_us,
+	const unsigned* ids, uint32_t* vals, unsigned count) {
+	uint32_t last = dc_get_attn_value(dc);
+	uint32_t hz = dc->swd_hz ? dc->swd_hz : 1000000;
+	uint32_t max = (uint32_t) (((uint64_t) hz) * WAIT_WINDOW_MAX_US / 1000000 / WAIT_RETRY_CLOCKS);
+	uint32_t retry = WAIT_RETRY_MIN;
+	uint32_t saved = dc->cfg_match;
+	uint32_t polls = 0;
+	uint32_t dhcsr = 0;
+	long long t0 = now_us();
+	long long t1 = t0, prev = t0;
+	int r;
+
+	if (max > 65535) {
+		max = 65535;
+	} else if (max < WAIT_RETRY_MIN) {
+		max = WAIT_RETRY_MIN;
+	}
+	if ((saved != INVALID) && (saved > retry) && (saved <= max)) {
+		retry = saved;
+	}
+	dc->quiet_match = 1;
+	for (;;) {
+		dc_set_match_retry(dc, retry);
+		dc_q_init(dc);
+		dc_q_set_mask(dc, mask);
+		dc_q_mem_match32(dc, DHCSR, val);
+		dc_q_mem_rd32(dc, DHCSR, &dhcsr);
+		r = dc_q_exec(dc);
+		t1 = now_us();
+		polls++;
+		if (r != DC_ERR_MATCH) {
+			break;
+		}
+		if (timeout_us && ((t1 - t0) >= timeout_us)) {
+			r = DC_ERR_TIMEOUT;
+			break;
+		}
+		if (last != dc_get_attn_value(dc)) {
+			r = DC_ERR_INTERRUPTED;
+			break;
+		}
+		prev = t1;
+		retry = (retry > (max / 2)) ? max : (retry * 2);
+	}
+	dc->quiet_match = 0;
+	if (saved != INVALID) {
+		dc_set_match_retry(dc, saved);
+	}
+	if ((r == DC_OK) && (count > 0)) {
+		dc_q_init(dc);
+		for (unsigned n = 0; n < count; n++) {
+			dc_q_core_reg_rd(dc, ids[n], vals + n);
+		}
+		r = dc_q_exec(dc);
+	}
+	if (r == DC_OK) {
+		dc_cache_observe(dc, dhcsr);
+		// the change happened after the previous poll's last read
+		DEBUG("core: DHCSR %08x after %lld us, %u polls, detect latency < %lld us\n",
+			dhcsr, t1 - t0, polls, t1 - prev);
+	}
+	return r;
+}
+
+static int dc_core_wait_dhcsr(DC* dc, uint32_t mask, uint32_t val, uint32_t timeout_us) {
+	return dc_core_wait_regs(dc, mask, val, timeout_us, NULL, NULL, 0);
+}
 
 int dc_core_check_halt(dctx_t* dc) {
 	uint32_t val;
@@ -170,17 +755,15 @@ int dc_core_halt(DC* dc) {
 	if ((r = dc_mem_wr32(dc, DHCSR, val)) < 0) {
 		return r;
 	}
-	for (unsigned n = 0; n < 64; n++) {
-		if (dc_core_check_halt(dc) == 1) {
-			return 0;
-		}
-	}
-	return DC_ERR_TIMEOUT;
+	return dc_core_wait_dhcsr(dc, DHCSR_S_HALT, DHCSR_S_HALT, HALT_TIMEOUT_US);
 }
 
 int dc_core_resume(DC* dc){
 	uint32_t val;
 	int r;
+	if ((r = dc_bp_sync(dc)) < 0) {
+		return r;
+	}
 	if ((r = dc_mem_rd32(dc, DHCSR, &val)) < 0) {
 		return r;
 	}
@@ -194,25 +777,25 @@ int dc_core_resume(DC* dc){
 	}
 	// clear C_HALT
 	val |= DHCSR_C_DEBUGEN | DHCSR_DBGKEY;
+	dc->core_epoch++;
 	if ((r = dc_mem_wr32(dc, DHCSR, val)) < 0) {
 		return r;
 	}
-	for (unsigned n = 0; n < 64; n++) {
-		if (dc_core_check_halt(dc) == 0) {
-			return 0;
-		}
-	}
-	return DC_ERR_TIMEOUT;
+	return dc_core_wait_dhcsr(dc, DHCSR_S_HALT, 0, HALT_TIMEOUT_US);
 }
 
 int dc_core_step(DC* dc) {
 	uint32_t val;
 	int r;
+	if ((r = dc_bp_sync(dc)) < 0) {
+		return r;
+	}
 	if ((r = dc_mem_rd32(dc, DHCSR, &val)) < 0) {
 		return r;
 	}
 	val &= (DHCSR_C_DEBUGEN | DHCSR_C_HALT | DHCSR_C_MASKINTS);
 	val |= DHCSR_DBGKEY;
+	dc->core_epoch++;
 
 	if (!(val & DHCSR_C_HALT)) {
 		val |= DHCSR_C_HALT | DHCSR_C_DEBUGEN;
@@ -228,22 +811,12 @@ int dc_core_step(DC* dc) {
 	return 0;
 }
 
+uint32_t dc_core_epoch(DC* dc) {
+	return dc->core_epoch;
+}
+
 int dc_core_wait_halt(DC* dc) {
-	uint32_t last = dc_get_attn_value(dc);
-	uint32_t val;
-	int r;
-	for (;;) {
-		if ((r = dc_mem_rd32(dc, DHCSR, &val)) < 0) {
-			return r;
-		}
-		if (val & DHCSR_S_HALT) {
-			return 0;
-		}
-		if (last != dc_get_attn_value(dc)) {
-			return DC_ERR_INTERRUPTED;
-		}
-	}
-	return 0;
+	return dc_core_wait_dhcsr(dc, DHCSR_S_HALT, DHCSR_S_HALT, 0);
 }
 
 static void dc_q_core_reg_rd(DC* dc, unsigned id, uint32_t* val) {
@@ -267,7 +840,7 @@ int dc_core_reg_rd(DC* dc, unsigned id, uint32_t* val) {
 int dc_core_reg_wr(DC* dc, unsigned id, uint32_t val) {
 	dc_q_init(dc);
 	dc_q_core_reg_wr(dc, id, val);
-	return dc_q_exec(dc);
+	return dc_q_exec_wr(dc);
 }
 int dc_core_reg_rd_list(DC* dc, uint32_t* id, uint32_t* val, unsigned count) {
 	dc_q_init(dc);
@@ -277,3 +850,59 @@ int dc_core_reg_rd_list(DC* dc, uint32_t* id, uint32_t* val, unsigned count) {
 	}
 	return dc_q_exec(dc);
 }
+
+// One queue sets up the registers and resumes the core, one (per
+// polling window) sees it halt, and one reads back r0 and pc.
+int dc_target_call_start(DC* dc, uint32_t entry, const uint32_t args[4],
+	uint32_t sp, uint32_t ret) {
+	int r;
+	if ((r = dc_bp_sync(dc)) < 0) {
+		return r;
+	}
+	// none of the writes below may reach a running core: on a
+	// mismatch the probe skips the rest of the match's packet, and
+	// dc_q_issue() sends no later packet until the match is answered
+	dc_q_init(dc);
+	dc_q_set_mask(dc, DHCSR_S_HALT);
+	dc_q_mem_match32(dc, DHCSR, DHCSR_S_HALT);
+	for (unsigned n = 0; n < 4; n++) {
+		dc_q_core_reg_wr(dc, n, args[n]);
+	}
+	dc_q_core_reg_wr(dc, 13, sp);
+	dc_q_core_reg_wr(dc, 14, ret | 1); // include T bit
+	dc_q_core_reg_wr(dc, 15, entry | 1); // include T bit
+
+	// if the target has bogus data at 0, the processor may be in
+	// pending-exception state after reset-stop, so we will clear
+	// any exceptions and then set the PSR to something reasonable
+	dc_q_mem_wr32(dc, AIRCR, AIRCR_VECTKEY | AIRCR_VECTCLRACTIVE);
+	dc_q_core_reg_wr(dc, 16, 0x01000000);
+
+	// clear C_HALT (and C_MASKINTS, which we never set)
+	dc_q_mem_wr32(dc, DHCSR, DHCSR_DBGKEY | DHCSR_C_DEBUGEN);
+	return dc_q_exec(dc);
+}
+
+int dc_target_call_wait(DC* dc, uint32_t ret, uint32_t* result) {
+	static const unsigned ids[2] = { 0, 15 };
+	uint32_t vals[2];
+	int r;
+	if ((r = dc_core_wait_regs(dc, DHCSR_S_HALT, DHCSR_S_HALT, 0, ids, vals, 2)) < 0) {
+		return r;
+	}
+	if ((vals[1] & ~1U) != (ret & ~1U)) {
+		ERROR("core: call halted at %08x, not %08x\n", vals[1], ret);
+		return DC_ERR_BAD_STATE;
+	}
+	*result = vals[0];
+	return DC_OK;
+}
+
+int dc_target_call(DC* dc, uint32_t entry, const uint32_t args[4],
+	uint32_t sp, uint32_t ret, uint32_t* result) {
+	int r;
+	if ((r = dc_target_call_start(dc, entry, args, sp, ret)) < 0) {
+		return r;
+	}
+	return dc_target_call_wait(dc, ret, result);
+}
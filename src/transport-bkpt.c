@@ -0,0 +1,413 @@
+// Copyright 2023, Brian Swetland <swetland@frotz.net>
+// Licensed under the Apache License, Version 2.0.
+
+#include <string.h>
+
+#include "transport.h"
+#include "transport-private.h"
+
+#include "arm-debug.h"
+#include "arm-v7-debug.h"
+
+// Breakpoints (FPB code comparators) and watchpoints (DWT data
+// comparators) are set and cleared in a shadow of the comparator
+// registers.  Nothing touches the target until dc_bp_sync() (from
+// resume and step), which writes only the registers whose wanted
+// value differs from what was last written, as one batch.
+//
+// The shadow of what the hardware holds is forgotten on attach
+// (and after a failed sync), so the next sync rewrites everything
+// that is wanted, and clears everything that is not.
+//
+// The DWT encoding here is the ARMv6-M / ARMv7-M one.
+
+// DWT_MASK values (address bits ignored) we're willing to use
+#define WP_MASK_MAX 15
+
+static int bp_ready(DC* dc) {
+	if (!dc->bp_probed) {
+		int r;
+		if ((r = dc_bp_probe(dc)) < 0) {
+			return r;
+		}
+	}
+	return DC_OK;
+}
+
+int dc_bp_probe(DC* dc) {
+	uint32_t fpctrl, dwtctrl;
+	int r;
+
+	dc_q_init(dc);
+	dc_q_mem_rd32(dc, FP_CTRL, &fpctrl);
+	dc_q_mem_rd32(dc, DWT_CTRL, &dwtctrl);
+	if ((r = dc_q_exec(dc)) < 0) {
+		dc->bp_probed = 0;
+		return r;
+	}
+
+	dc->bp_rev = fpctrl & FP_CTRL_REV_MASK;
+	dc->bp_count = ((fpctrl & FP_CTRL_CODE_H_MASK) >> FP_CTRL_CODE_H_SHIFT) |
+		((fpctrl & FP_CTRL_CODE_L_MASK) >> FP_CTRL_CODE_L_SHIFT);
+	if (dc->bp_count > DC_BP_MAX) {
+		dc->bp_count = DC_BP_MAX;
+	}
+	dc->wp_count = (dwtctrl & DWT_CTRL_NUMCOMP_MASK) >> DWT_CTRL_NUMCOMP_SHIFT;
+	if (dc->wp_count > DC_WP_MAX) {
+		dc->wp_count = DC_WP_MAX;
+	}
+
+	// breakpoints set before attach (or before a reattach) are kept
+	for (unsigned n = 0; n < DC_BP_MAX; n++) {
+		if (n >= dc->bp_count) {
+			dc->bp_want[n] = 0;
+		}
+		dc->bp_hw[n] = INVALID;
+	}
+	for (unsigned n = 0; n < DC_WP_MAX; n++) {
+		if (n >= dc->wp_count) {
+			dc->wp_want[n].func = DWT_FUNCTION_DISABLED;
+		}
+		dc->wp_hw[n].func = INVALID;
+	}
+	dc->bp_ctrl_hw = 0;
+	dc->wp_trcena = 0;
+	dc->bp_dirty = 1;
+	dc->bp_probed = 1;
+	return DC_OK;
+}
+
+void dc_bp_info(DC* dc, uint32_t* bps, uint32_t* wps) {
+	*bps = dc->bp_probed ? dc->bp_count : 0;
+	*wps = dc->bp_probed ? dc->wp_count : 0;
+}
+
+// FPBv1 comparators match a word in the code region and select
+// which halfword(s) of it to break on, FPBv2 ones any halfword
+static int bp_encode(DC* dc, uint32_t addr, uint32_t* comp, uint32_t* bits) {
+	if (addr & 1) {
+		return DC_ERR_BAD_PARAMS;
+	}
+	if (dc->bp_rev == FP_CTRL_REV_V1) {
+		if (addr >= 0x20000000) {
+			return DC_ERR_UNSUPPORTED;
+		}
+		*comp = (addr & 0x1FFFFFFC) | FP1_COMP_EN;
+		*bits = (addr & 2) ? FP1_COMP_BK_10 : FP1_COMP_BK_00;
+	} else {
+		*comp = (addr & FP2_COMP_BP_MASK) | FP2_COMP_BP_EN;
+		*bits = 0;
+	}
+	return DC_OK;
+}
+
+// the comparator a wanted value programs, minus the FPBv1 halfword
+// selects (on FPBv2 those bits are part of the address)
+static uint32_t bp_comp(DC* dc, uint32_t want) {
+	if (dc->bp_rev == FP_CTRL_REV_V1) {
+		return want & ~FP1_COMP_BK_x0;
+	}
+	return want;
+}
+
+int dc_bp_set(DC* dc, uint32_t addr) {
+	uint32_t comp, bits;
+	int r;
+
+	if ((r = bp_ready(dc)) < 0) {
+		return r;
+	}
+	if ((r = bp_encode(dc, addr, &comp, &bits)) < 0) {
+		return r;
+	}
+	unsigned avail = dc->bp_count;
+	for (unsigned n = 0; n < dc->bp_count; n++) {
+		uint32_t want = dc->bp_want[n];
+		if (want == 0) {
+			if (avail == dc->bp_count) {
+				avail = n;
+			}
+		} else if (bp_comp(dc, want) == comp) {
+			// already set, or (v1) its neighbouring halfword is
+			if ((want & bits) != bits) {
+				dc->bp_want[n] = want | bits;
+				dc->bp_dirty = 1;
+			}
+			return DC_OK;
+		}
+	}
+	if (avail == dc->bp_count) {
+		return DC_ERR_FAILED;
+	}
+	dc->bp_want[avail] = comp | bits;
+	dc->bp_dirty = 1;
+	return DC_OK;
+}
+
+int dc_bp_clr(DC* dc, uint32_t addr) {
+	uint32_t comp, bits;
+	int r;
+
+	if ((r = bp_ready(dc)) < 0) {
+		return r;
+	}
+	if ((r = bp_encode(dc, addr, &comp, &bits)) < 0) {
+		return r;
+	}
+	for (unsigned n = 0; n < dc->bp_count; n++) {
+		uint32_t want = dc->bp_want[n];
+		if ((want == 0) || (bp_comp(dc, want) != comp) ||
+			((want & bits) != bits)) {
+			continue;
+		}
+		if ((want & ~bits) != comp) {
+			// the other halfword stays
+			dc->bp_want[n] = want & ~bits;
+		} else {
+			dc->bp_want[n] = 0;
+		}
+		dc->bp_dirty = 1;
+		return DC_OK;
+	}
+	return DC_ERR_BAD_PARAMS;
+}
+
+// the nth breakpoint set (an FPBv1 comparator may hold two)
+int dc_bp_get(DC* dc, unsigned n, uint32_t* addr) {
+	if (!dc->bp_probed) {
+		return DC_ERR_BAD_PARAMS;
+	}
+	for (unsigned i = 0; i < dc->bp_count; i++) {
+		uint32_t want = dc->bp_want[i];
+		if (want == 0) {
+			continue;
+		}
+		if (dc->bp_rev != FP_CTRL_REV_V1) {
+			if (n-- == 0) {
+				*addr = want & FP2_COMP_BP_MASK;
+				return DC_OK;
+			}
+			continue;
+		}
+		if ((want & FP1_COMP_BK_00) && (n-- == 0)) {
+			*addr = want & 0x1FFFFFFC;
+			return DC_OK;
+		}
+		if ((want & FP1_COMP_BK_10) && (n-- == 0)) {
+			*addr = (want & 0x1FFFFFFC) + 2;
+			return DC_OK;
+		}
+	}
+	return DC_ERR_BAD_PARAMS;
+}
+
+// a comparator matches an aligned power of two sized range, so
+// watch the smallest one that covers [addr, addr + len)
+static int wp_encode(uint32_t addr, uint32_t len, uint32_t kind, dc_watch* w) {
+	if ((len == 0) || (kind < DC_WP_READ) || (kind > DC_WP_ACCESS)) {
+		return DC_ERR_BAD_PARAMS;
+	}
+	uint32_t last = addr + len - 1;
+	if (last < addr) {
+		return DC_ERR_BAD_PARAMS;
+	}
+	uint32_t mask = 0;
+	while ((addr >> mask) != (last >> mask)) {
+		if (++mask > WP_MASK_MAX) {
+			return DC_ERR_UNSUPPORTED;
+		}
+	}
+	w->addr = addr;
+	w->len = len;
+	w->comp = addr & ~((1U << mask) - 1);
+	w->mask = mask;
+	w->func = DWT_FUNCTION_WP_RD + (kind - DC_WP_READ);
+	return DC_OK;
+}
+
+static int wp_same(const dc_watch* a, const dc_watch* b) {
+	return (a->comp == b->comp) && (a->mask == b->mask) && (a->func == b->func);
+}
+
+int dc_wp_set(DC* dc, uint32_t addr, uint32_t len, uint32_t kind) {
+	dc_watch w;
+	int r;
+
+	if ((r = bp_ready(dc)) < 0) {
+		return r;
+	}
+	if ((r = wp_encode(addr, len, kind, &w)) < 0) {
+		return r;
+	}
+	unsigned avail = dc->wp_count;
+	for (unsigned n = 0; n < dc->wp_count; n++) {
+		if (dc->wp_want[n].func == DWT_FUNCTION_DISABLED) {
+			if (avail == dc->wp_count) {
+				avail = n;
+			}
+		} else if (wp_same(dc->wp_want + n, &w)) {
+			return DC_OK;
+		}
+	}
+	if (avail == dc->wp_count) {
+		return DC_ERR_FAILED;
+	}
+	dc->wp_want[avail] = w;
+	dc->bp_dirty = 1;
+	return DC_OK;
+}
+
+int dc_wp_clr(DC* dc, uint32_t addr, uint32_t len, uint32_t kind) {
+	dc_watch w;
+	int r;
+
+	if ((r = bp_ready(dc)) < 0) {
+		return r;
+	}
+	if ((r = wp_encode(addr, len, kind, &w)) < 0) {
+		return r;
+	}
+	for (unsigned n = 0; n < dc->wp_count; n++) {
+		if ((dc->wp_want[n].func != DWT_FUNCTION_DISABLED) &&
+			wp_same(dc->wp_want + n, &w)) {
+			dc->wp_want[n].func = DWT_FUNCTION_DISABLED;
+			dc->bp_dirty = 1;
+			return DC_OK;
+		}
+	}
+	return DC_ERR_BAD_PARAMS;
+}
+
+static uint32_t wp_kind(const dc_watch* w) {
+	return DC_WP_READ + (w->func - DWT_FUNCTION_WP_RD);
+}
+
+// the nth watchpoint set
+int dc_wp_get(DC* dc, unsigned n, uint32_t* addr, uint32_t* len, uint32_t* kind) {
+	if (!dc->bp_probed) {
+		return DC_ERR_BAD_PARAMS;
+	}
+	for (unsigned i = 0; i < dc->wp_count; i++) {
+		if ((dc->wp_want[i].func != DWT_FUNCTION_DISABLED) && (n-- == 0)) {
+			*addr = dc->wp_want[i].addr;
+			*len = dc->wp_want[i].len;
+			*kind = wp_kind(dc->wp_want + i);
+			return DC_OK;
+		}
+	}
+	return DC_ERR_BAD_PARAMS;
+}
+
+// MATCHED clears when read, so only the first check after a
+// halt sees it
+int dc_wp_matched(DC* dc, uint32_t* addr, uint32_t* kind) {
+	uint32_t func[DC_WP_MAX];
+	unsigned count = 0;
+	int r;
+
+	if (!dc->bp_probed) {
+		return 0;
+	}
+	dc_q_init(dc);
+	for (unsigned n = 0; n < dc->wp_count; n++) {
+		if (dc->wp_want[n].func != DWT_FUNCTION_DISABLED) {
+			dc_q_mem_rd32(dc, DWT_FUNCTION(n), func + n);
+			count++;
+		} else {
+			func[n] = 0;
+		}
+	}
+	if (count == 0) {
+		return 0;
+	}
+	if ((r = dc_q_exec(dc)) < 0) {
+		return r;
+	}
+	for (unsigned n = 0; n < dc->wp_count; n++) {
+		if ((func[n] & DWT_FUNCTION_MATCHED) &&
+			(dc->wp_want[n].func != DWT_FUNCTION_DISABLED)) {
+			*addr = dc->wp_want[n].addr;
+			*kind = wp_kind(dc->wp_want + n);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+int dc_bp_sync(DC* dc) {
+	unsigned bps = 0, wps = 0;
+	uint32_t demcr = 0;
+	int r;
+
+	if (!dc->bp_dirty) {
+		return DC_OK;
+	}
+	if ((r = bp_ready(dc)) < 0) {
+		return r;
+	}
+	for (unsigned n = 0; n < dc->bp_count; n++) {
+		bps += (dc->bp_want[n] != 0);
+	}
+	for (unsigned n = 0; n < dc->wp_count; n++) {
+		wps += (dc->wp_want[n].func != DWT_FUNCTION_DISABLED);
+	}
+
+	// the DWT only responds once trace is enabled
+	if (wps && !dc->wp_trcena) {
+		if ((r = dc_mem_rd32(dc, DEMCR, &demcr)) < 0) {
+			return r;
+		}
+	}
+
+	dc_q_init(dc);
+	if (wps && !dc->wp_trcena) {
+		dc_q_mem_wr32(dc, DEMCR, demcr | DEMCR_TRCENA);
+	}
+	if (bps && !dc->bp_ctrl_hw) {
+		dc_q_mem_wr32(dc, FP_CTRL, FP_CTRL_KEY | FP_CTRL_ENABLE);
+	}
+	for (unsigned n = 0; n < dc->bp_count; n++) {
+		if (dc->bp_want[n] != dc->bp_hw[n]) {
+			dc_q_mem_wr32(dc, FP_COMP(n), dc->bp_want[n]);
+		}
+	}
+	for (unsigned n = 0; n < dc->wp_count; n++) {
+		dc_watch* want = dc->wp_want + n;
+		dc_watch* hw = dc->wp_hw + n;
+		if (want->func == DWT_FUNCTION_DISABLED) {
+			if (hw->func != DWT_FUNCTION_DISABLED) {
+				dc_q_mem_wr32(dc, DWT_FUNCTION(n), DWT_FUNCTION_DISABLED);
+			}
+		} else if (!wp_same(want, hw)) {
+			// disable it while the address and mask change
+			dc_q_mem_wr32(dc, DWT_FUNCTION(n), DWT_FUNCTION_DISABLED);
+			dc_q_mem_wr32(dc, DWT_COMP(n), want->comp);
+			dc_q_mem_wr32(dc, DWT_MASK(n), want->mask);
+			dc_q_mem_wr32(dc, DWT_FUNCTION(n), want->func);
+		}
+	}
+	if ((r = dc_q_exec_wr(dc)) < 0) {
+		// we no longer know what the hardware holds
+		for (unsigned n = 0; n < DC_BP_MAX; n++) {
+			dc->bp_hw[n] = INVALID;
+		}
+		for (unsigned n = 0; n < DC_WP_MAX; n++) {
+			dc->wp_hw[n].func = INVALID;
+		}
+		dc->bp_ctrl_hw = 0;
+		dc->wp_trcena = 0;
+		return r;
+	}
+	memcpy(dc->bp_hw, dc->bp_want, sizeof(dc->bp_hw));
+	for (unsigned n = 0; n < dc->wp_count; n++) {
+		if (dc->wp_want[n].func == DWT_FUNCTION_DISABLED) {
+			dc->wp_hw[n].func = DWT_FUNCTION_DISABLED;
+		} else {
+			dc->wp_hw[n] = dc->wp_want[n];
+		}
+	}
+	dc->bp_ctrl_hw |= (bps != 0);
+	dc->wp_trcena |= (wps != 0);
+	dc->bp_dirty = 0;
+	return DC_OK;
+}
@@ -0,0 +1,180 @@
+// Copyright 2023, Brian Swetland <swetland@frotz.net>
+// Licensed under the Apache License, Version 2.0.
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "transport.h"
+#include "transport-private.h"
+
+#include "arm-debug.h"
+#include "arm-v7-debug.h"
+
+// While the core is halted, memory only changes if we write it
+// (or DMA or another bus master does, which is why only regions
+// explicitly marked cacheable are ever cached).
+//
+// The cache is armed by a read of DHCSR showing S_HALT (and no
+// reset since the last read), and disarmed and discarded by any
+// AP write other than the DCRSR/DCRDR core register traffic, by
+// any read of DHCSR showing the core running or reset, and by
+// attach, abort, and transfer errors.
+
+void dc_cache_invalidate(DC* dc) {
+	dc->cache_epoch++;
+	dc->cache_armed = 0;
+}
+
+void dc_cache_observe(DC* dc, uint32_t dhcsr) {
+	if ((dhcsr & DHCSR_S_HALT) && !(dhcsr & DHCSR_S_RESET_ST)) {
+		dc->cache_armed = 1;
+	} else {
+		dc->core_epoch++;
+		if (dc->cache_armed) {
+			dc_cache_invalidate(dc);
+		}
+	}
+}
+
+// called before an AP write is queued, while TAR is still
+// the address the write will land at
+void dc_cache_ap_wr(DC* dc, unsigned apaddr) {
+	if (!dc->cache_armed) {
+		return;
+	}
+	if ((apaddr & ~0xFU) == dc->map_reg_base) {
+		switch (apaddr & 0xF) {
+		case MAP_CSW:
+		case MAP_TAR:
+			return;
+		case MAP_DRW:
+			if ((dc->map_tar_cache == DCRSR) || (dc->map_tar_cache == DCRDR)) {
+				return;
+			}
+			break;
+		}
+	}
+	dc_cache_invalidate(dc);
+}
+
+// 1 if [addr, addr + len) may be served from the cache
+int dc_cache_covers(DC* dc, uint32_t addr, uint32_t len) {
+	if (!dc->cache_armed || (len == 0)) {
+		return 0;
+	}
+	// larger reads could collide with themselves in the cache
+	if (len > (DC_CACHE_PAGES * DC_CACHE_PAGE_SIZE / 2)) {
+		return 0;
+	}
+	uint32_t end = addr + len;
+	if (end < addr) {
+		return 0;
+	}
+	for (unsigned n = 0; n < dc->cache_regions; n++) {
+		if ((addr >= dc->cache_base[n]) && (end <= dc->cache_end[n])) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+int dc_cache_read(DC* dc, uint32_t addr, uint32_t len, void* buf) {
+	uint32_t first = addr & ~(DC_CACHE_PAGE_SIZE - 1);
+	uint32_t last = (addr + len - 1) & ~(DC_CACHE_PAGE_SIZE - 1);
+	uint32_t epoch = dc->cache_epoch;
+	uint32_t misses = 0;
+
+	// fetch every missing page in a single batch
+	for (uint32_t pa = first; ; pa += DC_CACHE_PAGE_SIZE) {
+		dc_cache_page* p = dc->cache + (pa / DC_CACHE_PAGE_SIZE) % DC_CACHE_PAGES;
+		if ((p->addr != pa) || (p->epoch != epoch)) {
+			if (misses == 0) {
+				dc_q_init(dc);
+			}
+			p->addr = pa;
+			p->epoch = epoch - 1;
+			dc_q_mem_rd_words(dc, pa, DC_CACHE_PAGE_SIZE / 4, p->data);
+			misses++;
+		}
+		if (pa == last) {
+			break;
+		}
+	}
+	int r = misses ? dc_q_exec(dc) : DC_OK;
+	if (r < 0) {
+		return r;
+	}
+
+	uint8_t* out = buf;
+	for (uint32_t pa = first; ; pa += DC_CACHE_PAGE_SIZE) {
+		dc_cache_page* p = dc->cache + (pa / DC_CACHE_PAGE_SIZE) % DC_CACHE_PAGES;
+		// pages only become valid if nothing invalidated
+		// the cache (an auto-attach, say) while they were read
+		if (epoch == dc->cache_epoch) {
+			p->epoch = epoch;
+		}
+		uint32_t off = (pa < addr) ? (addr - pa) : 0;
+		uint32_t xfer = DC_CACHE_PAGE_SIZE - off;
+		if (xfer > len) {
+			xfer = len;
+		}
+		memcpy(out, ((uint8_t*) p->data) + off, xfer);
+		out += xfer;
+		len -= xfer;
+		if (pa == last) {
+			break;
+		}
+	}
+
+	dc->cache_misses += misses;
+	dc->cache_hits += ((last - first) / DC_CACHE_PAGE_SIZE) + 1 - misses;
+	return DC_OK;
+}
+
+int dc_cache_add(DC* dc, uint32_t addr, uint32_t len) {
+	// only whole pages within the region are cached, so that
+	// filling a page never touches memory outside of it
+	uint32_t base = (addr + DC_CACHE_PAGE_SIZE - 1) & ~(DC_CACHE_PAGE_SIZE - 1);
+	uint32_t end = (addr + len) & ~(DC_CACHE_PAGE_SIZE - 1);
+	if ((addr + len < addr) || (base < addr) || (end <= base)) {
+		return DC_ERR_BAD_PARAMS;
+	}
+	// DHCSR must always be read from the target
+	if (end > 0xE0000000) {
+		return DC_ERR_BAD_PARAMS;
+	}
+	if (dc->cache_regions == DC_CACHE_REGIONS) {
+		return DC_ERR_FAILED;
+	}
+	if (dc->cache == NULL) {
+		if ((dc->cache = malloc(DC_CACHE_PAGES * sizeof(dc_cache_page))) == NULL) {
+			return DC_ERR_FAILED;
+		}
+		for (unsigned n = 0; n < DC_CACHE_PAGES; n++) {
+			dc->cache[n].addr = INVALID;
+		}
+	}
+	dc->cache_base[dc->cache_regions] = base;
+	dc->cache_end[dc->cache_regions] = end;
+	dc->cache_regions++;
+	return DC_OK;
+}
+
+void dc_cache_clear(DC* dc) {
+	dc->cache_regions = 0;
+	dc_cache_invalidate(dc);
+}
+
+int dc_cache_region(DC* dc, unsigned n, uint32_t* addr, uint32_t* len) {
+	if (n >= dc->cache_regions) {
+		return DC_ERR_BAD_PARAMS;
+	}
+	*addr = dc->cache_base[n];
+	*len = dc->cache_end[n] - dc->cache_base[n];
+	return DC_OK;
+}
+
+void dc_cache_stats(DC* dc, uint32_t* hits, uint32_t* misses) {
+	*hits = dc->cache_hits;
+	*misses = dc->cache_misses;
+}
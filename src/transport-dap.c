@@ -8,6 +8,7 @@
 
 #include "usb.h"
 #include "arm-debug.h"
+#include "arm-v7-debug.h"
 #include "cmsis-dap-protocol.h"
 #include "transport.h"
 #include "transport-private.h"
@@ -25,6 +26,10 @@ uint32_t dc_get_attn_value(DC *dc) {
 	return dc->attn;
 }
 
+uint32_t dc_get_status(DC* dc) {
+	return dc->status;
+}
+
 void dc_set_status(DC* dc, uint32_t status) {
 	dc->status = status;
 	if (dc->status_callback) {
@@ -32,12 +37,18 @@ void dc_set_status(DC* dc, uint32_t status) {
 	}
 }
 
+static void swo_halt(DC* dc);
+
 static void usb_failure(DC* dc, int status) {
 	ERROR("usb_failure status %d usb %p\n", status, dc->usb);
+	// the trace stream thread must let go of the usb handle first
+	swo_halt(dc);
 	if (dc->usb != NULL) {
 		usb_close(dc->usb);
 		dc->usb = NULL;
 	}
+	// no responses will arrive for anything in flight
+	dc->inflight_count = 0;
 	dc_set_status(dc, DC_OFFLINE);
 }
 
@@ -66,10 +77,40 @@ static int dap_get_info(DC* dc, unsigned di, void *out, unsigned minlen, unsigne
 	return buf[1];
 }
 
+static int dc_q_drain(DC* dc);
+static int _dc_q_exec(DC* dc);
+static int dc_q_exec_recover(DC* dc);
+
+#if 0
+// fill response buffers so short or missing data stands out
+#define rxfill(buf, len) memset(buf, 0xEE, len)
+#else
+#define rxfill(buf, len) do {} while (0)
+#endif
+
 static int dap_cmd(DC* dc, const void* tx, unsigned txlen, void* rx, unsigned rxlen) {
 	uint8_t cmd = ((const uint8_t*) tx)[0];
-	dump("TX>", tx, txlen);
 	int r;
+	// deferred writes must not be reordered after the command
+	// a failure is latched for the next dc_q_exec() or dc_flush()
+	// since whoever queued the writes was already told they worked
+	if (dc->qdefer) {
+		dc->qdefer = 0;
+		if ((r = dc_q_exec_recover(dc)) != DC_OK) {
+			ERROR("dap_cmd(0x%02x): deferred writes failed (%d)\n", cmd, r);
+			if (dc->werror == DC_OK) {
+				dc->werror = r;
+			}
+		}
+	}
+	// responses to in-flight transfers arrive first, so collect
+	// them now, latching any failure into the queue status
+	if (dc->inflight_count > 0) {
+		if (((r = dc_q_drain(dc)) != DC_OK) && (dc->qerror == DC_OK)) {
+			dc->qerror = r;
+		}
+	}
+	dump("TX>", tx, txlen);
 	if ((r = usb_write(dc->usb, tx, txlen)) != txlen) {
 		ERROR("dap_cmd(0x%02x): usb write error\n", cmd);
 		if (r < 0) {
@@ -127,7 +168,11 @@ static int dap_swd_configure(DC* dc, unsigned cfg) {
 int dc_set_clock(DC* dc, uint32_t hz) {
 	uint8_t io[5] = { DAP_SWJ_Clock,
 		hz, hz >> 8, hz >> 16, hz >> 24 };
-	return dap_cmd_std(dc, "dap_swj_clock()", io, 5, 2);
+	int r = dap_cmd_std(dc, "dap_swj_clock()", io, 5, 2);
+	if (r == 0) {
+		dc->swd_hz = hz;
+	}
+	return r;
 }
 
 static int dap_xfer_config(DC* dc, unsigned idle, unsigned wait, unsigned match) {
@@ -153,29 +198,72 @@ static int dap_xfer_config(DC* dc, unsigned idle, unsigned wait, unsigned match)
 	return dap_cmd_std(dc, "dap_transfer_configure()", io, 6, 2); 
 }
 
-static void dc_q_clear(DC* dc) {
+// reset the packet under construction, which uses the slot
+// following the newest in-flight packet
+static void dc_q_reset(DC* dc) {
+	uint32_t slot = (dc->inflight_head + dc->inflight_count) % (DC_MAX_INFLIGHT + 1);
+	dc->txbuf = dc->inflight_tx + slot * dc->max_packet_size;
 	dc->txnext = dc->txbuf + 3;
-	dc->rxnext = dc->rxptr;
+	dc->rxfirst = dc->rxspan[slot];
+	dc->rxnext = dc->rxfirst;
 	dc->txavail = dc->max_packet_size - 3;
 	dc->rxavail = dc->max_packet_size - 3;
-	dc->qerror = 0;
 	dc->txbuf[0] = DAP_Transfer;
 	dc->txbuf[1] = 0; // Index 0 for SWD
 	dc->txbuf[2] = 0; // Count 0 initially
+	dc->qmatch = 0;
+}
+
+// size the per-slot usb buffers for the probe's max packet size
+static int dc_q_alloc(DC* dc) {
+	size_t sz = dc->max_packet_size * (DC_MAX_INFLIGHT + 1);
+	uint8_t* tx = malloc(sz);
+	uint8_t* rx = malloc(sz);
+	if ((tx == NULL) || (rx == NULL)) {
+		free(tx);
+		free(rx);
+		return DC_ERR_FAILED;
+	}
+	free(dc->inflight_tx);
+	free(dc->inflight_rx);
+	dc->inflight_tx = tx;
+	dc->inflight_rx = rx;
+	return DC_OK;
+}
 
-	// TODO: less conservative mode: don't always invalidate
+// forget everything we believe about DP/AP register state
+static void dc_q_invalidate(DC* dc) {
 	dc->dp_select_cache = INVALID;
 	dc->cfg_mask = INVALID;
 	dc->map_csw_cache = INVALID;
 	dc->map_tar_cache = INVALID;
 }
 
+static void dc_q_clear(DC* dc) {
+	dc_q_reset(dc);
+	dc->qerror = 0;
+	dc->qdefer = 0;
+
+	// with DCF_REG_CACHE the caches stay valid across queues
+	// and are only dropped on errors, attach, and abort
+	if (!(dc->flags & DCF_REG_CACHE)) {
+		dc_q_invalidate(dc);
+	}
+}
+
 static inline void _dc_q_init(DC* dc) {
 	// no side-effects version for use from dc_attach(), etc
 	dc_q_clear(dc);
 }
 
 void dc_q_init(DC* dc) {
+	// writes deferred by write-combining stay queued
+	// and go out ahead of whatever is queued next
+	if (dc->qdefer) {
+		dc->qdefer = 0;
+		return;
+	}
+
 	// TODO: handle error cleanup, re-attach, etc
 	dc_q_clear(dc);
 
@@ -186,7 +274,7 @@ void dc_q_init(DC* dc) {
 }
 
 // unpack the status bits into a useful status code
-static int dc_decode_status(unsigned n) {
+static int dc_decode_status(DC* dc, unsigned n) {
 	unsigned ack = n & RSP_ACK_MASK;
 	if (n & RSP_ProtocolError) {
 		ERROR("DAP SWD Parity Error\n");
@@ -209,61 +297,174 @@ static int dc_decode_status(unsigned n) {
 		return DC_ERR_SWD_BOGUS;
 	}
 	if (n & RSP_ValueMismatch) {
-		ERROR("DAP Value Mismatch\n");
+		if (!dc->quiet_match) {
+			ERROR("DAP Value Mismatch\n");
+		}
 		return DC_ERR_MATCH;
 	}
 	return DC_OK;
 }
 
-// this internal version is called from the "public" dc_q_exec
-// as well as when we need to flush outstanding txns before
-// continuing to queue up more
-static int _dc_q_exec(DC* dc) {
-	// if we're already in error, don't generate more usb traffic
-	if (dc->qerror) {
-		int r = dc->qerror;
-		dc_q_clear(dc);
-		return r;
-	}
-	// if we have no work to do, succeed
-	if (dc->txbuf[2] == 0) {
-		return 0;
-	}
-	int sz = dc->txnext - dc->txbuf;
-	dump("TX>", dc->txbuf, sz);
-	int n = usb_write(dc->usb, dc->txbuf, sz);
-	if (n != sz) {
+// read the response to the oldest in-flight packet and deliver
+// its data, unless discard is set (an earlier packet failed)
+static int dc_q_reap(DC* dc, int discard) {
+	dc_packet* p = dc->inflight + dc->inflight_head;
+	uint8_t* rxbuf = dc->inflight_rx + dc->inflight_head * dc->max_packet_size;
+	dc->inflight_head = (dc->inflight_head + 1) % (DC_MAX_INFLIGHT + 1);
+	dc->inflight_count--;
+
+	int n = usb_reap(dc->usb, USB_OUT);
+	if (n != p->txlen) {
 		ERROR("dc_q_exec() usb write error\n");
-		if (n < 0) {
-			usb_failure(dc, n);
-		}
+		usb_failure(dc, (n < 0) ? n : DC_ERR_IO);
 		return DC_ERR_IO;
 	}
-	sz = 3 + (dc->rxnext - dc->rxptr) * 4;
-	uint8_t rxbuf[1024];
-	memset(rxbuf, 0xEE, 1024); // DEBUG
-	n = usb_read(dc->usb, rxbuf, sz);
+	n = usb_reap(dc->usb, USB_IN);
 	if (n < 0) {
 		ERROR("dc_q_exec() usb read error\n");
 		usb_failure(dc, n);
 		return DC_ERR_IO;
 	}
-	dump("RX>", rxbuf, sz);
+	dump("RX>", rxbuf, n);
+	if (p->cmd == DAP_TransferBlock) {
+		if ((n < 4) || (rxbuf[0] != DAP_TransferBlock)) {
+			ERROR("dc_q_exec() bad block response\n");
+			return DC_ERR_PROTOCOL;
+		}
+		int r = dc_decode_status(dc, rxbuf[3]);
+		if (r != DC_OK) {
+			return r;
+		}
+		if (((rxbuf[1] | (rxbuf[2] << 8)) != p->count) || (n < p->rxlen)) {
+			ERROR("dc_q_exec() short block transfer\n");
+			return DC_ERR_PROTOCOL;
+		}
+		if ((p->rxdata != NULL) && !discard) {
+			memcpy(p->rxdata, rxbuf + 4, p->count * 4);
+		}
+		return DC_OK;
+	}
 	if ((n < 3) || (rxbuf[0] != DAP_Transfer)) {
 		ERROR("dc_q_exec() bad response\n");
 		return DC_ERR_PROTOCOL;
 	}
-	int r = dc_decode_status(rxbuf[2]);
-	if (r == DC_OK) {
+	int r = dc_decode_status(dc, rxbuf[2]);
+	if ((r == DC_OK) && !discard) {
 		// how many response words available?
 		n = (n - 3) / 4;
 		uint8_t* rxptr = rxbuf + 3;
-		for (unsigned i = 0; i < n; i++) {
-			memcpy(dc->rxptr[i], rxptr, 4);
-			rxptr += 4;
+		dc_span* sp = p->rxspan;
+		for (unsigned i = 0; (i < p->rxspans) && (n > 0); i++, sp++) {
+			unsigned count = (sp->count > n) ? n : sp->count;
+			memcpy(sp->dst, rxptr, count * 4);
+			rxptr += count * 4;
+			n -= count;
+		}
+	}
+	return r;
+}
+
+// read back all outstanding responses, in order
+// once one packet fails, the data from the rest is discarded,
+// but their responses must still be consumed
+static int dc_q_drain(DC* dc) {
+	int r = DC_OK;
+	while (dc->inflight_count > 0) {
+		if (dc->usb == NULL) {
+			// usb failure, nothing more will arrive
+			dc->inflight_count = 0;
+			return DC_ERR_IO;
+		}
+		int e = dc_q_reap(dc, r != DC_OK);
+		if (r == DC_OK) {
+			r = e;
+		}
+	}
+	return r;
+}
+
+// send the DAP_Transfer or DAP_TransferBlock packet in txbuf without
+// waiting for the response, first making room in the in-flight window
+static int dc_q_issue(DC* dc, unsigned txlen, dc_packet* pkt) {
+	int r = DC_OK;
+	// a mismatch only stops the rest of its own packet, so nothing
+	// goes out behind a match until it has been answered
+	if (dc->inflight_count > 0) {
+		uint32_t newest = (dc->inflight_head + dc->inflight_count - 1) % (DC_MAX_INFLIGHT + 1);
+		if (dc->inflight[newest].match && ((r = dc_q_drain(dc)) != DC_OK)) {
+			return r;
+		}
+	}
+	if (dc->inflight_count >= dc->max_packet_count) {
+		if ((r = dc_q_reap(dc, 0)) != DC_OK) {
+			// stop here and unwind the rest
+			dc_q_drain(dc);
+			return r;
 		}
 	}
+	dump("TX>", dc->txbuf, txlen);
+	// the command goes out and a read for its response is posted
+	// right away, so the probe can answer while we build the next
+	// (reaping above moves head and count, but not the txbuf slot)
+	uint32_t slot = (dc->inflight_head + dc->inflight_count) % (DC_MAX_INFLIGHT + 1);
+	uint8_t* rxbuf = dc->inflight_rx + slot * dc->max_packet_size;
+	rxfill(rxbuf, dc->max_packet_size);
+	if (((r = usb_submit(dc->usb, USB_OUT, dc->txbuf, txlen)) < 0) ||
+		((r = usb_submit(dc->usb, USB_IN, rxbuf, dc->max_packet_size)) < 0)) {
+		ERROR("dc_q_exec() usb submit error\n");
+		usb_failure(dc, r);
+		return DC_ERR_IO;
+	}
+	dc->inflight[slot] = *pkt;
+	dc->inflight[slot].txlen = txlen;
+	dc->inflight_count++;
+	return DC_OK;
+}
+
+// send the DAP_Transfer packet under construction (if any)
+// and start a new one, without waiting for the response
+static int dc_q_send(DC* dc) {
+	if (dc->txbuf[2] == 0) {
+		return DC_OK;
+	}
+	dc_packet pkt = {
+		.cmd = DAP_Transfer,
+		.count = dc->txbuf[2],
+		.rxlen = dc->max_packet_size - dc->rxavail,
+		.rxspan = dc->rxfirst,
+		.rxspans = dc->rxnext - dc->rxfirst,
+		.rxdata = NULL,
+		.match = dc->qmatch,
+	};
+	int r = dc_q_issue(dc, dc->txnext - dc->txbuf, &pkt);
+	dc_q_reset(dc);
+	return r;
+}
 
+// this internal version is called from the "public" dc_q_exec
+// as well as when we need to flush outstanding txns before
+// issuing other commands to the probe
+static int _dc_q_exec(DC* dc) {
+	// if we're already in error, don't generate more usb traffic
+	// beyond collecting responses to packets already sent
+	if (dc->qerror) {
+		int r = dc->qerror;
+		dc_q_drain(dc);
+		dc_q_invalidate(dc);
+		dc_cache_invalidate(dc);
+		dc_q_clear(dc);
+		return r;
+	}
+	int r = dc_q_send(dc);
+	if (r == DC_OK) {
+		r = dc_q_drain(dc);
+	}
+	if (r != DC_OK) {
+		// the caches were updated as txns were queued, and
+		// there's no telling which of those actually happened
+		dc_q_invalidate(dc);
+		dc_cache_invalidate(dc);
+	}
 	dc_q_clear(dc);
 	return r;
 }
@@ -271,29 +472,37 @@ static int _dc_q_exec(DC* dc) {
 // internal use only -- queue raw dp reads and writes
 // these do not check req for correctness
 static void dc_q_raw_rd(DC* dc, unsigned req, uint32_t* val) {
-	if ((dc->txavail < 1) || (dc->rxavail < 4)) {
-		// exec q to make space for more work,
+	if ((dc->txavail < 1) || (dc->rxavail < 4) ||
+		(dc->txbuf[2] == DC_MAX_XFER_COUNT)) {
+		// send the packet to make space for more work,
 		// but if there's an error, latch it
 		// so we don't send any further txns
-		if ((dc->qerror = _dc_q_exec(dc)) != DC_OK) {
+		if ((dc->qerror = dc_q_send(dc)) != DC_OK) {
 			return;
 		}
 	}
 	dc->txnext[0] = req;
-	dc->rxnext[0] = val;
 	dc->txnext += 1;
-	dc->rxnext += 1;
+	// extend the current span if this word lands right after it
+	if ((dc->rxnext != dc->rxfirst) &&
+		((dc->rxnext[-1].dst + dc->rxnext[-1].count) == val)) {
+		dc->rxnext[-1].count++;
+	} else {
+		dc->rxnext->dst = val;
+		dc->rxnext->count = 1;
+		dc->rxnext++;
+	}
 	dc->txbuf[2] += 1;
 	dc->txavail -= 1;
 	dc->rxavail -= 4;
 }
 
 static void dc_q_raw_wr(DC* dc, unsigned req, uint32_t val) {
-	if (dc->txavail < 5) {
-		// exec q to make space for more work,
+	if ((dc->txavail < 5) || (dc->txbuf[2] == DC_MAX_XFER_COUNT)) {
+		// send the packet to make space for more work,
 		// but if there's an error, latch it
 		// so we don't send any further txns
-		if ((dc->qerror = _dc_q_exec(dc)) != DC_OK) {
+		if ((dc->qerror = dc_q_send(dc)) != DC_OK) {
 			return;
 		}
 	}
@@ -302,6 +511,9 @@ static void dc_q_raw_wr(DC* dc, unsigned req, uint32_t val) {
 	dc->txnext += 5;
 	dc->txavail -= 5;
 	dc->txbuf[2] += 1;
+	if (req & XFER_ValueMatch) {
+		dc->qmatch = 1;
+	}
 }
 
 // adjust DP.SELECT for desired DP access, if necessary
@@ -354,6 +566,38 @@ void dc_q_ap_sel(DC* dc, uint32_t apaddr) {
 	}
 }
 
+// keep the register caches coherent with direct DP/AP writes
+// (the cached helpers update their cache after the write is queued)
+static void dc_q_dp_track(DC* dc, unsigned dpaddr) {
+	if (dpaddr == DP_SELECT) {
+		dc->dp_select_cache = INVALID;
+	} else if (dpaddr == DP_ABORT) {
+		// an aborted AP txn leaves CSW/TAR in an unknown state
+		dc_q_invalidate(dc);
+	}
+}
+
+static void dc_q_map_track(DC* dc, unsigned apaddr, int write) {
+	if ((apaddr & ~0xFU) != dc->map_reg_base) {
+		return;
+	}
+	switch (apaddr & 0xF) {
+	case MAP_CSW:
+		if (write) dc->map_csw_cache = INVALID;
+		break;
+	case MAP_TAR:
+		if (write) dc->map_tar_cache = INVALID;
+		break;
+	case MAP_DRW:
+		// unless we know TAR won't increment, we don't know TAR
+		if ((dc->map_csw_cache == INVALID) ||
+			(dc->map_csw_cache & MAP_CSW_INC_MASK)) {
+			dc->map_tar_cache = INVALID;
+		}
+		break;
+	}
+}
+
 // DP and AP reads and writes
 // DP.SELECT will be adjusted as necessary to ensure proper addressing
 void dc_q_dp_rd(DC* dc, unsigned dpaddr, uint32_t* val) {
@@ -366,18 +610,22 @@ void dc_q_dp_wr(DC* dc, unsigned dpaddr, uint32_t val) {
 	if (dc->qerror) return;
 	dc_q_dp_sel(dc, dpaddr);
 	dc_q_raw_wr(dc, XFER_DP | XFER_WR | (dpaddr & 0x0C), val);
+	dc_q_dp_track(dc, dpaddr);
 }
 
 void dc_q_ap_rd(DC* dc, unsigned apaddr, uint32_t* val) {
 	if (dc->qerror) return;
 	dc_q_ap_sel(dc, apaddr);
 	dc_q_raw_rd(dc, XFER_AP | XFER_RD | (apaddr & 0x0C), val);
+	dc_q_map_track(dc, apaddr, 0);
 }
 
 void dc_q_ap_wr(DC* dc, unsigned apaddr, uint32_t val) {
 	if (dc->qerror) return;
+	dc_cache_ap_wr(dc, apaddr);
 	dc_q_ap_sel(dc, apaddr);
 	dc_q_raw_wr(dc, XFER_AP | XFER_WR | (apaddr & 0x0C), val);
+	dc_q_map_track(dc, apaddr, 1);
 }
 
 void dc_q_set_mask(DC* dc, uint32_t mask) {
@@ -396,6 +644,7 @@ void dc_q_ap_match(DC* dc, unsigned apaddr, uint32_t val) {
 	if (dc->qerror) return;
 	dc_q_ap_sel(dc, apaddr);
 	dc_q_raw_wr(dc, XFER_AP | XFER_RD | XFER_ValueMatch | (apaddr & 0x0C), val);
+	dc_q_map_track(dc, apaddr, 0);
 }
 
 void dc_q_dp_match(DC* dc, unsigned apaddr, uint32_t val) {
@@ -418,15 +667,126 @@ void dc_q_map_match(DC* dc, unsigned offset, uint32_t val) {
 }
 
 
+// runs shorter than this are cheaper to pack into the DAP_Transfer queue
+#define XFER_BLOCK_MIN 4
+
+// a run that fits in the DAP_Transfer under construction rides along
+// in it, rather than costing a packet of its own (allowing for a
+// possible DP.SELECT write ahead of it)
+static int dc_q_fits(DC* dc, unsigned count, int rd) {
+	if ((dc->txbuf[2] + count + 1) > DC_MAX_XFER_COUNT) {
+		return 0;
+	}
+	if (rd) {
+		return (dc->txavail >= (count + 5)) && (dc->rxavail >= (count * 4));
+	} else {
+		return dc->txavail >= ((count + 1) * 5);
+	}
+}
+
+// issue a run of reads (into rd) or writes (from wr) of one DP or AP
+// register as a series of DAP_TransferBlock commands, each sized to
+// fit in the probe's max packet size, and kept in flight alongside
+// any DAP_Transfer packets
+static int dap_xfer_block(DC* dc, unsigned req, uint32_t* rd, const uint32_t* wr, unsigned count) {
+	// command header is 5 bytes, response header is 4 bytes
+	unsigned max = (req & XFER_RD) ? (dc->max_packet_size - 4) / 4 :
+		(dc->max_packet_size - 5) / 4;
+	while (count > 0) {
+		unsigned n = (count > max) ? max : count;
+		// the DAP_Transfer under construction is empty, so
+		// build the block command in its place
+		uint8_t* io = dc->txbuf;
+		io[0] = DAP_TransferBlock;
+		io[1] = 0; // Index 0 for SWD
+		io[2] = n;
+		io[3] = n >> 8;
+		io[4] = req;
+		unsigned txlen = 5;
+		if (wr) {
+			memcpy(io + 5, wr, n * 4);
+			txlen += n * 4;
+			wr += n;
+		}
+		dc_packet pkt = {
+			.cmd = DAP_TransferBlock,
+			.count = n,
+			.rxlen = rd ? (4 + n * 4) : 4,
+			.rxspan = NULL,
+			.rxspans = 0,
+			.rxdata = rd,
+		};
+		int r = dc_q_issue(dc, txlen, &pkt);
+		// the (empty) packet under construction moves to the next slot
+		dc_q_reset(dc);
+		if (r != DC_OK) {
+			return r;
+		}
+		if (rd) {
+			rd += n;
+		}
+		count -= n;
+	}
+	return DC_OK;
+}
+
+void dc_q_ap_rd_block(DC* dc, unsigned apaddr, uint32_t* val, unsigned count) {
+	if (dc->qerror) return;
+	if ((!dc->xfer_block) || (count < XFER_BLOCK_MIN) || dc_q_fits(dc, count, 1)) {
+		while (count-- > 0) {
+			dc_q_ap_rd(dc, apaddr, val++);
+		}
+		return;
+	}
+	dc_q_ap_sel(dc, apaddr);
+	// TransferBlock is a separate DAP command, so anything
+	// queued ahead of it (including the SELECT) must go first
+	if ((dc->qerror = dc_q_send(dc)) != DC_OK) {
+		return;
+	}
+	dc->qerror = dap_xfer_block(dc, XFER_AP | XFER_RD | (apaddr & 0x0C),
+		val, NULL, count);
+	dc_q_map_track(dc, apaddr, 0);
+}
+
+void dc_q_ap_wr_block(DC* dc, unsigned apaddr, const uint32_t* val, unsigned count) {
+	if (dc->qerror) return;
+	if ((!dc->xfer_block) || (count < XFER_BLOCK_MIN) || dc_q_fits(dc, count, 0)) {
+		while (count-- > 0) {
+			dc_q_ap_wr(dc, apaddr, *val++);
+		}
+		return;
+	}
+	dc_cache_ap_wr(dc, apaddr);
+	dc_q_ap_sel(dc, apaddr);
+	if ((dc->qerror = dc_q_send(dc)) != DC_OK) {
+		return;
+	}
+	dc->qerror = dap_xfer_block(dc, XFER_AP | XFER_WR | (apaddr & 0x0C),
+		NULL, val, count);
+	dc_q_map_track(dc, apaddr, 1);
+}
+
+void dc_q_map_rd_block(DC* dc, unsigned offset, uint32_t* val, unsigned count) {
+	dc_q_ap_rd_block(dc, dc->map_reg_base + offset, val, count);
+}
+
+void dc_q_map_wr_block(DC* dc, unsigned offset, const uint32_t* val, unsigned count) {
+	dc_q_ap_wr_block(dc, dc->map_reg_base + offset, val, count);
+}
+
+
 // write to ABORT, which should never cause a fault
 static int _dc_wr_abort(DC* dc, uint32_t val) {
 	_dc_q_init(dc);
 	dc_q_raw_wr(dc, XFER_DP | XFER_WR | XFER_00, val);
+	dc_q_invalidate(dc);
+	dc_cache_invalidate(dc);
 	return _dc_q_exec(dc);
 }
 
-// the public dc_q_exec() is called from higher layers
-int dc_q_exec(DC* dc) {
+// run the queue and clear sticky errors if it faulted
+static int dc_q_exec_recover(DC* dc) {
 	int r = _dc_q_exec(dc);
 	if (r == DC_ERR_SWD_FAULT) {
 		// clear all sticky errors
@@ -440,6 +800,37 @@ int dc_q_exec(DC* dc) {
 	return r;
 }
 
+// the public dc_q_exec() is called from higher layers
+// and also reports deferred writes that failed earlier
+int dc_q_exec(DC* dc) {
+	int r = dc_q_exec_recover(dc);
+	if (dc->werror != DC_OK) {
+		if (r == DC_OK) {
+			r = dc->werror;
+		}
+		dc->werror = DC_OK;
+	}
+	return r;
+}
+
+int dc_q_exec_wr(DC* dc) {
+	if ((dc->flags & DCF_WRITE_COMBINE) && (dc->qerror == DC_OK)) {
+		dc->qdefer = 1;
+		return DC_OK;
+	}
+	return dc_q_exec(dc);
+}
+
+int dc_flush(DC* dc) {
+	if (!dc->qdefer) {
+		int r = dc->werror;
+		dc->werror = DC_OK;
+		return r;
+	}
+	dc_q_init(dc);
+	return dc_q_exec(dc);
+}
+
 
 // convenience wrappers for single reads and writes
 int dc_dp_rd(DC* dc, unsigned dpaddr, uint32_t* val) {
@@ -517,6 +908,7 @@ static int _dc_attach(DC* dc, unsigned flags, uint32_t tgt, uint32_t* idcode) {
 	// Issue a bare DP.IDR read, as required after a line reset
 	// or line reset + target select
 	_dc_q_init(dc);
+	dc_q_invalidate(dc);
 	dc_q_raw_rd(dc, XFER_DP | XFER_RD | XFER_00, idcode);
 	// Writes to ABORT will not cause a fault.  Clear any faults now.
 	dc_q_raw_wr(dc, XFER_DP | XFER_WR | XFER_00, DP_ABORT_ALLCLR);
@@ -627,10 +1019,18 @@ int dc_attach(DC* dc, unsigned flags, unsigned tgt, uint32_t* idcode) {
 
 	dc->dp_version = 0;
 	dc->map_reg_base = 0;
+	dc->core_epoch++;
+	dc_q_invalidate(dc);
+	dc_cache_invalidate(dc);
 
 	_dc_attach(dc, 0, 0, &n);
 
+	// writes that failed before the line reset are moot now
+	dc->werror = DC_OK;
+
+	// SELECT layout depends on the DP version
 	dc->dp_version = (n >> 12) & 7;
+	dc_q_invalidate(dc);
 
 	if (dc->dp_version == 3) {
 		// todo: query ROM table
@@ -677,6 +1077,8 @@ int dc_attach(DC* dc, unsigned flags, unsigned tgt, uint32_t* idcode) {
 	}
 	dc_q_ap_rd(dc, dc->map_reg_base + MAP_CSW, &dc->map_csw_keep);
 	dc_q_exec(dc);
+	// size and address increment are always set per access
+	dc->map_csw_keep &= ~(MAP_CSW_SZ_MASK | MAP_CSW_INC_MASK);
 	DEBUG("attach: CTRL/STAT   %08x\n", n);
 	DEBUG("attach: MAP.CSW     %08x\n", dc->map_csw_keep);
 
@@ -688,6 +1090,9 @@ int dc_attach(DC* dc, unsigned flags, unsigned tgt, uint32_t* idcode) {
 
 	dc_set_status(dc, DC_ATTACHED);
 
+	dc_map_probe(dc);
+	dc_bp_probe(dc);
+
 #if 0
 	if (dc->dp_version >= 3) {
 		dump_rom_table(dc, 0, 1);
@@ -714,6 +1119,225 @@ void dc_require_serialno(const char* sn) {
 	dc_serialno = sn;
 }
 
+
+// SWO trace capture
+
+// a probe with a trace endpoint gets this many transfers queued
+// on it at all times, so a slow callback doesn't stall the stream
+#define SWO_XFERS     8
+#define SWO_XFER_SIZE 16384
+
+// without one, DAP_SWO_Data is polled this often while idle,
+// draining up to this many packets of trace data each time
+#define SWO_POLL_MS   10
+#define SWO_POLL_MAX  64
+
+static void* swo_stream(void* arg) {
+	DC* dc = arg;
+	usb_handle* usb = dc->usb;
+	unsigned xfers = 0, next = 0;
+	int stop = 0, r = 0;
+
+	pthread_mutex_lock(&dc->swo_lock);
+	while (xfers < SWO_XFERS) {
+		if ((r = usb_submit(usb, USB_SWO, dc->swo_buf + xfers * SWO_XFER_SIZE, SWO_XFER_SIZE)) < 0) {
+			break;
+		}
+		xfers++;
+	}
+	pthread_mutex_unlock(&dc->swo_lock);
+	if (xfers == 0) {
+		dc->swo_error = r;
+		return NULL;
+	}
+
+	// transfers complete in the order submitted, and each is
+	// resubmitted as soon as its data is delivered
+	while (usb_pending(usb, USB_SWO) > 0) {
+		uint8_t* buf = dc->swo_buf + next * SWO_XFER_SIZE;
+		next = (next + 1) % xfers;
+		if ((r = usb_reap(usb, USB_SWO)) < 0) {
+			// cancelled, or the probe went away
+			if (!stop && !dc->swo_stop && (dc->swo_error == 0)) {
+				dc->swo_error = r;
+			}
+			stop = 1;
+			continue;
+		}
+		if (r > 0) {
+			dc->swo_bytes += r;
+			dc->swo_callback(dc->swo_cookie, buf, r);
+		}
+		// dc_swo_stop() cancels whatever is pending once swo_stop
+		// is set, so nothing may be submitted after that
+		pthread_mutex_lock(&dc->swo_lock);
+		if (dc->swo_stop || stop) {
+			stop = 1;
+		} else if ((r = usb_submit(usb, USB_SWO, buf, SWO_XFER_SIZE)) < 0) {
+			dc->swo_error = r;
+			stop = 1;
+		}
+		pthread_mutex_unlock(&dc->swo_lock);
+	}
+	return NULL;
+}
+
+// drain the probe's trace buffer via DAP_SWO_Data
+static int swo_drain(DC* dc) {
+	unsigned max = dc->max_packet_size - 4;
+	for (unsigned n = 0; n < SWO_POLL_MAX; n++) {
+		uint8_t* io = dc->swo_buf;
+		io[0] = DAP_SWO_Data;
+		io[1] = max;
+		io[2] = max >> 8;
+		int r = dap_cmd(dc, io, 3, io, max + 4);
+		if (r < 0) {
+			return r;
+		}
+		unsigned count = io[2] | (io[3] << 8);
+		if ((r < 4) || (count > (r - 4))) {
+			ERROR("swo: bad DAP_SWO_Data response\n");
+			return DC_ERR_PROTOCOL;
+		}
+		if (io[1] & (SWO_STATUS_ERROR | SWO_STATUS_OVERRUN)) {
+			dc->swo_overruns++;
+		}
+		if (count > 0) {
+			dc->swo_bytes += count;
+			dc->swo_callback(dc->swo_cookie, io + 4, count);
+		}
+		if (count < max) {
+			break;
+		}
+	}
+	return DC_OK;
+}
+
+static int swo_periodic(DC* dc, int ms) {
+	if (dc->swo_streaming) {
+		if (dc->swo_error) {
+			ERROR("swo: trace stream failed (%d)\n", dc->swo_error);
+			dc_swo_stop(dc);
+			return ms;
+		}
+		// only the probe knows if it ran out of buffer
+		uint8_t io[6] = { DAP_SWO_Status };
+		if ((dap_cmd(dc, io, 1, io, 6) >= 6) &&
+			(io[1] & (SWO_STATUS_ERROR | SWO_STATUS_OVERRUN))) {
+			dc->swo_overruns++;
+		}
+		return ms;
+	}
+	if (swo_drain(dc) < 0) {
+		ERROR("swo: cannot read trace data\n");
+		dc_swo_stop(dc);
+		return ms;
+	}
+	return (ms > SWO_POLL_MS) ? SWO_POLL_MS : ms;
+}
+
+// stop the stream thread, if any
+static void swo_halt(DC* dc) {
+	if (dc->swo_streaming) {
+		pthread_mutex_lock(&dc->swo_lock);
+		dc->swo_stop = 1;
+		pthread_mutex_unlock(&dc->swo_lock);
+		usb_cancel(dc->usb, USB_SWO);
+		pthread_join(dc->swo_thread, NULL);
+		dc->swo_streaming = 0;
+	}
+	dc->swo_active = 0;
+}
+
+int dc_swo_start(DC* dc, uint32_t* baud, uint32_t* mode, dc_swo_cb cb, void* cookie) {
+	uint8_t io[5];
+	uint32_t m;
+	int r;
+
+	dc_swo_stop(dc);
+	if (dc->usb == NULL) {
+		return DC_ERR_OFFLINE;
+	}
+	if (dc->swo_caps & I0_SWO_UART) {
+		m = SWO_MODE_UART;
+	} else if (dc->swo_caps & I0_SWO_Manchester) {
+		m = SWO_MODE_MANCHESTER;
+	} else {
+		return DC_ERR_UNSUPPORTED;
+	}
+	if ((dc->swo_buf == NULL) &&
+		((dc->swo_buf = malloc(SWO_XFERS * SWO_XFER_SIZE)) == NULL)) {
+		return DC_ERR_FAILED;
+	}
+	// DAP_SWO_Data responses must fit in swo_buf too
+	if (dc->max_packet_size > (SWO_XFERS * SWO_XFER_SIZE)) {
+		return DC_ERR_UNSUPPORTED;
+	}
+	int streaming = (dc->swo_caps & I0_SWO_Streaming_Trace) &&
+		usb_has_pipe(dc->usb, USB_SWO);
+
+	io[0] = DAP_SWO_Transport;
+	io[1] = streaming ? SWO_TRANSPORT_STREAM : SWO_TRANSPORT_COMMAND;
+	if ((r = dap_cmd_std(dc, "swo_transport()", io, 2, 2)) < 0) {
+		return r;
+	}
+	io[0] = DAP_SWO_Mode;
+	io[1] = m;
+	if ((r = dap_cmd_std(dc, "swo_mode()", io, 2, 2)) < 0) {
+		return r;
+	}
+	io[0] = DAP_SWO_Baudrate;
+	memcpy(io + 1, baud, 4);
+	if ((r = dap_cmd(dc, io, 5, io, 5)) < 0) {
+		return r;
+	}
+	if (r < 5) {
+		return DC_ERR_PROTOCOL;
+	}
+	memcpy(baud, io + 1, 4);
+	if (*baud == 0) {
+		return DC_ERR_UNSUPPORTED;
+	}
+
+	dc->swo_callback = cb;
+	dc->swo_cookie = cookie;
+	dc->swo_bytes = 0;
+	dc->swo_overruns = 0;
+	dc->swo_error = 0;
+	dc->swo_stop = 0;
+	if (streaming) {
+		if (pthread_create(&dc->swo_thread, NULL, swo_stream, dc) != 0) {
+			return DC_ERR_FAILED;
+		}
+		dc->swo_streaming = 1;
+	}
+	dc->swo_active = 1;
+
+	io[0] = DAP_SWO_Control;
+	io[1] = SWO_CONTROL_START;
+	if ((r = dap_cmd_std(dc, "swo_control()", io, 2, 2)) < 0) {
+		swo_halt(dc);
+		return r;
+	}
+	*mode = m;
+	return DC_OK;
+}
+
+int dc_swo_stop(DC* dc) {
+	if (!dc->swo_active) {
+		return DC_OK;
+	}
+	uint8_t io[2] = { DAP_SWO_Control, SWO_CONTROL_STOP };
+	int r = dap_cmd_std(dc, "swo_control()", io, 2, 2);
+	swo_halt(dc);
+	return r;
+}
+
+void dc_swo_stats(DC* dc, uint32_t* bytes, uint32_t* overruns) {
+	*bytes = dc->swo_bytes;
+	*overruns = dc->swo_overruns;
+}
+
 static usb_handle* usb_connect(void) {
 	return usb_open(dc_vid, dc_pid, dc_serialno);
 }
@@ -747,12 +1371,20 @@ static int dap_configure(DC* dc) {
 	dc->cfg_mask = INVALID;
 
 	dc->map_csw_keep = 0;
+	dc->map_wrap_size = MAP_TAR_WRAP_MIN;
+	dc->map_sizes = 1U << MAP_CSW_SZ_32;
+	dc->map_packed = 0;
 	dc->map_csw_cache = INVALID;
 	dc->map_tar_cache = INVALID;
+	dc_cache_invalidate(dc);
 
 	// setup default packet limits
 	dc->max_packet_count = 1;
 	dc->max_packet_size = 64;
+	dc->inflight_count = 0;
+	if (dc_q_alloc(dc) != DC_OK) {
+		return DC_ERR_FAILED;
+	}
 
 	// flush queue
 	dc_q_clear(dc);
@@ -767,7 +1399,9 @@ static int dap_configure(DC* dc) {
 	}
 
 	buf[0] = 0; buf[1] = 0;
+	dc->swo_caps = 0;
 	if (dap_get_info(dc, DI_Capabilities, buf, 1, 2) > 0) {
+		dc->swo_caps = buf[0] & (I0_SWO_UART | I0_SWO_Manchester | I0_SWO_Streaming_Trace);
 		INFO("connect: Capabilities:");
 		if (buf[0] & I0_SWD) INFO(" SWD");
 		if (buf[0] & I0_JTAG) INFO(" JTAG");
@@ -789,6 +1423,10 @@ static int dap_configure(DC* dc) {
 	if (dap_get_info(dc, DI_SWO_Trace_Buffer_Size, &n32, 4, 4) == 4) {
 		INFO("connect: SWO Trace Buffer Size: %u\n", n32);
 	}
+	if (dc->swo_caps & I0_SWO_Streaming_Trace) {
+		INFO("connect: SWO Trace Endpoint: %s\n",
+			usb_has_pipe(dc->usb, USB_SWO) ? "yes" : "no");
+	}
 	if (dap_get_info(dc, DI_Max_Packet_Count, &n8, 1, 1) == 1) {
 		dc->max_packet_count = n8;
 	}
@@ -799,15 +1437,28 @@ static int dap_configure(DC* dc) {
 		dc->max_packet_count, dc->max_packet_size);
 	if ((dc->max_packet_count < 1) || (dc->max_packet_size < 64)) {
 		ERROR("dc_init() impossible packet configuration\n");
+		dc->max_packet_size = 64;
 		return DC_ERR_PROTOCOL;
 	}
+	if (dc_q_alloc(dc) != DC_OK) {
+		ERROR("dc_init() cannot allocate %u byte packets\n", dc->max_packet_size);
+		dc->max_packet_size = 64;
+		return DC_ERR_FAILED;
+	}
+	dc_q_clear(dc);
 
 	// invalidate register cache
 	dc->dp_select_cache = INVALID;
 
-	// clip to our buffer size
-	if (dc->max_packet_size > 1024) {
-		dc->max_packet_size = 1024;
+	// DAP_TransferBlock is optional in older probe firmware
+	// a zero-length block touches nothing on the target
+	uint8_t io[5] = { DAP_TransferBlock, 0, 0, 0, XFER_DP | XFER_RD | XFER_0C };
+	dc->xfer_block = (dap_cmd(dc, io, 5, io, 4) >= 4);
+	INFO("connect: TransferBlock: %s\n", dc->xfer_block ? "yes" : "no");
+
+	// clip to our in-flight window
+	if (dc->max_packet_count > DC_MAX_INFLIGHT) {
+		dc->max_packet_count = DC_MAX_INFLIGHT;
 	}
 
 	dap_connect(dc);
@@ -836,14 +1487,23 @@ int dc_create(DC** out, void (*cb)(void *cookie, uint32_t status), void *cookie)
 	}
 	dc->status_callback = cb;
 	dc->status_cookie = cookie;
-	dc->flags = DCF_POLL; // | DCF_AUTO_ATTACH;
+	pthread_mutex_init(&dc->swo_lock, NULL);
+	dc->flags = DCF_POLL | DCF_REG_CACHE; // | DCF_AUTO_ATTACH;
+	// queue buffers must exist even while offline
+	dc->max_packet_count = 1;
+	dc->max_packet_size = 64;
+	if (dc_q_alloc(dc) != DC_OK) {
+		free(dc);
+		return DC_ERR_FAILED;
+	}
+	dc_q_clear(dc);
 	*out = dc;
 	dc_set_status(dc, DC_OFFLINE);
 	dc_connect(dc);
 	return 0;
 }
 
-int dc_periodic(DC* dc) {
+static int dc_poll(DC* dc) {
 	switch (dc->status) {
 	case DC_OFFLINE:
 		if (dc_connect(dc) < 0) {
@@ -853,8 +1513,18 @@ int dc_periodic(DC* dc) {
 		}
 	case DC_ATTACHED:
 		if (dc->flags & DCF_POLL) {
-			uint32_t n;
-			int r = dc_dp_rd(dc, DP_CS, &n);
+			uint32_t n, dhcsr;
+			dc_q_init(dc);
+			dc_q_dp_rd(dc, DP_CS, &n);
+			// track halt state for the memory cache, which also
+			// notices the core reset or resumed behind our back
+			if (dc->cache_regions) {
+				dc_q_mem_rd32(dc, DHCSR, &dhcsr);
+			}
+			int r = dc_q_exec(dc);
+			if ((r == DC_OK) && dc->cache_regions) {
+				dc_cache_observe(dc, dhcsr);
+			}
 			if (r == DC_ERR_IO) {
 				dc_set_status(dc, DC_OFFLINE);
 				ERROR("offline\n");
@@ -877,3 +1547,11 @@ int dc_periodic(DC* dc) {
 	}
 }
 
+int dc_periodic(DC* dc) {
+	int ms = dc_poll(dc);
+	if (dc->swo_active) {
+		ms = swo_periodic(dc, ms);
+	}
+	return ms;
+}
+
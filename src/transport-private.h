@@ -6,9 +6,59 @@
 #include "xdebug.h"
 
 #include <stdint.h>
+#include <pthread.h>
 
 #include "usb.h"
 
+// most DAP packets we will keep in flight at once
+#define DC_MAX_INFLIGHT 8
+
+// DAP_Transfer has an 8bit transfer count
+#define DC_MAX_XFER_COUNT 255
+
+// consecutive words of a DAP_Transfer response that land in
+// consecutive words of memory, delivered with a single copy
+typedef struct dc_span {
+	uint32_t* dst;
+	uint32_t count;
+} dc_span;
+
+// a DAP_Transfer or DAP_TransferBlock command that has been sent
+// to the probe and whose response has not yet been read back
+typedef struct dc_packet {
+	uint32_t cmd;
+	uint32_t count;     // transfers requested
+	uint32_t txlen;     // command length
+	uint32_t rxlen;     // expected response length
+	dc_span* rxspan;    // DAP_Transfer: destinations of the data words
+	uint32_t rxspans;
+	uint32_t* rxdata;   // DAP_TransferBlock: destination of all data words
+	uint32_t match;     // holds a value match, nothing may follow until answered
+} dc_packet;
+
+// host-side cache of target memory, direct mapped
+#define DC_CACHE_PAGE_SIZE 256
+#define DC_CACHE_PAGES     256
+#define DC_CACHE_REGIONS   8
+
+// hardware breakpoint and watchpoint comparators we manage
+#define DC_BP_MAX 16
+#define DC_WP_MAX 16
+
+typedef struct dc_watch {
+	uint32_t addr;      // as requested (comp and mask may cover more)
+	uint32_t len;
+	uint32_t comp;
+	uint32_t mask;
+	uint32_t func;
+} dc_watch;
+
+typedef struct dc_cache_page {
+	uint32_t addr;      // target address of the page
+	uint32_t epoch;     // only valid if it matches dc->cache_epoch
+	uint32_t data[DC_CACHE_PAGE_SIZE / 4];
+} dc_cache_page;
+
 struct debug_context {
 	usb_handle* usb;
 	unsigned status;
@@ -21,12 +71,15 @@ struct debug_context {
 	// dap protocol info
 	uint32_t max_packet_count;
 	uint32_t max_packet_size;
+	uint32_t xfer_block; // DAP_TransferBlock supported
+	uint32_t swd_hz;     // SWD clock, from dc_set_clock()
 
 	// dap internal state cache
 	uint32_t cfg_idle;
 	uint32_t cfg_wait;
 	uint32_t cfg_match;
 	uint32_t cfg_mask;
+	uint32_t quiet_match; // value mismatch is expected, don't complain
 
 	// target state
 	uint32_t dp_version;
@@ -39,19 +92,84 @@ struct debug_context {
 	// active MAP context
 	uint32_t map_reg_base;
 
+	// MAP properties
+	uint32_t map_wrap_size; // TAR auto-increment boundary
+	uint32_t map_sizes;     // bit (1 << MAP_CSW_SZ_n) set if supported
+	uint32_t map_packed;    // packed 8bit transfers supported
+
 	// MAP cached state
 	uint32_t map_csw_keep;
 	uint32_t map_csw_cache;
 	uint32_t map_tar_cache;
 
 	// transfer queue state
-	uint8_t txbuf[1024];
-	uint32_t* rxptr[256];
+	// the packet under construction is built in place in the
+	// tx buffer of its in-flight slot
+	uint8_t *txbuf;
+	dc_span rxspan[DC_MAX_INFLIGHT + 1][DC_MAX_XFER_COUNT];
 	uint8_t *txnext;
-	uint32_t** rxnext;
+	dc_span* rxfirst;
+	dc_span* rxnext;
 	uint32_t txavail;
 	uint32_t rxavail;
 	int qerror;
+	int qdefer;     // queue holds writes deferred by write-combining
+	int werror;     // deferred writes failed, for the next exec/flush
+	int qmatch;     // packet under construction holds a value match
+
+	// packets awaiting responses, oldest at inflight_head
+	// the packet being built uses the slot after the newest
+	// each slot owns the usb buffers of its async transfers,
+	// max_packet_size bytes each, allocated when the probe connects
+	dc_packet inflight[DC_MAX_INFLIGHT + 1];
+	uint8_t* inflight_tx;
+	uint8_t* inflight_rx;
+	uint32_t inflight_head;
+	uint32_t inflight_count;
+
+	// memory read cache, only used while the core is known halted
+	// bumping cache_epoch discards every page at once
+	dc_cache_page* cache;
+	uint32_t cache_epoch;
+	uint32_t cache_armed;
+	uint32_t cache_base[DC_CACHE_REGIONS];
+	uint32_t cache_end[DC_CACHE_REGIONS];
+	uint32_t cache_regions;
+	uint32_t cache_hits;
+	uint32_t cache_misses;
+
+	// bumped whenever the core may have run or been reset
+	uint32_t core_epoch;
+
+	// breakpoint (FPB) and watchpoint (DWT) comparators
+	// *_want is what has been asked for, *_hw what was last written
+	// (INVALID if unknown), and dc_bp_sync() writes the difference
+	uint32_t bp_probed;
+	uint32_t bp_rev;        // FP_CTRL_REV_*
+	uint32_t bp_count;
+	uint32_t bp_want[DC_BP_MAX];
+	uint32_t bp_hw[DC_BP_MAX];
+	uint32_t bp_ctrl_hw;    // FP_CTRL enable written
+	uint32_t wp_count;
+	dc_watch wp_want[DC_WP_MAX];
+	dc_watch wp_hw[DC_WP_MAX];
+	uint32_t wp_trcena;     // DEMCR.TRCENA known to be set
+	uint32_t bp_dirty;
+
+	// SWO trace capture
+	// while streaming, swo_thread owns the USB_SWO pipe and swo_buf
+	uint32_t swo_caps;      // I0_SWO_* capabilities of the probe
+	uint32_t swo_active;
+	uint32_t swo_streaming; // via the trace endpoint, not DAP_SWO_Data
+	uint32_t swo_bytes;
+	uint32_t swo_overruns;
+	volatile int swo_error; // stream thread failure, reported by dc_periodic()
+	int swo_stop;           // protected by swo_lock
+	void (*swo_callback)(void* cookie, const uint8_t* data, unsigned len);
+	void* swo_cookie;
+	uint8_t* swo_buf;
+	pthread_t swo_thread;
+	pthread_mutex_t swo_lock;
 };
 
 typedef struct debug_context DC;
@@ -75,3 +193,21 @@ static void dump(const char* str, const void* ptr, unsigned len) {
 
 uint32_t dc_get_attn_value(DC* dc);
 
+// discover properties of the active MAP, from dc_attach()
+int dc_map_probe(DC* dc);
+
+// execute a queue of writes, or with DCF_WRITE_COMBINE leave them
+// queued ahead of the next queue (whose exec reports their status)
+int dc_q_exec_wr(DC* dc);
+
+// breakpoints (transport-bkpt.c)
+// count comparators and forget what they hold, from dc_attach()
+int dc_bp_probe(DC* dc);
+
+// memory cache (transport-cache.c)
+void dc_cache_invalidate(DC* dc);
+void dc_cache_observe(DC* dc, uint32_t dhcsr);
+void dc_cache_ap_wr(DC* dc, unsigned apaddr);
+int dc_cache_covers(DC* dc, uint32_t addr, uint32_t len);
+int dc_cache_read(DC* dc, uint32_t addr, uint32_t len, void* buf);
+
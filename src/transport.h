@@ -19,6 +19,8 @@ uint32_t dc_flags(dctx_t* dc, uint32_t clr, uint32_t set);
 #define DCF_POLL        0x00000001 // query state while attached
 #define DCF_AUTO_ATTACH 0x00000002 // attach on new command if detached
 #define DCF_AUTO_CONFIG 0x00000004 // configure some flags based on IDCODE
+#define DCF_REG_CACHE   0x00000008 // keep DP/AP register caches across queues
+#define DCF_WRITE_COMBINE 0x00000010 // defer dc_mem_wr32() and dc_core_reg_wr()
 
 #define DC_OK               0
 #define DC_ERR_FAILED      -1  // generic internal failure
@@ -57,6 +59,10 @@ void dc_set_match_retry(dctx_t* dc, unsigned num);
 void dc_q_set_mask(dctx_t* dc, uint32_t mask);
 
 // try to read until (readval & mask) == val or timeout
+// a mismatch fails the queue and the probe skips the rest of the
+// packet holding the match, but a match does not by itself protect
+// later packets in the same queue: the transport holds those back
+// until the match is answered, so each match costs a round trip
 void dc_q_ap_match(dctx_t* dc, unsigned apaddr, uint32_t val);
 void dc_q_dp_match(dctx_t* dc, unsigned apaddr, uint32_t val);
 
@@ -65,12 +71,26 @@ void dc_q_map_rd(dctx_t* dc, unsigned offset, uint32_t* val);
 void dc_q_map_wr(dctx_t* dc, unsigned offset, uint32_t val);
 void dc_q_map_match(dctx_t* dc, unsigned offset, uint32_t val);
 
+// queue a run of reads or writes of a single Access Port register
+// (typically MAP.DRW with auto-increment enabled)
+// uses DAP_TransferBlock if the probe supports it, in which case
+// anything queued before is issued first and the run is sent at once
+void dc_q_ap_rd_block(dctx_t* dc, unsigned apaddr, uint32_t* val, unsigned count);
+void dc_q_ap_wr_block(dctx_t* dc, unsigned apaddr, const uint32_t* val, unsigned count);
+void dc_q_map_rd_block(dctx_t* dc, unsigned offset, uint32_t* val, unsigned count);
+void dc_q_map_wr_block(dctx_t* dc, unsigned offset, const uint32_t* val, unsigned count);
+
 // prepare for a set of transactions
 void dc_q_init(dctx_t* dc);
 
 // execute any outstanding transactions, return final status
 int dc_q_exec(dctx_t* dc);
 
+// with DCF_WRITE_COMBINE, dc_mem_wr32() and dc_core_reg_wr() only
+// queue their writes, which go out ahead of the next read (and
+// an error from them is reported by that read), or on dc_flush()
+int dc_flush(dctx_t* dc);
+
 // convenince wrappers for a single read/write and then exec
 int dc_dp_rd(dctx_t* dc, unsigned dpaddr, uint32_t* val);
 int dc_dp_wr(dctx_t* dc, unsigned dpaddr, uint32_t val);
@@ -87,6 +107,8 @@ int dc_create(dctx_t** dc, void (*cb)(void *cookie, uint32_t status), void *cook
 #define DC_UNCONFIG 3 // configure failed
 #define DC_OFFLINE  4 // usb connection not available
 
+uint32_t dc_get_status(dctx_t* dc);
+
 // attempt to attach to the debug target
 int dc_attach(dctx_t* dc, unsigned flags, uint32_t tgt, uint32_t* idcode);
 #define DC_MULTIDROP 1
@@ -96,12 +118,107 @@ void dc_q_mem_rd32(dctx_t* dc, uint32_t addr, uint32_t* val);
 void dc_q_mem_wr32(dctx_t* dc, uint32_t addr, uint32_t val);
 void dc_q_mem_match32(dctx_t* dc, uint32_t addr, uint32_t val);
 
+// queue word reads, TAR auto-incrementing
+void dc_q_mem_rd_words(dctx_t* dc, uint32_t addr, uint32_t num, uint32_t* ptr);
+
 int dc_mem_rd32(dctx_t* dc, uint32_t addr, uint32_t* val);
 int dc_mem_wr32(dctx_t* dc, uint32_t addr, uint32_t val);
 
 int dc_mem_rd_words(dctx_t* dc, uint32_t addr, uint32_t num, uint32_t* ptr);
 int dc_mem_wr_words(dctx_t* dc, uint32_t addr, uint32_t num, const uint32_t* ptr);
 
+// read the same word num times in one batch (to sample DWT_PCSR, etc)
+int dc_mem_sample32(dctx_t* dc, uint32_t addr, uint32_t num, uint32_t* ptr);
+
+// 8 and 16 bit accesses, if supported by the MAP (DC_ERR_UNSUPPORTED if not)
+void dc_q_mem_wr8(dctx_t* dc, uint32_t addr, uint8_t val);
+void dc_q_mem_wr16(dctx_t* dc, uint32_t addr, uint16_t val);
+int dc_mem_rd8(dctx_t* dc, uint32_t addr, uint8_t* val);
+int dc_mem_rd16(dctx_t* dc, uint32_t addr, uint16_t* val);
+int dc_mem_wr8(dctx_t* dc, uint32_t addr, uint8_t val);
+int dc_mem_wr16(dctx_t* dc, uint32_t addr, uint16_t val);
+
+// any address and length: unaligned ends use 8/16 bit accesses,
+// the rest uses word accesses
+int dc_mem_read(dctx_t* dc, uint32_t addr, uint32_t len, void* buf);
+int dc_mem_write(dctx_t* dc, uint32_t addr, uint32_t len, const void* buf);
+
+// strictly 8 bit accesses (packed, if supported)
+int dc_mem_rd_bytes(dctx_t* dc, uint32_t addr, uint32_t len, uint8_t* ptr);
+int dc_mem_wr_bytes(dctx_t* dc, uint32_t addr, uint32_t len, const uint8_t* ptr);
+
+// read many (possibly scattered) ranges in one batch
+// ranges are read as whole words, and ranges within DC_READV_GAP
+// bytes of each other are merged, so the bytes between are read too
+typedef struct {
+	uint32_t addr;
+	uint32_t len;
+	void* dst;
+} dc_iovec;
+
+#define DC_READV_GAP 32
+
+int dc_mem_readv(dctx_t* dc, const dc_iovec* iov, unsigned count);
+
+// host-side memory read cache
+// dc_mem_rd32(), dc_mem_rd_words(), and dc_mem_read() within a
+// cacheable region are served from the cache while the core is
+// halted (as last observed via DHCSR), and any write, resume,
+// step, or reset discards the cached data
+// regions are trimmed to whole (256 byte) cache pages
+int dc_cache_add(dctx_t* dc, uint32_t addr, uint32_t len);
+void dc_cache_clear(dctx_t* dc);
+int dc_cache_region(dctx_t* dc, unsigned n, uint32_t* addr, uint32_t* len);
+void dc_cache_stats(dctx_t* dc, uint32_t* hits, uint32_t* misses);
+
+
+
+// SWO trace capture
+// trace data is handed to the callback as it arrives: from a thread
+// of its own if the probe streams it over a dedicated USB endpoint,
+// otherwise from dc_periodic() (so only between commands), and in
+// either case the callback must not block for long
+typedef void (*dc_swo_cb)(void* cookie, const uint8_t* data, unsigned len);
+
+#define DC_SWO_UART       1 // NRZ
+#define DC_SWO_MANCHESTER 2
+
+// start capturing at (the probe's closest rate to) *baud, returning
+// the actual rate and the encoding (DC_SWO_*) the target must use
+int dc_swo_start(dctx_t* dc, uint32_t* baud, uint32_t* mode, dc_swo_cb cb, void* cookie);
+int dc_swo_stop(dctx_t* dc);
+
+// bytes captured, and times the probe reported losing trace data
+void dc_swo_stats(dctx_t* dc, uint32_t* bytes, uint32_t* overruns);
+
+
+// hardware breakpoints (FPB) and data watchpoints (DWT)
+// comparators are counted on attach and set and cleared in a host
+// side shadow, which dc_core_resume() and dc_core_step() write out
+// (only the registers that changed, in one batch) via dc_bp_sync()
+int dc_bp_set(dctx_t* dc, uint32_t addr);
+int dc_bp_clr(dctx_t* dc, uint32_t addr);
+int dc_bp_get(dctx_t* dc, unsigned n, uint32_t* addr);
+
+#define DC_WP_READ   1
+#define DC_WP_WRITE  2
+#define DC_WP_ACCESS 3
+
+// the comparator watches the smallest aligned power of two sized
+// range covering [addr, addr + len), so may also match around it
+int dc_wp_set(dctx_t* dc, uint32_t addr, uint32_t len, uint32_t kind);
+int dc_wp_clr(dctx_t* dc, uint32_t addr, uint32_t len, uint32_t kind);
+int dc_wp_get(dctx_t* dc, unsigned n, uint32_t* addr, uint32_t* len, uint32_t* kind);
+
+// which watchpoint (if any) matched since the last check
+// 1 = one did, 0 = none, < 0 = error
+int dc_wp_matched(dctx_t* dc, uint32_t* addr, uint32_t* kind);
+
+// comparators available (0 until attached)
+void dc_bp_info(dctx_t* dc, uint32_t* bps, uint32_t* wps);
+
+// write out changes now, rather than at the next resume or step
+int dc_bp_sync(dctx_t* dc);
 
 
 int dc_core_halt(dctx_t* dc);
@@ -117,3 +234,21 @@ int dc_core_reg_rd_list(dctx_t* dc, uint32_t* id, uint32_t* val, unsigned count)
 // 0 = no, 1 = yes, < 0 = error
 int dc_core_check_halt(dctx_t* dc);
 
+// changes whenever the core may have run code of its own or been
+// reset (on attach, resume, or step, or a read of DHCSR showing it
+// running or reset), but not across dc_target_call(), so state left
+// on the target may be trusted while it stays the same
+uint32_t dc_core_epoch(dctx_t* dc);
+
+// call a Thumb function on the halted core, with r0-r3 = args
+// and sp, returning to ret (where a BKPT should halt the core),
+// and wait (until it halts, or the attention value changes) for
+// its result (r0), or DC_ERR_BAD_STATE if it halted elsewhere
+int dc_target_call(dctx_t* dc, uint32_t entry, const uint32_t args[4],
+	uint32_t sp, uint32_t ret, uint32_t* result);
+
+// the same in two halves, to talk to the function while it runs
+int dc_target_call_start(dctx_t* dc, uint32_t entry, const uint32_t args[4],
+	uint32_t sp, uint32_t ret);
+int dc_target_call_wait(dctx_t* dc, uint32_t ret, uint32_t* result);
+
@@ -6,17 +6,33 @@
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <pthread.h>
 
 #include <libusb-1.0/libusb.h>
 
 #include "usb.h"
 
+// a ring of preallocated transfers for one endpoint
+// transfers are submitted at head+count and reaped at head
+typedef struct usb_ring {
+	struct libusb_transfer *xfer[USB_RING_SIZE];
+	int done[USB_RING_SIZE];
+	unsigned head;
+	unsigned count;
+	unsigned ept;
+	unsigned timeout;
+} usb_ring;
+
 struct usb_handle {
 	libusb_device_handle *dev;
 	unsigned ei;
 	unsigned eo;
+	usb_ring ring[USB_PIPES];
 };
 
+static pthread_mutex_t usb_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t usb_cond = PTHREAD_COND_INITIALIZER;
+
 int get_sysfs_path(libusb_device* dev, char* path, int max) {
 	if (max < 0) return -1;
 	uint8_t num[8];
@@ -35,7 +51,7 @@ int get_sysfs_path(libusb_device* dev, char* path, int max) {
 }
 
 int get_vendor_bulk_ifc(struct libusb_config_descriptor *cd, uint8_t* iifc,
-			uint8_t *ino, uint8_t *eptin, uint8_t *eptout) {
+			uint8_t *ino, uint8_t *eptin, uint8_t *eptout, uint8_t *eptswo) {
 	const struct libusb_interface_descriptor *id;
 	for (unsigned i = 0; i < cd->bNumInterfaces; i++) {
 		if (cd->interface[i].num_altsetting != 1) {
@@ -47,31 +63,36 @@ int get_vendor_bulk_ifc(struct libusb_config_descriptor *cd, uint8_t* iifc,
 			// require vendor ifc class
 			continue;
 		}
-		if (id->bNumEndpoints != 2) {
-			// must have two endpoints
-			continue;
-		}
-		// look for one bulk in, one bulk out
-		const struct libusb_endpoint_descriptor *e0 = id->endpoint + 0;
-		const struct libusb_endpoint_descriptor *e1 = id->endpoint + 1;
-		if ((e0->bmAttributes & 3) != LIBUSB_ENDPOINT_TRANSFER_TYPE_BULK) {
+		if ((id->bNumEndpoints != 2) && (id->bNumEndpoints != 3)) {
+			// must have two endpoints (plus optional SWO)
 			continue;
 		}
-		if ((e1->bmAttributes & 3) != LIBUSB_ENDPOINT_TRANSFER_TYPE_BULK) {
-			continue;
+		// look for one bulk in, one bulk out, and maybe another
+		// bulk in (CMSIS-DAP v2 puts the SWO trace endpoint last)
+		uint8_t in = 0, out = 0, swo = 0;
+		for (unsigned n = 0; n < id->bNumEndpoints; n++) {
+			const struct libusb_endpoint_descriptor *e = id->endpoint + n;
+			if ((e->bmAttributes & 3) != LIBUSB_ENDPOINT_TRANSFER_TYPE_BULK) {
+				in = 0;
+				break;
+			}
+			if (!(e->bEndpointAddress & 0x80)) {
+				if (out) {
+					in = 0;
+					break;
+				}
+				out = e->bEndpointAddress;
+			} else if (in == 0) {
+				in = e->bEndpointAddress;
+			} else {
+				swo = e->bEndpointAddress;
+			}
 		}
-		if ((e0->bEndpointAddress & 0x80) &&
-		    (!(e1->bEndpointAddress & 0x80))) {
-			*eptin = e0->bEndpointAddress;
-			*eptout = e1->bEndpointAddress;
+		if (in && out) {
+			*eptin = in;
+			*eptout = out;
+			*eptswo = swo;
 			goto match;
-		} else if ((e1->bEndpointAddress & 0x80) &&
-			   (!(e0->bEndpointAddress & 0x80))) {
-			*eptin = e1->bEndpointAddress;
-			*eptout = e0->bEndpointAddress;
-			goto match;
-		} else {
-			continue;
 		}
 	}
 	return -1;
@@ -81,14 +102,23 @@ match:
 	return 0;
 }
 
+static void usb_free_rings(usb_handle *usb) {
+	for (unsigned p = 0; p < USB_PIPES; p++) {
+		for (unsigned n = 0; n < USB_RING_SIZE; n++) {
+			// safe on NULL
+			libusb_free_transfer(usb->ring[p].xfer[n]);
+		}
+	}
+}
+
 usb_handle *usb_try_open(libusb_device* dev, const char* sn,
 			unsigned isn, unsigned iifc,
-			unsigned ino, unsigned ei, unsigned eo) {
+			unsigned ino, unsigned ei, unsigned eo, unsigned es) {
 	unsigned char text[256];
 	usb_handle *usb;
 	int r;
 
-	usb = malloc(sizeof(usb_handle));
+	usb = calloc(1, sizeof(usb_handle));
 	if (usb == 0) {
 		return NULL;
 	}
@@ -123,6 +153,20 @@ usb_handle *usb_try_open(libusb_device* dev, const char* sn,
 
 	usb->ei = ei;
 	usb->eo = eo;
+	usb->ring[USB_OUT].ept = eo;
+	usb->ring[USB_IN].ept = ei;
+	usb->ring[USB_SWO].ept = es;
+	usb->ring[USB_OUT].timeout = 5000;
+	usb->ring[USB_IN].timeout = 5000;
+	// trace data arrives whenever the target sends it
+	usb->ring[USB_SWO].timeout = 0;
+	for (unsigned p = 0; p < USB_PIPES; p++) {
+		for (unsigned n = 0; n < USB_RING_SIZE; n++) {
+			if ((usb->ring[p].xfer[n] = libusb_alloc_transfer(0)) == NULL) {
+				goto fail;
+			}
+		}
+	}
 
 	// This causes problems on re-attach.  Maybe need for OSX?
 	// On Linux it's completely happy without us explicitly setting a configuration.
@@ -143,6 +187,7 @@ usb_handle *usb_try_open(libusb_device* dev, const char* sn,
 	return usb;
 
 fail:
+	usb_free_rings(usb);
 	libusb_close(usb->dev);
 	free(usb);
 	return NULL;
@@ -162,6 +207,18 @@ static int read_sysfs(const char* path, char* text, int len) {
 }
 
 static libusb_context *usb_ctx = NULL;
+static pthread_t usb_event_thread;
+static int usb_event_thread_running = 0;
+
+// libusb only delivers completions from within an event handling
+// call, so keep one running in the background for async transfers
+static void* usb_event_loop(void* arg) {
+	for (;;) {
+		struct timeval tv = { .tv_sec = 1, .tv_usec = 0 };
+		libusb_handle_events_timeout_completed(usb_ctx, &tv, NULL);
+	}
+	return NULL;
+}
 
 usb_handle *usb_open(unsigned vid, unsigned pid, const char* sn) {
 	usb_handle *usb = NULL;
@@ -173,7 +230,7 @@ usb_handle *usb_open(unsigned vid, unsigned pid, const char* sn) {
 		}
 	}
 
-	uint8_t ino, eo, ei, iifc;
+	uint8_t ino, eo, ei, es, iifc;
 	libusb_device** list;
 	int count = libusb_get_device_list(usb_ctx, &list);
 	for (int n = 0; n < count; n++) {
@@ -203,7 +260,7 @@ usb_handle *usb_open(unsigned vid, unsigned pid, const char* sn) {
 		if (libusb_get_active_config_descriptor(list[n], &cd) != 0) {
 			continue;
 		}
-		int r = get_vendor_bulk_ifc(cd, &iifc, &ino, &ei, &eo);
+		int r = get_vendor_bulk_ifc(cd, &iifc, &ino, &ei, &eo, &es);
 		libusb_free_config_descriptor(cd);
 		if (r != 0) {
 			continue;
@@ -256,17 +313,38 @@ usb_handle *usb_open(unsigned vid, unsigned pid, const char* sn) {
 			iifc = 0;
 		}
 
-		if ((usb = usb_try_open(list[n], sn, isn, iifc, ino, ei, eo)) != NULL) {
+		if ((usb = usb_try_open(list[n], sn, isn, iifc, ino, ei, eo, es)) != NULL) {
 			break;
 		}
 	}
 	if (count >= 0) {
 		libusb_free_device_list(list, 1);
 	}
+	if ((usb != NULL) && !usb_event_thread_running) {
+		if (pthread_create(&usb_event_thread, NULL, usb_event_loop, NULL) == 0) {
+			pthread_detach(usb_event_thread);
+			usb_event_thread_running = 1;
+		} else {
+			fprintf(stderr, "usb: cannot start event thread\n");
+			usb_close(usb);
+			usb = NULL;
+		}
+	}
 	return usb;
 }
 
 void usb_close(usb_handle *usb) {
+	// cancel anything outstanding and wait for the cancellations
+	// to be delivered before the transfers are released
+	for (unsigned p = 0; p < USB_PIPES; p++) {
+		usb_cancel(usb, p);
+	}
+	for (unsigned p = 0; p < USB_PIPES; p++) {
+		while (usb->ring[p].count > 0) {
+			usb_reap(usb, p);
+		}
+	}
+	usb_free_rings(usb);
 	libusb_close(usb->dev);
 	free(usb);
 }
@@ -315,3 +393,107 @@ int usb_write(usb_handle *usb, const void *data, int len) {
 	return xfer;
 }
 
+
+static void LIBUSB_CALL usb_complete(struct libusb_transfer *xfer) {
+	pthread_mutex_lock(&usb_lock);
+	*((int*) xfer->user_data) = 1;
+	pthread_cond_broadcast(&usb_cond);
+	pthread_mutex_unlock(&usb_lock);
+}
+
+int usb_submit(usb_handle *usb, unsigned pipe, void *data, int len) {
+	if (usb == NULL) {
+		return LIBUSB_ERROR_NO_DEVICE;
+	}
+	if (pipe >= USB_PIPES) {
+		return LIBUSB_ERROR_INVALID_PARAM;
+	}
+	usb_ring *ring = usb->ring + pipe;
+	if (ring->ept == 0) {
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+	}
+	if (ring->count == USB_RING_SIZE) {
+		return LIBUSB_ERROR_BUSY;
+	}
+	unsigned i = (ring->head + ring->count) % USB_RING_SIZE;
+	struct libusb_transfer *xfer = ring->xfer[i];
+	ring->done[i] = 0;
+	libusb_fill_bulk_transfer(xfer, usb->dev, ring->ept, data, len,
+		usb_complete, ring->done + i, ring->timeout);
+	int r = libusb_submit_transfer(xfer);
+	if (r < 0) {
+		return r;
+	}
+	// usb_cancel() may be walking the ring from another thread
+	pthread_mutex_lock(&usb_lock);
+	ring->count++;
+	pthread_mutex_unlock(&usb_lock);
+	return 0;
+}
+
+int usb_reap(usb_handle *usb, unsigned pipe) {
+	if (usb == NULL) {
+		return LIBUSB_ERROR_NO_DEVICE;
+	}
+	if (pipe >= USB_PIPES) {
+		return LIBUSB_ERROR_INVALID_PARAM;
+	}
+	usb_ring *ring = usb->ring + pipe;
+	if (ring->count == 0) {
+		return LIBUSB_ERROR_NOT_FOUND;
+	}
+	unsigned i = ring->head;
+	struct libusb_transfer *xfer = ring->xfer[i];
+	pthread_mutex_lock(&usb_lock);
+	while (!ring->done[i]) {
+		pthread_cond_wait(&usb_cond, &usb_lock);
+	}
+	ring->head = (i + 1) % USB_RING_SIZE;
+	ring->count--;
+	pthread_mutex_unlock(&usb_lock);
+	switch (xfer->status) {
+	case LIBUSB_TRANSFER_COMPLETED:
+		return xfer->actual_length;
+	case LIBUSB_TRANSFER_TIMED_OUT:
+		return LIBUSB_ERROR_TIMEOUT;
+	case LIBUSB_TRANSFER_CANCELLED:
+		return LIBUSB_ERROR_INTERRUPTED;
+	case LIBUSB_TRANSFER_STALL:
+		return LIBUSB_ERROR_PIPE;
+	case LIBUSB_TRANSFER_NO_DEVICE:
+		return LIBUSB_ERROR_NO_DEVICE;
+	case LIBUSB_TRANSFER_OVERFLOW:
+		return LIBUSB_ERROR_OVERFLOW;
+	default:
+		return LIBUSB_ERROR_IO;
+	}
+}
+
+int usb_pending(usb_handle *usb, unsigned pipe) {
+	if ((usb == NULL) || (pipe >= USB_PIPES)) {
+		return 0;
+	}
+	return usb->ring[pipe].count;
+}
+
+void usb_cancel(usb_handle *usb, unsigned pipe) {
+	if ((usb == NULL) || (pipe >= USB_PIPES)) {
+		return;
+	}
+	usb_ring *ring = usb->ring + pipe;
+	pthread_mutex_lock(&usb_lock);
+	for (unsigned n = 0; n < ring->count; n++) {
+		unsigned i = (ring->head + n) % USB_RING_SIZE;
+		if (!ring->done[i]) {
+			libusb_cancel_transfer(ring->xfer[i]);
+		}
+	}
+	pthread_mutex_unlock(&usb_lock);
+}
+
+int usb_has_pipe(usb_handle *usb, unsigned pipe) {
+	if ((usb == NULL) || (pipe >= USB_PIPES)) {
+		return 0;
+	}
+	return usb->ring[pipe].ept != 0;
+}
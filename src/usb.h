@@ -17,4 +17,38 @@ int usb_read_forever(usb_handle *usb, void *data, int len);
 int usb_write(usb_handle *usb, const void *data, int len);
 int usb_ctrl(usb_handle *usb, void *data,
 	uint8_t typ, uint8_t req, uint16_t val, uint16_t idx, uint16_t len);
+
+/* asynchronous bulk api
+ *
+ * Up to USB_RING_SIZE transfers may be outstanding on each pipe.
+ * usb_submit() queues a transfer and returns immediately.  The
+ * buffer must remain valid until the transfer is reaped.
+ * usb_reap() waits for the oldest transfer on the pipe and returns
+ * its actual length (or a negative error).  Completions are handled
+ * by a background event thread.
+ *
+ * Do not mix sync reads/writes with async ones on a pipe that has
+ * outstanding transfers.
+ *
+ * USB_SWO is the optional third (bulk in) endpoint a CMSIS-DAP v2
+ * probe streams SWO trace data on.  Transfers on it never time out.
+ * Submitting on it fails with LIBUSB_ERROR_NOT_SUPPORTED if the
+ * probe does not have one.
+ *
+ * usb_cancel() cancels every transfer outstanding on a pipe; they
+ * must still be reaped.  It, unlike the rest of this api, may be
+ * used by a thread other than the one submitting and reaping.
+ */
+
+#define USB_OUT 0
+#define USB_IN 1
+#define USB_SWO 2
+#define USB_PIPES 3
+#define USB_RING_SIZE 16
+
+int usb_submit(usb_handle *usb, unsigned pipe, void *data, int len);
+int usb_reap(usb_handle *usb, unsigned pipe);
+int usb_pending(usb_handle *usb, unsigned pipe);
+void usb_cancel(usb_handle *usb, unsigned pipe);
+int usb_has_pipe(usb_handle *usb, unsigned pipe);
 #endif
@@ -10,6 +10,7 @@
 #include <pthread.h>
 #include <sys/eventfd.h>
 #include <poll.h>
+#include <sys/time.h>
 
 #include "xdebug.h"
 #include "tui.h"
@@ -182,22 +183,63 @@ static volatile int busy = 0;
 static int efd = -1;
 static char linebuf[1024];
 
+static uint64_t now(void) {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return ((uint64_t) tv.tv_sec) * 1000000ULL + tv.tv_usec;
+}
+
+// SWO capture without a trace endpoint polls faster
+static int transport_periodic(DC* dc) {
+	int ms = dc_periodic(dc);
+	return (ms < 10) ? 10 : ms;
+}
+
+// the transport, the RAM console, and the gdb server each say
+// when they next want to run, and requests are handled in between
+static struct {
+	int (*periodic)(DC* dc);
+	uint64_t next;
+} timers[] = {
+	{ transport_periodic, 0 },
+	{ rtt_periodic, 0 },
+	{ gdb_server_periodic, 0 },
+};
+#define TIMER_GDB 2
+#define TIMERS (sizeof(timers) / sizeof(timers[0]))
+
 static void *work_thread(void* arg) {
-	struct pollfd pfd = {
-		.fd = efd,
-		.events = POLLIN,
+	struct pollfd pfd[2] = {
+		{ .fd = efd, .events = POLLIN, },
+		{ .fd = -1, .events = POLLIN, },
 	};
-	int timeout = 250;
+	for (unsigned n = 0; n < TIMERS; n++) {
+		timers[n].next = now() + 250000;
+	}
 	while (running) {
-		int r = poll(&pfd, 1, timeout);
+		uint64_t t = now();
+		uint64_t next = t + 1000000;
+		for (unsigned n = 0; n < TIMERS; n++) {
+			if (t >= timers[n].next) {
+				timers[n].next = t + timers[n].periodic(dc) * 1000;
+			}
+			if (timers[n].next < next) {
+				next = timers[n].next;
+			}
+		}
+		t = now();
+		int timeout = (next > t) ? ((next - t + 999) / 1000) : 0;
+		pfd[1].fd = gdb_server_fd();
+		int r = poll(pfd, 2, timeout);
 		if (r < 0) {
 			exit(-1);
 		}
-		if (r == 0) {
-			timeout = dc_periodic(dc);
-			if (timeout < 100) {
-				timeout = 100;
-			}
+		if (pfd[1].revents) {
+			gdb_server_io(dc);
+			// it may have resumed the target, and be waiting on a halt
+			timers[TIMER_GDB].next = 0;
+		}
+		if (!pfd[0].revents) {
 			continue;
 		}
 		uint64_t n;
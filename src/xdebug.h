@@ -35,6 +35,7 @@ int cmd_argc(CC* cc);
 
 typedef struct debug_context DC;
 void debugger_command(DC* dc, CC* cc);
+void debug_command(char* line);
 void debugger_exit(void);
 
 // commands.c
@@ -51,6 +52,27 @@ int do_setarch(DC* dc, CC* cc);
 int do_flash(DC* dc, CC* cc);
 int do_erase(DC* dc, CC* cc);
 const char* get_arch_name(void);
+int get_flash_region(uint32_t* addr, uint32_t* size);
+struct flash_region;
+int get_flash_map(DC* dc, struct flash_region* map, unsigned max);
+int flash_image(DC* dc, uint32_t addr, void* data, uint32_t data_sz);
+
+// commands-profile.c
+int do_profile(DC* dc, CC* cc);
+
+// commands-swo.c
+int do_swo(DC* dc, CC* cc);
+
+// gdb-server.c
+int do_gdbserver(DC* dc, CC* cc);
+int gdb_server_fd(void);
+void gdb_server_io(DC* dc);
+int gdb_server_periodic(DC* dc);
+
+// commands-rtt.c
+int do_rtt(DC* dc, CC* cc);
+int do_wconsole(DC* dc, CC* cc);
+int rtt_periodic(DC* dc);
 
 void *load_file(const char* fn, size_t *sz);
 void *get_builtin_file(const char *name, size_t *sz);